@@ -4,8 +4,92 @@
 
 typedef int (*ASS_FontCallback)(const wchar_t *font, size_t cch, void *arg);
 
+typedef int (*ASS_FontCallbackU8)(const char *font, size_t cch, void *arg);
+
+typedef enum {
+  PST_UNKNOWN = 0,
+  // PST_INFO,
+  PST_STYLES,
+  PST_EVENTS,
+  // PST_FONTS
+} ASS_ParserState;
+
+typedef enum {
+  TRACK_TYPE_UNKNOWN = 0,
+  TRACK_TYPE_ASS,
+  TRACK_TYPE_SSA
+} ASS_TrackType;
+
+typedef struct {
+  ASS_ParserState state;
+  ASS_TrackType track_type;
+  int format_col;  // Fontname or Text of the section, -1 if there's none
+
+  ASS_FontCallback callback;
+  void *cb_arg;
+} ASS_Track;
+
+// parses a subtitle fed in chunks of any size. lines are carried over in buf
+// of cap + 1 chars, longer ones are parsed by their beginning, and Text of a
+// Dialogue line block by block.
+typedef struct {
+  ASS_Track track;
+  int mode;
+  wchar_t *buf;
+  size_t cap;
+  size_t len;
+} ASS_Parser;
+
 void ass_process_data(
     const wchar_t *data,
     size_t cch,
     ASS_FontCallback cb,
     void *arg);
+
+void ass_parser_begin(
+    ASS_Parser *p,
+    wchar_t *buf,
+    size_t cap,
+    ASS_FontCallback cb,
+    void *arg);
+
+void ass_parser_feed(ASS_Parser *p, const wchar_t *data, size_t cch);
+
+// parses the last line, if it's not terminated
+void ass_parser_end(ASS_Parser *p);
+
+// the same parser on UTF-8, see ass_parser_u8.c
+
+typedef struct {
+  ASS_ParserState state;
+  ASS_TrackType track_type;
+  int format_col;
+
+  ASS_FontCallbackU8 callback;
+  void *cb_arg;
+} ASS_TrackU8;
+
+typedef struct {
+  ASS_TrackU8 track;
+  int mode;
+  char *buf;
+  size_t cap;
+  size_t len;
+} ASS_ParserU8;
+
+void ass_process_data_u8(
+    const char *data,
+    size_t cch,
+    ASS_FontCallbackU8 cb,
+    void *arg);
+
+void ass_parser_begin_u8(
+    ASS_ParserU8 *p,
+    char *buf,
+    size_t cap,
+    ASS_FontCallbackU8 cb,
+    void *arg);
+
+void ass_parser_feed_u8(ASS_ParserU8 *p, const char *data, size_t cch);
+
+void ass_parser_end_u8(ASS_ParserU8 *p);
@@ -0,0 +1,408 @@
+// the parser of ass_parser.h on ASS_CHAR, included by ass_parser.c for
+// wchar_t and by ass_parser_u8.c for UTF-8. ASS_STR makes a literal of
+// ASS_CHAR.
+
+typedef struct {
+  ASS_Range Text;
+} ASS_Event;
+
+// columns by the spec, without a Format line
+#define kStylesFontCol 1
+#define kEventsTextCol 9
+
+typedef enum {
+  PARSER_LINE = 0,  // buf holds the partial line
+  PARSER_TEXT,      // in Text of an overlong line, buf holds the open block
+  PARSER_SKIP       // the rest of an overlong line is ignored
+} ASS_ParserMode;
+
+static void fire_font_cb(ASS_Track *track, ASS_Range *font) {
+  if (track->callback) {
+    const ASS_CHAR *begin = ass_skip_spaces(font->begin, font->end);
+    track->callback(begin, font->end - begin, track->cb_arg);
+  }
+}
+
+static int next_tok(ASS_Range *input, ASS_Range *tok) {
+  if (input->begin == input->end) {
+    return 0;
+  }
+  *tok = (ASS_Range){.begin = input->begin, .end = input->begin};
+  while (tok->end != input->end && tok->end[0] != ',') {
+    ++tok->end;
+  }
+  if (tok->end[0] == ',') {
+    input->begin = tok->end + 1;
+  } else {
+    input->begin = tok->end;
+  }
+  ass_trim(tok);
+
+  return 1;
+}
+
+// the column n of line, trimmed
+static int nth_tok(ASS_Range *line, int n, ASS_Range *tok) {
+  if (n < 0)
+    return 0;
+  for (; n; n--) {
+    const ASS_CHAR *comma = ass_find_any(line->begin, line->end, ',', ',');
+    if (comma == line->end)
+      return 0;
+    line->begin = comma + 1;
+  }
+  return next_tok(line, tok);
+}
+
+// index of the column of a Format line, -1 if it's absent. fallback if the
+// line is empty.
+static int format_col(
+    const ASS_CHAR *begin,
+    const ASS_CHAR *end,
+    const ASS_CHAR *name,
+    size_t len,
+    int fallback) {
+  ASS_Range format = {.begin = begin, .end = end};
+  ASS_Range tag;
+  ass_trim(&format);
+  if (format.begin == format.end)
+    return fallback;
+  for (int i = 0; next_tok(&format, &tag); i++) {
+    if ((size_t)(tag.end - tag.begin) == len &&
+        ass_strncasecmp(tag.begin, name, len) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static int test_tag(
+    const ASS_CHAR *p,
+    const ASS_CHAR *end,
+    const ASS_CHAR *tag,
+    size_t len,
+    ASS_Range *arg) {
+  if (end >= p + len && ass_strncmp(p, tag, len) == 0) {
+    *arg = (ASS_Range){.begin = p + len, .end = end};
+    return 1;
+  }
+  return 0;
+}
+
+static const ASS_CHAR *parse_tags(
+    ASS_Track *track,
+    const ASS_CHAR *p,
+    const ASS_CHAR *end,
+    int nested) {
+  const ASS_CHAR *q;
+  for (; p != end; p = q) {
+    p = ass_find_any(p, end, '\\', '\\');
+    if (*p != '\\')
+      break;
+    ++p;
+    if (p != end)
+      p = ass_skip_spaces(p, end);
+
+    q = p;
+    while (q != end && *q != '(' && *q != '\\')
+      ++q;
+    if (q == p)
+      continue;
+
+    const ASS_CHAR *name_end = q;
+
+    // Split parenthesized arguments
+    ASS_Range first_arg = {NULL, NULL};
+    if (q != end && *q == '(') {
+      ++q;
+      while (1) {
+        if (q != end)
+          q = ass_skip_spaces(q, end);
+        const ASS_CHAR *r = q;
+        while (r != end && *r != ',' && *r != '\\' && *r != ')')
+          ++r;
+
+        if (r != end && *r == ',') {
+          // push_arg(args, &argc, q, r);
+          q = r + 1;
+        } else {
+          while (r != end && *r != ')')
+            ++r;
+          // push_arg(args, &argc, q, r);
+          if (first_arg.begin == NULL) {
+            first_arg = (ASS_Range){q, r};
+          }
+          q = r;
+          if (q != end)
+            ++q;
+          break;
+        }
+      }
+    }
+
+    ASS_Range arg;
+    if (test_tag(p, name_end, ASS_STR("fn"), 2, &arg)) {
+      if (ass_strncmp(ASS_STR("0"), arg.begin, arg.end - arg.begin) == 0) {
+        // restore?
+      } else {
+        if (first_arg.begin)
+          fire_font_cb(track, &first_arg);
+        else 
+          fire_font_cb(track, &arg);
+      }
+    }
+  }
+  return p;
+}
+
+// returns the '{' left open at the end of text, NULL if there's none
+static const ASS_CHAR *parse_events(ASS_Track *track, ASS_Event *event) {
+  if (event->Text.begin == NULL) {
+    return NULL;
+  }
+
+  const ASS_CHAR *p = event->Text.begin;
+  const ASS_CHAR *ep = event->Text.end;
+  const ASS_CHAR *q;
+
+  while ((p = ass_strnchr(p, '{', ep - p)) != NULL) {
+    if ((q = ass_strnchr(p, '}', ep - p)) == NULL)
+      return p;
+    p = parse_tags(track, p, q, 0);
+    ++p;
+  }
+  return NULL;
+}
+
+// 0 if line ends before Text
+static int process_event_tail(
+    ASS_Track *track,
+    ASS_Range *line,
+    const ASS_CHAR **open) {
+  ASS_Range tok[1];
+  ASS_Event event = {0};
+
+  if (nth_tok(line, track->format_col, tok)) {
+    // till the end
+    tok->end = line->end;
+    event.Text = *tok;
+  }
+  *open = parse_events(track, &event);
+  return event.Text.begin != NULL;
+}
+
+static void
+process_styles(ASS_Track *track, const ASS_CHAR *begin, const ASS_CHAR *end) {
+  ASS_Range line[1], tok[1];
+  *line = (ASS_Range){.begin = begin, .end = end};
+
+  if (nth_tok(line, track->format_col, tok)) {
+    fire_font_cb(track, tok);
+  }
+}
+
+static void process_styles_line(
+    ASS_Track *track,
+    const ASS_CHAR *begin,
+    const ASS_CHAR *end) {
+  if (!ass_strncmp(begin, ASS_STR("Format:"), 7)) {
+    track->format_col =
+        format_col(begin + 7, end, ASS_STR("fontname"), 8, kStylesFontCol);
+  } else if (!ass_strncmp(begin, ASS_STR("Style:"), 6)) {
+    process_styles(track, ass_skip_spaces(begin + 6, end), end);
+  }
+}
+
+static void process_events_line(
+    ASS_Track *track,
+    const ASS_CHAR *begin,
+    const ASS_CHAR *end) {
+  if (!ass_strncmp(begin, ASS_STR("Format:"), 7)) {
+    track->format_col =
+        format_col(begin + 7, end, ASS_STR("text"), 4, kEventsTextCol);
+  } else if (!ass_strncmp(begin, ASS_STR("Dialogue:"), 9)) {
+    ASS_Range range = {.begin = ass_skip_spaces(begin + 9, end), .end = end};
+    const ASS_CHAR *open;
+    process_event_tail(track, &range, &open);
+  }
+}
+
+static void
+process_line(ASS_Track *track, const ASS_CHAR *begin, const ASS_CHAR *end) {
+  int is_content = 0;
+
+  if (!ass_strncasecmp(begin, ASS_STR("[v4 styles]"), 11)) {
+    track->state = PST_STYLES;
+    track->track_type = TRACK_TYPE_SSA;
+  } else if (!ass_strncasecmp(begin, ASS_STR("[v4+ styles]"), 12)) {
+    track->state = PST_STYLES;
+    track->track_type = TRACK_TYPE_ASS;
+  } else if (!ass_strncasecmp(begin, ASS_STR("[events]"), 8)) {
+    track->state = PST_EVENTS;
+  } else if (begin[0] == '[') {
+    track->state = PST_UNKNOWN;
+  } else {
+    is_content = 1;
+  }
+
+  if (!is_content) {
+    // the columns are looked up once per Format line
+    track->format_col =
+        track->state == PST_STYLES ? kStylesFontCol : kEventsTextCol;
+  } else {
+    switch (track->state) {
+    case PST_STYLES:
+      process_styles_line(track, begin, end);
+      break;
+    case PST_EVENTS:
+      process_events_line(track, begin, end);
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+void ass_process_data(
+    const ASS_CHAR *data,
+    size_t cch,
+    ASS_FontCallback cb,
+    void *arg) {
+  ASS_Track track = {.callback = cb, .cb_arg = arg};
+  const ASS_CHAR *p = data;
+  const ASS_CHAR *eos = data + cch;
+  while (p != eos) {
+    // skip blank lines
+    while (p != eos && ass_is_eol(*p))
+      ++p;
+    // find end of the line
+    const ASS_CHAR *q = ass_find_any(p, eos, '\r', '\n');
+
+    process_line(&track, p, q);
+    p = q;
+  }
+}
+
+void ass_parser_begin(
+    ASS_Parser *p,
+    ASS_CHAR *buf,
+    size_t cap,
+    ASS_FontCallback cb,
+    void *arg) {
+  *p = (ASS_Parser){.track = {.callback = cb, .cb_arg = arg},
+                    .buf = buf,
+                    .cap = cap};
+}
+
+// appends to buf, the rest is dropped once it's full
+static void
+parser_push(ASS_Parser *p, const ASS_CHAR *begin, const ASS_CHAR *end) {
+  for (; begin != end && p->len != p->cap; begin++)
+    p->buf[p->len++] = *begin;
+}
+
+// buf is full before the line ends
+static void parser_overflow(ASS_Parser *p) {
+  const ASS_CHAR *begin = p->buf;
+  const ASS_CHAR *end = p->buf + p->len;
+  p->buf[p->len] = 0;
+  p->len = 0;
+  p->mode = PARSER_SKIP;
+
+  if (p->track.state != PST_EVENTS ||
+      ass_strncmp(begin, ASS_STR("Dialogue:"), 9)) {
+    // the columns of interest are near the beginning
+    process_line(&p->track, begin, end);
+    return;
+  }
+  ASS_Range range = {.begin = ass_skip_spaces(begin + 9, end), .end = end};
+  const ASS_CHAR *open;
+  if (process_event_tail(&p->track, &range, &open)) {
+    // keep parsing Text without the line
+    p->mode = PARSER_TEXT;
+    if (open)
+      parser_push(p, open, end);
+  }
+}
+
+// the part of Text in [begin, end) of an overlong line
+static void
+parser_text(ASS_Parser *p, const ASS_CHAR *begin, const ASS_CHAR *end) {
+  while (begin != end) {
+    if (p->len == 0) {
+      begin = ass_find_any(begin, end, '{', '{');
+      if (begin == end)
+        break;
+    }
+    const ASS_CHAR *q = ass_find_any(begin + (p->len == 0), end, '}', '}');
+    parser_push(p, begin, q);
+    if (q == end)
+      break;
+    p->buf[p->len] = '}';
+    parse_tags(&p->track, p->buf, p->buf + p->len, 0);
+    p->len = 0;
+    begin = q + 1;
+  }
+}
+
+void ass_parser_feed(ASS_Parser *p, const ASS_CHAR *data, size_t cch) {
+  const ASS_CHAR *eos = data + cch;
+  while (data != eos) {
+    const ASS_CHAR *q;
+    switch (p->mode) {
+    case PARSER_LINE:
+      if (p->len == 0) {
+        // skip blank lines
+        while (data != eos && ass_is_eol(*data))
+          ++data;
+        q = ass_find_any(data, eos, '\r', '\n');
+        if (q != eos) {
+          // the whole line is in data
+          process_line(&p->track, data, q);
+          data = q;
+          break;
+        }
+      } else {
+        q = ass_find_any(data, eos, '\r', '\n');
+      }
+      if ((size_t)(q - data) > p->cap - p->len) {
+        const size_t room = p->cap - p->len;
+        parser_push(p, data, data + room);
+        data += room;
+        parser_overflow(p);
+        break;
+      }
+      parser_push(p, data, q);
+      data = q;
+      if (q != eos) {
+        p->buf[p->len] = 0;
+        process_line(&p->track, p->buf, p->buf + p->len);
+        p->len = 0;
+      }
+      break;
+    case PARSER_TEXT:
+      q = ass_find_any(data, eos, '\r', '\n');
+      parser_text(p, data, q);
+      data = q;
+      if (q != eos) {
+        // a block still open is ignored, as with a whole line
+        p->len = 0;
+        p->mode = PARSER_LINE;
+      }
+      break;
+    case PARSER_SKIP:
+      data = ass_find_any(data, eos, '\r', '\n');
+      if (data != eos)
+        p->mode = PARSER_LINE;
+      break;
+    }
+  }
+}
+
+void ass_parser_end(ASS_Parser *p) {
+  if (p->mode == PARSER_LINE && p->len) {
+    p->buf[p->len] = 0;
+    process_line(&p->track, p->buf, p->buf + p->len);
+  }
+  p->len = 0;
+  p->mode = PARSER_LINE;
+}
@@ -0,0 +1,22 @@
+#include "ass_parser.h"
+#include "ass_string.h"
+
+// ass_parser_tpl.h with the names of ass_parser.h and ass_string.h suffixed
+// by _u8. font names are passed in UTF-8, as they're found.
+#define ASS_CHAR char
+#define ASS_STR(s) s
+#define ASS_Range ASS_RangeU8
+#define ASS_Track ASS_TrackU8
+#define ASS_Parser ASS_ParserU8
+#define ASS_FontCallback ASS_FontCallbackU8
+#define ass_trim ass_trim_u8
+#define ass_skip_spaces ass_skip_spaces_u8
+#define ass_strncmp ass_strncmp_u8
+#define ass_strncasecmp ass_strncasecmp_u8
+#define ass_strnchr ass_strnchr_u8
+#define ass_find_any ass_find_any_u8
+#define ass_process_data ass_process_data_u8
+#define ass_parser_begin ass_parser_begin_u8
+#define ass_parser_feed ass_parser_feed_u8
+#define ass_parser_end ass_parser_end_u8
+#include "ass_parser_tpl.h"
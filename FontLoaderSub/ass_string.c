@@ -1,71 +1,54 @@
 #include "ass_string.h"
 
-int ass_is_space(int ch) {
-  return ch == ' ' || ch == '\t';
-}
+#if defined(_M_X64) || defined(_M_IX86_FP) && _M_IX86_FP >= 2
+#include <emmintrin.h>
+#include <intrin.h>
+#define ASS_SSE2
+#endif
 
-void ass_trim(ASS_Range *r) {
-  if (!r || !r->begin || !r->end || r->begin == r->end)
-    return;
-  for (; r->begin != r->end && ass_is_space(*r->begin); r->begin++) {
-    // nop;
-  }
-  if (r->begin == r->end)
-    return;
-  for (; ass_is_space(r->end[-1]); r->end--) {
-    // nop;
-  }
-}
+#define ASS_CHAR wchar_t
+#include "ass_string_tpl.h"
 
-const wchar_t *ass_skip_spaces(const wchar_t *p, const wchar_t *end) {
-  for (; ass_is_space(*p) && p != end; p++) {
-    // nop
-  }
-  return p;
+int ass_is_space(int ch) {
+  return ch == ' ' || ch == '\t';
 }
 
 int ass_is_eol(int ch) {
   return ch == '\r' || ch == '\n';
 }
 
-int ass_strncmp(const wchar_t *s1, const wchar_t *s2, size_t cch) {
-  wchar_t a, b;
-  const wchar_t *last = s2 + cch;
-
-  do {
-    a = *s1++;
-    b = *s2++;
-  } while (s2 != last && a && a == b);
-
-  return a - b;
-}
-
-static wchar_t ass_to_lower(wchar_t ch) {
-  if (L'A' <= ch && ch <= L'Z')
-    return ch - L'A' + L'a';
-  return ch;
-}
-
-int ass_strncasecmp(const wchar_t *s1, const wchar_t *s2, size_t cch) {
-  // assume wchar_t is unsigned short
-  wchar_t a, b;
-  const wchar_t *last = s2 + cch;
-
-  do {
-    a = ass_to_lower(*s1++);
-    b = ass_to_lower(*s2++);
-  } while (s2 != last && a && a == b);
-
-  return a - b;
+#ifdef ASS_SSE2
+// 2 bits per char of s[0..8), set if it's c0 or c1
+static unsigned ass_match8(const wchar_t *s, __m128i c0, __m128i c1) {
+  const __m128i v = _mm_loadu_si128((const __m128i *)s);
+  const __m128i m0 = _mm_cmpeq_epi16(v, c0);
+  const __m128i m1 = _mm_cmpeq_epi16(v, c1);
+  return _mm_movemask_epi8(_mm_or_si128(m0, m1));
 }
+#endif
 
-const wchar_t *ass_strnchr(const wchar_t *s, wchar_t ch, size_t cch) {
-  const wchar_t *last = s + cch;
-
-  for (; s != last && *s != ch; s++) {
+const wchar_t *
+ass_find_any(const wchar_t *s, const wchar_t *end, wchar_t c0, wchar_t c1) {
+#ifdef ASS_SSE2
+  const __m128i v0 = _mm_set1_epi16(c0);
+  const __m128i v1 = _mm_set1_epi16(c1);
+  unsigned long i;
+  // nothing is read past end, it may be the end of a mapped file
+  for (; end - s >= 16; s += 16) {
+    const unsigned m = ass_match8(s, v0, v1) | ass_match8(s + 8, v0, v1) << 16;
+    if (_BitScanForward(&i, m))
+      return s + i / 2;
+  }
+  if (end - s >= 8) {
+    if (_BitScanForward(&i, ass_match8(s, v0, v1)))
+      return s + i / 2;
+    s += 8;
+  }
+#endif
+  for (; s != end && *s != c0 && *s != c1; s++) {
     // nop
   }
-  return s == last ? NULL : s;
+  return s;
 }
 
 size_t ass_strlen(const wchar_t *str) {
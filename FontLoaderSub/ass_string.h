@@ -7,6 +7,13 @@ typedef struct _ASS_Range {
   const wchar_t *end;
 } ASS_Range;
 
+typedef struct _ASS_RangeU8 {
+  const char *begin;
+  const char *end;
+} ASS_RangeU8;
+
+int ass_is_space(int ch);
+
 void ass_trim(ASS_Range *r);
 
 const wchar_t *ass_skip_spaces(const wchar_t *p, const wchar_t *end);
@@ -26,6 +33,25 @@ int ass_strncasecmp(const wchar_t *s1, const wchar_t *s2, size_t cch);
 
 const wchar_t *ass_strnchr(const wchar_t *s, wchar_t ch, size_t cch);
 
+// first c0 or c1 in [s, end), end if there's none. vectorized where SSE2 is
+// available, as subtitles are mostly scanned by it.
+const wchar_t *
+ass_find_any(const wchar_t *s, const wchar_t *end, wchar_t c0, wchar_t c1);
+
 size_t ass_strlen(const wchar_t *str);
 
 size_t ass_strnlen(const wchar_t *str, size_t n);
+
+// the same helpers on UTF-8, see ass_string_u8.c
+
+void ass_trim_u8(ASS_RangeU8 *r);
+
+const char *ass_skip_spaces_u8(const char *p, const char *end);
+
+int ass_strncmp_u8(const char *s1, const char *s2, size_t cch);
+
+int ass_strncasecmp_u8(const char *s1, const char *s2, size_t cch);
+
+const char *ass_strnchr_u8(const char *s, char ch, size_t cch);
+
+const char *ass_find_any_u8(const char *s, const char *end, char c0, char c1);
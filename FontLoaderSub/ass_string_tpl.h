@@ -0,0 +1,60 @@
+// helpers of ass_string.h on ASS_CHAR, included by ass_string.c for wchar_t
+// and by ass_string_u8.c for UTF-8. only ASCII is compared or skipped, which
+// is never a part of a multibyte sequence.
+
+void ass_trim(ASS_Range *r) {
+  if (!r || !r->begin || !r->end || r->begin == r->end)
+    return;
+  for (; r->begin != r->end && ass_is_space(*r->begin); r->begin++) {
+    // nop;
+  }
+  if (r->begin == r->end)
+    return;
+  for (; ass_is_space(r->end[-1]); r->end--) {
+    // nop;
+  }
+}
+
+const ASS_CHAR *ass_skip_spaces(const ASS_CHAR *p, const ASS_CHAR *end) {
+  for (; ass_is_space(*p) && p != end; p++) {
+    // nop
+  }
+  return p;
+}
+
+int ass_strncmp(const ASS_CHAR *s1, const ASS_CHAR *s2, size_t cch) {
+  ASS_CHAR a, b;
+  const ASS_CHAR *last = s2 + cch;
+
+  do {
+    a = *s1++;
+    b = *s2++;
+  } while (s2 != last && a && a == b);
+
+  return a - b;
+}
+
+static ASS_CHAR ass_to_lower(ASS_CHAR ch) {
+  if ('A' <= ch && ch <= 'Z')
+    return ch - 'A' + 'a';
+  return ch;
+}
+
+int ass_strncasecmp(const ASS_CHAR *s1, const ASS_CHAR *s2, size_t cch) {
+  ASS_CHAR a, b;
+  const ASS_CHAR *last = s2 + cch;
+
+  do {
+    a = ass_to_lower(*s1++);
+    b = ass_to_lower(*s2++);
+  } while (s2 != last && a && a == b);
+
+  return a - b;
+}
+
+const ASS_CHAR *ass_strnchr(const ASS_CHAR *s, ASS_CHAR ch, size_t cch) {
+  const ASS_CHAR *last = s + cch;
+
+  s = ass_find_any(s, last, ch, ch);
+  return s == last ? NULL : s;
+}
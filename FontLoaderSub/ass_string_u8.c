@@ -0,0 +1,52 @@
+#include "ass_string.h"
+
+#if defined(_M_X64) || defined(_M_IX86_FP) && _M_IX86_FP >= 2
+#include <emmintrin.h>
+#include <intrin.h>
+#define ASS_SSE2
+#endif
+
+// ass_string_tpl.h with the names of ass_string.h suffixed by _u8
+#define ASS_CHAR char
+#define ASS_Range ASS_RangeU8
+#define ass_trim ass_trim_u8
+#define ass_skip_spaces ass_skip_spaces_u8
+#define ass_strncmp ass_strncmp_u8
+#define ass_strncasecmp ass_strncasecmp_u8
+#define ass_strnchr ass_strnchr_u8
+#define ass_find_any ass_find_any_u8
+#include "ass_string_tpl.h"
+
+#ifdef ASS_SSE2
+// a bit per byte of s[0..16), set if it's c0 or c1
+static unsigned ass_match16(const char *s, __m128i c0, __m128i c1) {
+  const __m128i v = _mm_loadu_si128((const __m128i *)s);
+  const __m128i m0 = _mm_cmpeq_epi8(v, c0);
+  const __m128i m1 = _mm_cmpeq_epi8(v, c1);
+  return _mm_movemask_epi8(_mm_or_si128(m0, m1));
+}
+#endif
+
+const char *ass_find_any(const char *s, const char *end, char c0, char c1) {
+#ifdef ASS_SSE2
+  const __m128i v0 = _mm_set1_epi8(c0);
+  const __m128i v1 = _mm_set1_epi8(c1);
+  unsigned long i;
+  // nothing is read past end, it may be the end of a mapped file
+  for (; end - s >= 32; s += 32) {
+    const unsigned m =
+        ass_match16(s, v0, v1) | ass_match16(s + 16, v0, v1) << 16;
+    if (_BitScanForward(&i, m))
+      return s + i;
+  }
+  if (end - s >= 16) {
+    if (_BitScanForward(&i, ass_match16(s, v0, v1)))
+      return s + i;
+    s += 16;
+  }
+#endif
+  for (; s != end && *s != c0 && *s != c1; s++) {
+    // nop
+  }
+  return s;
+}
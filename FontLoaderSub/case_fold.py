@@ -0,0 +1,62 @@
+#!/usr/bin/env python3
+"""Generate case_fold.c, the simple case folding table for the BMP.
+
+Usage: python3 case_fold.py > case_fold.c
+
+Simple (1:1) folding is derived from the Unicode database bundled with
+Python: the full folding of a code point is used when it is a single
+character, otherwise its lower case mapping when that is a single character.
+"""
+
+import sys
+import unicodedata
+
+
+def simple_fold(cp):
+    ch = chr(cp)
+    for mapped in (ch.casefold(), ch.lower()):
+        if len(mapped) == 1 and ord(mapped) <= 0xffff:
+            return ord(mapped)
+    return cp
+
+
+def main():
+    delta = [0] * 0x10000
+    for cp in range(0x10000):
+        if 0xd800 <= cp < 0xe000:
+            continue
+        delta[cp] = (simple_fold(cp) - cp) & 0xffff
+
+    pages = []
+    page_index = []
+    for hi in range(256):
+        page = tuple(delta[hi * 256:(hi + 1) * 256])
+        if page not in pages:
+            pages.append(page)
+        page_index.append(pages.index(page))
+
+    out = sys.stdout
+    out.write('// generated by case_fold.py, Unicode %s, do not edit\n\n'
+              % unicodedata.unidata_version)
+    out.write('#include "util.h"\n\n')
+    out.write('static const uint8_t kFoldPage[256] = {\n')
+    for i in range(0, 256, 16):
+        out.write('    %s,\n' % ', '.join('%d' % v for v in page_index[i:i + 16]))
+    out.write('};\n\n')
+    out.write('// delta to the folded character, modulo 0x10000\n')
+    out.write('static const uint16_t kFoldDelta[%d][256] = {\n' % len(pages))
+    for page in pages:
+        out.write('    {\n')
+        for i in range(0, 256, 12):
+            out.write('        %s,\n'
+                      % ', '.join('0x%04x' % v for v in page[i:i + 12]))
+        out.write('    },\n')
+    out.write('};\n\n')
+    out.write('wchar_t FlCaseFold(wchar_t ch) {\n')
+    out.write('  const uint16_t d = kFoldDelta[kFoldPage[ch >> 8]][ch & 0xff];\n')
+    out.write('  return (wchar_t)(ch + d);\n')
+    out.write('}\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,426 @@
+#include "cli.h"
+
+#include "ass_string.h"
+#include "font_loader.h"
+#include "main.h"
+
+#define kCliMaxThread (MAXIMUM_WAIT_OBJECTS)
+
+enum {
+  kCliExitOk = 0,
+  kCliExitMissing = 1,
+  kCliExitError = 2,
+};
+
+typedef struct {
+  const wchar_t *path;
+  int status;  // FL_STATUS of the job, FL_UNRECOGNIZED if there's no subtitle
+  uint32_t num_sub;
+  uint32_t num_face;
+  uint32_t num_loaded;
+  uint32_t num_failed;
+  uint32_t num_unmatched;
+  uint32_t num_skipped;
+  DWORD parse_ms;
+  DWORD load_ms;
+  str_db_t out;  // formatted fonts of the job
+} CliJob;
+
+typedef struct {
+  allocator_t *alloc;
+  int json;
+  const wchar_t *font_path;  // root of the index, resolved
+  FS_Set *font_set;          // shared by the jobs
+  CRITICAL_SECTION lock;     // for digests of font_set
+  CliJob *job;
+  uint32_t num_job;
+  volatile LONG next_job;
+} CliCtx;
+
+// fonts are resolved and fingerprinted, but never registered
+static int CliRegAdd(FL_FontRegistry *reg, const wchar_t *path) {
+  return 1;
+}
+
+static int CliRegRemove(FL_FontRegistry *reg, const wchar_t *path) {
+  return 1;
+}
+
+static FL_FontRegistry kCliRegistry = {CliRegAdd, CliRegRemove};
+
+// installed fonts are ignored, every face is checked against the index
+static int CliSysFonts(FL_LoaderCtx *c, void *param) {
+  return FL_OK;
+}
+
+static int CliPush(str_db_t *o, const wchar_t *str) {
+  return str_db_push_u16_le(o, str, 0) != NULL;
+}
+
+static int CliPushNum(str_db_t *o, uint32_t v) {
+  wchar_t buf[11];
+  int i = _countof(buf) - 1;
+  buf[i] = 0;
+  do {
+    buf[--i] = L'0' + v % 10;
+    v /= 10;
+  } while (v);
+  return CliPush(o, buf + i);
+}
+
+static int CliPushStr(str_db_t *o, const wchar_t *str, int json) {
+  if (str == NULL)
+    str = L"";
+  if (json && !CliPush(o, L"\""))
+    return 0;
+  for (; *str; str++) {
+    wchar_t esc[7] = {0};
+    if (!json) {
+      // keep a record in one line
+      esc[0] = (*str == L'\t' || *str == L'\r' || *str == L'\n') ? L' ' : *str;
+    } else if (*str == L'"' || *str == L'\\') {
+      esc[0] = L'\\';
+      esc[1] = *str;
+    } else if (*str < 0x20) {
+      const wchar_t *hex = L"0123456789abcdef";
+      esc[0] = L'\\';
+      esc[1] = L'u';
+      esc[2] = esc[3] = L'0';
+      esc[4] = hex[*str >> 4];
+      esc[5] = hex[*str & 15];
+    } else {
+      esc[0] = *str;
+    }
+    if (!CliPush(o, esc))
+      return 0;
+  }
+  return json ? CliPush(o, L"\"") : 1;
+}
+
+static const wchar_t *CliMatchKind(FL_MatchFlag flag) {
+  // same order as the log of the UI
+  if (flag & FL_LOAD_DUP)
+    return L"dup";
+  if (flag & FL_LOAD_FUZZY)
+    return L"fuzzy";
+  if (flag & (FL_OS_LOADED | FL_LOAD_OK))
+    return L"ok";
+  if (flag & FL_LOAD_ERR)
+    return L"error";
+  return L"miss";
+}
+
+static const wchar_t *CliJobStatus(const CliJob *job) {
+  if (job->status != FL_OK)
+    return L"error";
+  if (job->num_failed || job->num_unmatched)
+    return L"missing";
+  return L"ok";
+}
+
+static int CliFormatFonts(CliCtx *cli, uint32_t id, FL_LoaderCtx *c) {
+  str_db_t *o = &cli->job[id].out;
+  const FL_FontMatch *m = (const FL_FontMatch *)c->loaded_font.data;
+  int ok = 1;
+  for (size_t i = 0; ok && i != c->loaded_font.n; i++) {
+    if (cli->json) {
+      ok = CliPush(o, i ? L",\n{\"face\":" : L"\n{\"face\":") &&
+           CliPushStr(o, m[i].face, 1) && CliPush(o, L",\"match\":\"") &&
+           CliPush(o, CliMatchKind(m[i].flag)) &&
+           CliPush(o, L"\",\"file\":") &&
+           (m[i].filename ? CliPushStr(o, m[i].filename, 1)
+                          : CliPush(o, L"null")) &&
+           CliPush(o, L"}");
+    } else {
+      ok = CliPush(o, L"font\t") && CliPushNum(o, id + 1) &&
+           CliPush(o, L"\t") && CliPush(o, CliMatchKind(m[i].flag)) &&
+           CliPush(o, L"\t") && CliPushStr(o, m[i].face, 0) &&
+           CliPush(o, L"\t") && CliPushStr(o, m[i].filename, 0) &&
+           CliPush(o, L"\n");
+    }
+  }
+  return ok ? FL_OK : FL_OUT_OF_MEMORY;
+}
+
+static int CliRunJob(CliCtx *cli, uint32_t id) {
+  CliJob *job = &cli->job[id];
+  FL_LoaderCtx c;
+  int r = fl_init(&c, cli->alloc);
+  if (r != FL_OK)
+    return r;
+
+  c.font_set = cli->font_set;
+  c.font_set_lock = &cli->lock;
+  c.registry = &kCliRegistry;
+  c.sys_font_cb = CliSysFonts;
+  do {
+    if (!str_db_push_u16_le(&c.font_path, cli->font_path, 0)) {
+      r = FL_OUT_OF_MEMORY;
+      break;
+    }
+    const DWORD t0 = GetTickCount();
+    r = fl_add_subs(&c, job->path);
+    const DWORD t1 = GetTickCount();
+    job->parse_ms = t1 - t0;
+    if (r != FL_OK)
+      break;
+    if (c.num_sub == 0) {
+      r = FL_UNRECOGNIZED;
+      break;
+    }
+    r = fl_load_fonts(&c);
+    job->load_ms = GetTickCount() - t1;
+    if (r != FL_OK)
+      break;
+
+    job->num_sub = c.num_sub;
+    job->num_face = c.num_sub_font;
+    job->num_loaded = c.num_font_loaded;
+    job->num_failed = c.num_font_failed;
+    job->num_unmatched = c.num_font_unmatched;
+    job->num_skipped = c.num_font_skipped;
+    r = CliFormatFonts(cli, id, &c);
+  } while (0);
+
+  // the set is freed by CliMain
+  c.font_set = NULL;
+  fl_free(&c);
+  return r;
+}
+
+static DWORD WINAPI CliWorker(LPVOID param) {
+  CliCtx *cli = (CliCtx *)param;
+  LONG id;
+  while ((id = InterlockedIncrement(&cli->next_job) - 1) < (LONG)cli->num_job) {
+    cli->job[id].status = CliRunJob(cli, id);
+  }
+  return 0;
+}
+
+static int CliFormatJob(CliCtx *cli, uint32_t id, str_db_t *o) {
+  const CliJob *job = &cli->job[id];
+  const int json = cli->json;
+  // names and values of the counters, same order in both formats
+  const wchar_t *name[] = {L"subs",    L"faces",     L"loaded",  L"failed",
+                           L"unmatched", L"skipped", L"parse_ms", L"load_ms"};
+  const uint32_t value[] = {
+      job->num_sub,    job->num_face,    job->num_loaded, job->num_failed,
+      job->num_unmatched, job->num_skipped, job->parse_ms,   job->load_ms};
+
+  int ok = json ? CliPush(o, id ? L",\n{\"path\":" : L"\n{\"path\":")
+                : CliPush(o, L"job\t") && CliPushNum(o, id + 1) &&
+                      CliPush(o, L"\t");
+  ok = ok && CliPushStr(o, job->path, json) &&
+       CliPush(o, json ? L",\"status\":\"" : L"\t") &&
+       CliPush(o, CliJobStatus(job)) && (!json || CliPush(o, L"\""));
+  for (size_t i = 0; ok && i != _countof(value); i++) {
+    if (json)
+      ok = CliPush(o, L",\"") && CliPush(o, name[i]) && CliPush(o, L"\":");
+    else
+      ok = CliPush(o, L"\t");
+    ok = ok && CliPushNum(o, value[i]);
+  }
+  ok = ok && CliPush(o, json ? L",\"fonts\":[" : L"\n") &&
+       CliPush(o, str_db_get((str_db_t *)&job->out, 0)) &&
+       (!json || CliPush(o, L"]}"));
+  return ok ? FL_OK : FL_OUT_OF_MEMORY;
+}
+
+static int CliFormat(CliCtx *cli, DWORD index_ms, str_db_t *o) {
+  FS_Stat stat = {0};
+  fs_stat(cli->font_set, &stat);
+  const int json = cli->json;
+
+  int ok = json ? CliPush(o, L"{\"index\":{\"path\":")
+                : CliPush(o, L"index\t");
+  ok = ok && CliPushStr(o, cli->font_path, json) &&
+       CliPush(o, json ? L",\"files\":" : L"\t") &&
+       CliPushNum(o, stat.num_file) &&
+       CliPush(o, json ? L",\"faces\":" : L"\t") &&
+       CliPushNum(o, stat.num_face) &&
+       CliPush(o, json ? L",\"ms\":" : L"\t") && CliPushNum(o, index_ms) &&
+       CliPush(o, json ? L"},\n\"jobs\":[" : L"\n");
+  for (uint32_t i = 0; ok && i != cli->num_job; i++)
+    ok = CliFormatJob(cli, i, o) == FL_OK;
+  ok = ok && (!json || CliPush(o, L"]}\n"));
+  return ok ? FL_OK : FL_OUT_OF_MEMORY;
+}
+
+static int CliWrite(const wchar_t *out_path, str_db_t *o, allocator_t *alloc) {
+  HANDLE h;
+  if (out_path) {
+    h = CreateFile(
+        out_path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+  } else {
+    // a GUI process has no console, unless stdout is redirected
+    h = GetStdHandle(STD_OUTPUT_HANDLE);
+    if ((h == NULL || h == INVALID_HANDLE_VALUE) &&
+        AttachConsole(ATTACH_PARENT_PROCESS))
+      h = GetStdHandle(STD_OUTPUT_HANDLE);
+  }
+  if (h == NULL || h == INVALID_HANDLE_VALUE)
+    return FL_OS_ERROR;
+
+  int r = FL_OK;
+  const wchar_t *str = str_db_get(o, 0);
+  const int cch = (int)str_db_tell(o);
+  const int size = WideCharToMultiByte(CP_UTF8, 0, str, cch, NULL, 0, 0, 0);
+  char *buf = alloc->alloc(NULL, size + 1, alloc->arg);
+  DWORD written;
+  if (buf == NULL) {
+    r = FL_OUT_OF_MEMORY;
+  } else if (
+      WideCharToMultiByte(CP_UTF8, 0, str, cch, buf, size, 0, 0) != size ||
+      !WriteFile(h, buf, size, &written, NULL) || written != (DWORD)size) {
+    r = FL_OS_ERROR;
+  }
+  alloc->alloc(buf, 0, alloc->arg);
+  if (out_path)
+    CloseHandle(h);
+  return r;
+}
+
+static int CliLoadIndex(FL_LoaderCtx *index, const wchar_t *path) {
+  // same as APP_LOAD_CACHE, then APP_SCAN_FONT
+  FS_Stat stat = {0};
+  fl_scan_fonts(index, path, kCacheFile, kBlackFile);
+  fs_stat(index->font_set, &stat);
+  if (stat.num_face == 0) {
+    if (fl_scan_fonts(index, path, NULL, kBlackFile) != FL_OK)
+      return FL_OS_ERROR;
+    fl_save_cache(index, kCacheFile);
+  }
+  // lookups of the jobs only read the set from now on
+  fs_build_fuzzy(index->font_set);
+  return index->font_set ? FL_OK : FL_OS_ERROR;
+}
+
+static uint32_t CliParseNum(const wchar_t *s) {
+  uint32_t v = 0;
+  for (; *s >= L'0' && *s <= L'9'; s++)
+    v = v * 10 + (*s - L'0');
+  return *s ? 0 : v;
+}
+
+int CliIsCheck(const wchar_t *arg) {
+  return ass_strncmp(arg, L"--check", 8) == 0;
+}
+
+int CliMain(int argc, wchar_t **argv, allocator_t *alloc) {
+  CliCtx cli;
+  zmemset(&cli, 0, sizeof cli);
+  cli.alloc = alloc;
+
+  // options, then jobs
+  const wchar_t *font_path = NULL;
+  const wchar_t *out_path = NULL;
+  uint32_t num_thread = 0;
+  int i = 2;
+  for (; i < argc && argv[i][0] == L'-' && argv[i][1] == L'-'; i++) {
+    const wchar_t *opt = argv[i];
+    const int has_value = i + 1 < argc;
+    if (ass_strncmp(opt, L"--", 3) == 0) {
+      i++;
+      break;
+    } else if (ass_strncmp(opt, L"--json", 7) == 0) {
+      cli.json = 1;
+    } else if (ass_strncmp(opt, L"--tsv", 6) == 0) {
+      cli.json = 0;
+    } else if (ass_strncmp(opt, L"--fonts", 8) == 0 && has_value) {
+      font_path = argv[++i];
+    } else if (ass_strncmp(opt, L"--out", 6) == 0 && has_value) {
+      out_path = argv[++i];
+    } else if (ass_strncmp(opt, L"--jobs", 7) == 0 && has_value) {
+      num_thread = CliParseNum(argv[++i]);
+      if (num_thread == 0)
+        return kCliExitError;
+    } else {
+      return kCliExitError;
+    }
+  }
+  if (i == argc)
+    return kCliExitError;
+
+  // the exe path, the index is beside it
+  wchar_t exe_path[MAX_PATH];
+  if (font_path == NULL) {
+    const DWORD cch = GetModuleFileName(NULL, exe_path, _countof(exe_path));
+    if (cch == 0 || cch == _countof(exe_path))
+      return kCliExitError;
+    font_path = exe_path;
+  }
+  if (num_thread == 0) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    num_thread = info.dwNumberOfProcessors;
+  }
+
+  FL_LoaderCtx index;
+  if (fl_init(&index, alloc) != FL_OK)
+    return kCliExitError;
+  InitializeCriticalSection(&cli.lock);
+  str_db_t out;
+  str_db_init(&out, alloc, 0, 0);
+  HANDLE thread[kCliMaxThread];
+  uint32_t num_started = 0;
+  int exit_code = kCliExitError;
+  do {
+    const DWORD t0 = GetTickCount();
+    if (CliLoadIndex(&index, font_path) != FL_OK)
+      break;
+    const DWORD index_ms = GetTickCount() - t0;
+    cli.font_set = index.font_set;
+    cli.font_path = str_db_get(&index.font_path, 0);
+
+    cli.num_job = argc - i;
+    cli.job = alloc->alloc(NULL, cli.num_job * sizeof cli.job[0], alloc->arg);
+    if (cli.job == NULL)
+      break;
+    for (uint32_t j = 0; j != cli.num_job; j++) {
+      cli.job[j].path = argv[i + j];
+      str_db_init(&cli.job[j].out, alloc, 0, 0);
+    }
+
+    // the calling thread is a worker too
+    if (num_thread > cli.num_job)
+      num_thread = cli.num_job;
+    if (num_thread > kCliMaxThread)
+      num_thread = kCliMaxThread;
+    for (; num_started + 1 < num_thread; num_started++) {
+      DWORD thread_id;
+      thread[num_started] =
+          CreateThread(NULL, 0, CliWorker, &cli, 0, &thread_id);
+      if (thread[num_started] == NULL)
+        break;
+    }
+    CliWorker(&cli);
+    if (num_started)
+      WaitForMultipleObjects(num_started, thread, TRUE, INFINITE);
+
+    if (CliFormat(&cli, index_ms, &out) != FL_OK ||
+        CliWrite(out_path, &out, alloc) != FL_OK)
+      break;
+
+    exit_code = kCliExitOk;
+    for (uint32_t j = 0; j != cli.num_job; j++) {
+      const CliJob *job = &cli.job[j];
+      if (job->status != FL_OK) {
+        exit_code = kCliExitError;
+        break;
+      }
+      if (job->num_failed || job->num_unmatched)
+        exit_code = kCliExitMissing;
+    }
+  } while (0);
+
+  for (uint32_t j = 0; j != num_started; j++)
+    CloseHandle(thread[j]);
+  for (uint32_t j = 0; cli.job && j != cli.num_job; j++)
+    str_db_free(&cli.job[j].out);
+  alloc->alloc(cli.job, 0, alloc->arg);
+  str_db_free(&out);
+  DeleteCriticalSection(&cli.lock);
+  fl_free(&index);
+  return exit_code;
+}
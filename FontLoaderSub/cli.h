@@ -0,0 +1,16 @@
+#pragma once
+
+#include "util.h"
+
+// headless check for scripts, without UI or font registration:
+//   FontLoaderSub.exe --check [--json] [--fonts DIR] [--jobs N] [--out FILE]
+//                     PATH...
+// each PATH, a subtitle or a directory of them, is a job resolved against one
+// index of DIR, the exe folder by default. jobs run in parallel, the results
+// are written in order as TSV or JSON, to stdout or FILE.
+//
+// exit code: 0 if every face is resolved, 1 if some are missing or failed to
+// open, 2 on bad arguments, no index or a failed job.
+int CliIsCheck(const wchar_t *arg);
+
+int CliMain(int argc, wchar_t **argv, allocator_t *alloc);
@@ -169,3 +169,104 @@ void str_db_loads(str_db_t *s, const wchar_t *str, size_t cch, wchar_t ex_pad) {
   };
   // clang-format on
 }
+
+int hash_tab_init(hash_tab_t *t, allocator_t *alloc) {
+  *t = (hash_tab_t){.alloc = alloc};
+  return 0;
+}
+
+int hash_tab_free(hash_tab_t *t) {
+  if (t->alloc) {
+    allocator_t *alloc = t->alloc;
+    alloc->alloc(t->slot, 0, alloc->arg);
+  }
+  t->slot = NULL;
+  t->mask = 0;
+  t->n = 0;
+  return 0;
+}
+
+int hash_tab_clear(hash_tab_t *t) {
+  if (t->slot && t->alloc) {
+    zmemset(t->slot, 0, (t->mask + 1) * sizeof t->slot[0]);
+  }
+  t->n = 0;
+  return 0;
+}
+
+static void hash_tab_put(hash_slot_t *slot, uint32_t mask, hash_slot_t *s) {
+  uint32_t pos = s->hash & mask;
+  while (slot[pos].value != 0) {
+    pos = (pos + 1) & mask;
+  }
+  slot[pos] = *s;
+}
+
+int hash_tab_reserve(hash_tab_t *t, size_t n) {
+  // keep load factor under 1/2
+  if (t->alloc == NULL)
+    return 0;
+  if (t->slot && (size_t)t->mask + 1 >= n * 2)
+    return 1;
+
+  size_t cap = 16;
+  while (cap < n * 2)
+    cap *= 2;
+  if (cap > 0x80000000u)
+    return 0;
+
+  allocator_t *alloc = t->alloc;
+  hash_slot_t *slot =
+      (hash_slot_t *)alloc->alloc(NULL, cap * sizeof slot[0], alloc->arg);
+  if (slot == NULL)
+    return 0;
+  zmemset(slot, 0, cap * sizeof slot[0]);
+  if (t->slot) {
+    for (uint32_t i = 0; i != t->mask + 1; i++) {
+      if (t->slot[i].value != 0)
+        hash_tab_put(slot, (uint32_t)(cap - 1), &t->slot[i]);
+    }
+    alloc->alloc(t->slot, 0, alloc->arg);
+  }
+  t->slot = slot;
+  t->mask = (uint32_t)(cap - 1);
+  return 1;
+}
+
+int hash_tab_insert(hash_tab_t *t, uint32_t hash, uint32_t value) {
+  if (!hash_tab_reserve(t, (size_t)t->n + 1))
+    return 0;
+  hash_slot_t s = {.hash = hash, .value = value + 1};
+  hash_tab_put(t->slot, t->mask, &s);
+  t->n++;
+  return 1;
+}
+
+uint32_t hash_tab_next(const hash_tab_t *t, uint32_t hash, uint32_t *probe) {
+  if (t->slot == NULL)
+    return kHashTabNone;
+  while (*probe <= t->mask) {
+    const hash_slot_t *s = &t->slot[(hash + *probe) & t->mask];
+    *probe += 1;
+    if (s->value == 0)
+      break;
+    if (s->hash == hash)
+      return s->value - 1;
+  }
+  *probe = t->mask + 1;
+  return kHashTabNone;
+}
+
+void hash_tab_loads(hash_tab_t *t, const hash_slot_t *slot, uint32_t num) {
+  // num must be a power of 2
+  *t = (hash_tab_t){
+      .slot = (hash_slot_t *)slot, .mask = num - 1, .n = 0, .alloc = NULL};
+}
+
+uint32_t str_hash(uint32_t h, const wchar_t *str, size_t cch) {
+  // FNV-1a, start with kStrHashInit
+  for (size_t i = 0; i != cch; i++) {
+    h = (h ^ str[i]) * 16777619u;
+  }
+  return h;
+}
@@ -54,3 +54,37 @@ const wchar_t *str_db_push_u16_be(str_db_t *s, const wchar_t *str, size_t cch);
 const wchar_t *str_db_str(str_db_t *s, size_t pos, const wchar_t *str);
 
 void str_db_loads(str_db_t *s, const wchar_t *str, size_t cch, wchar_t ex_pad);
+
+typedef struct _hash_slot_t {
+  uint32_t hash;
+  uint32_t value;  // value + 1, 0 for empty slot
+} hash_slot_t;
+
+// open addressing hash table, mapping hash to uint32_t values.
+// keys are not stored, caller should verify each candidate.
+typedef struct _hash_tab_t {
+  hash_slot_t *slot;
+  uint32_t mask;  // number of slots - 1
+  uint32_t n;
+  allocator_t *alloc;
+} hash_tab_t;
+
+#define kHashTabNone ((uint32_t)-1)
+
+int hash_tab_init(hash_tab_t *t, allocator_t *alloc);
+
+int hash_tab_free(hash_tab_t *t);
+
+int hash_tab_clear(hash_tab_t *t);
+
+int hash_tab_reserve(hash_tab_t *t, size_t n);
+
+int hash_tab_insert(hash_tab_t *t, uint32_t hash, uint32_t value);
+
+uint32_t hash_tab_next(const hash_tab_t *t, uint32_t hash, uint32_t *probe);
+
+void hash_tab_loads(hash_tab_t *t, const hash_slot_t *slot, uint32_t num);
+
+#define kStrHashInit (2166136261u)
+
+uint32_t str_hash(uint32_t h, const wchar_t *str, size_t cch);
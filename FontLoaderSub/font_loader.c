@@ -10,6 +10,48 @@
 #include "util.h"
 
 #define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#define kSubWindow 32768   // chars of a subtitle decoded at a time
+#define kSubMaxLine 32768  // longer lines are parsed by parts
+#define kSubMaxWorker (4)  // threads parsing subtitles, besides the caller
+
+// in sys_font_hash, a face queried but not installed
+#define kSysFontMiss (0x80000000u)
+
+// a font of the previous load, still registered
+typedef struct {
+  size_t face;     // in retain
+  size_t file;     // in retain, if registered
+  int registered;  // 0 for a face loaded by another file
+  int kept;        // reused by the current load
+  size_t size;
+  uint32_t fingerprint;
+  int has_hash;
+  uint8_t hash[32];
+} FL_RetainRec;
+
+// a subtitle parsed by fl_add_subs
+typedef struct {
+  size_t path;  // in sub_file
+  FILETIME mtime;
+  DWORD size;
+  int counted;  // in num_sub
+} FL_SubFile;
+
+// views of the loaded fonts are kept between passes of fl_cache_fonts on x64.
+// on x86, they'd take a large part of the address space, which is needed to
+// map the index and subtitles, so they're mapped for a pass only
+#ifdef _WIN64
+#define kFlCacheKeepViews (1)
+#else
+#define kFlCacheKeepViews (0)
+#endif
+
+// a loaded font mapped by fl_cache_fonts
+typedef struct {
+  memmap_t map;
+} FL_CacheView;
+
+static void fl_cache_release(FL_LoaderCtx *c);
 
 int fl_init(FL_LoaderCtx *c, allocator_t *alloc) {
   int r = FL_OK;
@@ -18,21 +60,47 @@ int fl_init(FL_LoaderCtx *c, allocator_t *alloc) {
 
   do {
     vec_init(&c->loaded_font, sizeof(FL_FontMatch), alloc);
+    hash_tab_init(&c->loaded_face, alloc);
+    hash_tab_init(&c->loaded_file, alloc);
+    hash_tab_init(&c->loaded_fp, alloc);
     str_db_init(&c->sub_font, alloc, 0, 1);
+    str_db_init(&c->sub_file, alloc, 0, 1);
+    vec_init(&c->sub_file_rec, sizeof(FL_SubFile), alloc);
+    hash_tab_init(&c->sub_file_hash, alloc);
     str_db_init(&c->font_path, alloc, 0, 0);
     str_db_init(&c->walk_path, alloc, 0, 0);
+    str_db_init(&c->sys_font, alloc, 0, 1);
+    hash_tab_init(&c->sys_font_hash, alloc);
+    str_db_init(&c->retain, alloc, 0, 1);
+    vec_init(&c->retain_font, sizeof(FL_RetainRec), alloc);
+    hash_tab_init(&c->retain_face, alloc);
+    hash_tab_init(&c->retain_file, alloc);
+    vec_init(&c->cache_view, sizeof(FL_CacheView), alloc);
 
     c->event_cancel = CreateEvent(NULL, TRUE, FALSE, NULL);
     if (!c->event_cancel) {
       r = FL_OS_ERROR;
       break;
     }
-    const NTSTATUS status = BCryptOpenAlgorithmProvider(
+    NTSTATUS status = BCryptOpenAlgorithmProvider(
         &c->hash_alg, BCRYPT_SHA256_ALGORITHM, NULL, 0);
     if (!NT_SUCCESS(status)) {
       r = FL_OS_ERROR;
       break;
     }
+    DWORD sz_data = 0;
+    status = BCryptGetProperty(
+        c->hash_alg, BCRYPT_OBJECT_LENGTH, (PBYTE)&c->sz_hash_obj,
+        sizeof c->sz_hash_obj, &sz_data, 0);
+    if (!NT_SUCCESS(status)) {
+      r = FL_OS_ERROR;
+      break;
+    }
+    c->hash_obj = alloc->alloc(NULL, c->sz_hash_obj, alloc->arg);
+    if (c->hash_obj == NULL) {
+      r = FL_OUT_OF_MEMORY;
+      break;
+    }
   } while (0);
 
   if (r != FL_OK)
@@ -43,11 +111,28 @@ int fl_init(FL_LoaderCtx *c, allocator_t *alloc) {
 int fl_free(FL_LoaderCtx *c) {
   CloseHandle(c->event_cancel);
   BCryptCloseAlgorithmProvider(c->hash_alg, 0);
+  c->alloc->alloc(c->hash_obj, 0, c->alloc->arg);
   vec_free(&c->loaded_font);
+  hash_tab_free(&c->loaded_face);
+  hash_tab_free(&c->loaded_file);
+  hash_tab_free(&c->loaded_fp);
   str_db_free(&c->sub_font);
+  str_db_free(&c->sub_file);
+  vec_free(&c->sub_file_rec);
+  hash_tab_free(&c->sub_file_hash);
   str_db_free(&c->font_path);
   str_db_free(&c->walk_path);
+  str_db_free(&c->sys_font);
+  hash_tab_free(&c->sys_font_hash);
+  str_db_free(&c->retain);
+  vec_free(&c->retain_font);
+  hash_tab_free(&c->retain_face);
+  hash_tab_free(&c->retain_file);
+  fl_cache_release(c);
+  vec_free(&c->cache_view);
+  fs_fuzzy_buf_free(&c->fuzzy_buf);
   fs_free(c->font_set);
+  fs_free(c->prev_font_set);
 
   return FL_OK;
 }
@@ -56,43 +141,220 @@ int fl_cancel(FL_LoaderCtx *c) {
   return SetEvent(c->event_cancel) ? FL_OK : FL_OS_ERROR;
 }
 
+static uint32_t fl_sys_font_hash(const wchar_t *face) {
+  uint32_t h = kStrHashInit;
+  for (; *face; face++) {
+    const wchar_t f = FlCaseFold(*face);
+    h = str_hash(h, &f, 1);
+  }
+  return h;
+}
+
 static int fl_check_cancel(FL_LoaderCtx *c) {
   if (WaitForSingleObject(c->event_cancel, 0) != WAIT_TIMEOUT)
     return FL_OS_ERROR;
   return FL_OK;
 }
 
+// subtitles of a fl_add_subs call are parsed by a pool of workers, each one
+// collects the faces of a file on its own. they're merged in order by the
+// caller, so sub_font is the same as parsing the files one by one.
+typedef struct {
+  uint32_t rec;  // in sub_file_rec
+  int parsed;
+  int read;  // a subtitle text, not an unreadable file
+  str_db_t font;  // faces of the file, deduplicated
+  volatile LONG done;
+} FL_SubJob;
+
+typedef struct _FL_SubPool FL_SubPool;
+
+typedef struct {
+  FL_SubPool *pool;
+  FL_SubJob *job;   // being parsed
+  wchar_t *window;  // allocated on the first file
+} FL_SubWorker;
+
+struct _FL_SubPool {
+  FL_LoaderCtx *c;
+  vec_t jobs;              // FL_SubJob, fixed once workers start
+  volatile LONG next_job;  // claimed by workers
+  volatile LONG closing;   // skip the remaining jobs
+  HANDLE evt_done;         // a job is done
+  uint32_t num_worker;
+  HANDLE thread[kSubMaxWorker];
+  FL_SubWorker worker[kSubMaxWorker + 1];  // the last one is the caller
+};
+
+// FL_DUP if the face is in the list already
+static int fl_sub_font_push(str_db_t *font, const wchar_t *face, size_t cch) {
+  const size_t pos = str_db_tell(font);
+  const wchar_t *insert = str_db_push_u16_le(font, face, cch);
+  if (insert == NULL)
+    return FL_OUT_OF_MEMORY;
+  if (str_db_str(font, 0, insert) != insert) {
+    str_db_seek(font, pos);
+    return FL_DUP;
+  }
+  return FL_OK;
+}
+
 static int fl_sub_font_callback(const wchar_t *font, size_t cch, void *arg) {
-  FL_LoaderCtx *c = arg;
-  if (cch != 0) {
-    if (font[0] == '@') {
-      // skip prefix '@'
-      font++;
-      cch--;
-    }
-    if (cch == 0)
-      return FL_OK;
+  FL_SubWorker *w = arg;
+  if (cch != 0 && font[0] == '@') {
+    // skip prefix '@'
+    font++;
+    cch--;
+  }
+  if (cch == 0)
+    return FL_OK;
+
+  const int r = fl_sub_font_push(&w->job->font, font, cch);
+  return r == FL_DUP ? FL_OK : r;
+}
+
+static int fl_sub_font_callback_u8(const char *font, size_t cch, void *arg) {
+  FL_SubWorker *w = arg;
+  allocator_t *alloc = w->pool->c->alloc;
+  wchar_t buf[256];
+  wchar_t *name = buf;
+  if (cch == 0)
+    return FL_OK;
 
-    const size_t pos = str_db_tell(&c->sub_font);
-    const wchar_t *insert = str_db_push_u16_le(&c->sub_font, font, cch);
-    if (insert == NULL) {
+  // only the names are converted
+  int len = MultiByteToWideChar(CP_UTF8, 0, font, (int)cch, buf, _countof(buf));
+  if (len == 0) {
+    // longer than any face
+    len = MultiByteToWideChar(CP_UTF8, 0, font, (int)cch, NULL, 0);
+    name = alloc->alloc(NULL, len * sizeof name[0], alloc->arg);
+    if (name == NULL)
       return FL_OUT_OF_MEMORY;
-    }
+    len = MultiByteToWideChar(CP_UTF8, 0, font, (int)cch, name, len);
+  }
+  const int r = fl_sub_font_callback(name, len, w);
+  if (name != buf)
+    alloc->alloc(name, 0, alloc->arg);
+  return r;
+}
+
+// FL_DUP if the subtitle is parsed and unchanged since, otherwise it's
+// recorded as *id and to be parsed
+static int fl_sub_file_check(
+    FL_LoaderCtx *c,
+    const wchar_t *path,
+    WIN32_FIND_DATA *data,
+    uint32_t *id) {
+  FL_SubFile *rec = c->sub_file_rec.data;
+  const uint32_t h = fl_sys_font_hash(path);
+  uint32_t probe = 0, i;
+  while ((i = hash_tab_next(&c->sub_file_hash, h, &probe)) != kHashTabNone) {
+    if (FlStrCmpIW(path, str_db_get(&c->sub_file, rec[i].path)) != 0)
+      continue;
+    if (rec[i].size == data->nFileSizeLow &&
+        CompareFileTime(&rec[i].mtime, &data->ftLastWriteTime) == 0)
+      return FL_DUP;
+    rec[i].size = data->nFileSizeLow;
+    rec[i].mtime = data->ftLastWriteTime;
+    *id = i;
+    return FL_OK;
+  }
+
+  // FL_SubFile m = {.mtime = ..., .size = ...};
+  FL_SubFile m;
+  m.path = str_db_tell(&c->sub_file);
+  m.mtime = data->ftLastWriteTime;
+  m.size = data->nFileSizeLow;
+  m.counted = 0;
+  i = (uint32_t)c->sub_file_rec.n;
+  if (!str_db_push_u16_le(&c->sub_file, path, 0) ||
+      !vec_append(&c->sub_file_rec, &m, 1) ||
+      !hash_tab_insert(&c->sub_file_hash, h, i))
+    return FL_OUT_OF_MEMORY;
+  *id = i;
+  return FL_OK;
+}
 
-    const wchar_t *match = str_db_str(&c->sub_font, 0, insert);
-    if (match == insert) {
-      // not duplicated
-      c->num_sub_font++;
+// parsed again by the next fl_add_subs, if it's skipped by this one
+static void fl_sub_file_reset(FL_LoaderCtx *c, uint32_t id) {
+  FL_SubFile *rec = (FL_SubFile *)c->sub_file_rec.data + id;
+  zmemset(&rec->mtime, 0, sizeof rec->mtime);
+}
+
+static int fl_parse_sub(FL_SubWorker *w, const memmap_t *map) {
+  allocator_t *alloc = w->pool->c->alloc;
+  FL_TextReader reader;
+  if (FlTextReaderInit(&reader, map->data, map->size) != FL_OK)
+    return FL_UNRECOGNIZED;
+  const size_t bytes = reader.end - reader.pos;
+
+  // parsed in place if possible, otherwise decoded a window at a time
+  if (w->window == NULL) {
+    w->window = alloc->alloc(
+        NULL, (kSubWindow + kSubMaxLine + 1) * sizeof w->window[0],
+        alloc->arg);
+    if (w->window == NULL)
+      return FL_OUT_OF_MEMORY;
+  }
+  wchar_t *window = w->window;
+  if (reader.codepage == CP_UTF8) {
+    ASS_ParserU8 parser;
+    ass_parser_begin_u8(
+        &parser, (char *)window, kSubMaxLine, fl_sub_font_callback_u8, w);
+    ass_parser_feed_u8(&parser, (const char *)reader.pos, bytes);
+    ass_parser_end_u8(&parser);
+  } else {
+    ASS_Parser parser;
+    ass_parser_begin(
+        &parser, window + kSubWindow, kSubMaxLine, fl_sub_font_callback, w);
+    if (reader.codepage == kFlCodePageUtf16Le) {
+      ass_parser_feed(&parser, (const wchar_t *)reader.pos, bytes / 2);
     } else {
-      str_db_seek(&c->sub_font, pos);
+      size_t cch;
+      while ((cch = FlTextRead(&reader, window, kSubWindow)) != 0)
+        ass_parser_feed(&parser, window, cch);
     }
+    ass_parser_end(&parser);
   }
   return FL_OK;
 }
 
+// parse the next subtitle, 0 if there's none
+static int fl_sub_run_one(FL_SubWorker *w) {
+  FL_SubPool *p = w->pool;
+  FL_LoaderCtx *c = p->c;
+  const uint32_t i = (uint32_t)InterlockedIncrement(&p->next_job) - 1;
+  if (i >= (uint32_t)p->jobs.n)
+    return 0;
+  FL_SubJob *job = (FL_SubJob *)p->jobs.data + i;
+  if (!p->closing && fl_check_cancel(c) == FL_OK) {
+    const FL_SubFile *rec = (FL_SubFile *)c->sub_file_rec.data + job->rec;
+    memmap_t map;
+    FlMemMap(str_db_get(&c->sub_file, rec->path), &map);
+    if (map.data) {
+      w->job = job;
+      job->read = fl_parse_sub(w, &map) == FL_OK;
+      if (MOCK_DELAY_SUB)
+        Sleep(MOCK_DELAY_SUB);
+    }
+    FlMemUnmap(&map);
+    job->parsed = 1;
+  }
+  InterlockedExchange(&job->done, 1);
+  SetEvent(p->evt_done);
+  return 1;
+}
+
+static DWORD WINAPI fl_sub_worker(LPVOID param) {
+  FL_SubWorker *w = (FL_SubWorker *)param;
+  while (fl_sub_run_one(w))
+    ;
+  return 0;
+}
+
 static int
 fl_walk_sub_callback(const wchar_t *path, WIN32_FIND_DATA *data, void *arg) {
-  FL_LoaderCtx *c = arg;
+  FL_SubPool *p = arg;
+  FL_LoaderCtx *c = p->c;
   const int r = fl_check_cancel(c);
   if (r != FL_OK)
     return r;
@@ -102,40 +364,116 @@ fl_walk_sub_callback(const wchar_t *path, WIN32_FIND_DATA *data, void *arg) {
   const int match_attr =
       !(data->dwFileAttributes &
         (FILE_ATTRIBUTE_DEVICE | FILE_ATTRIBUTE_DIRECTORY));
-  const int match_size =
-      (data->nFileSizeHigh == 0 && data->nFileSizeLow <= 64 * 1024 * 1024);
+  // a view is sized by 32 bits
+  const int match_size = data->nFileSizeHigh == 0;
   const int match_ext = (len > 4) && (ass_strncasecmp(ext, L".ass", 4) == 0 ||
                                       ass_strncasecmp(ext, L".ssa", 4) == 0);
   if (!(match_attr && match_size && match_ext))
     return FL_OK;
 
-  memmap_t map;
-  wchar_t *content = NULL;
-  size_t cch = 0;
-  do {
-    FlMemMap(path, &map);
-    if (!map.data)
-      break;
-    content = FlTextDecode(map.data, map.size, &cch, c->alloc);
-    if (content == NULL)
-      break;
+  FL_SubJob job;
+  zmemset(&job, 0, sizeof job);
+  const int r_check = fl_sub_file_check(c, path, data, &job.rec);
+  if (r_check != FL_OK)
+    return r_check == FL_DUP ? FL_OK : r_check;
 
-    c->num_sub++;
-    ass_process_data(content, cch, fl_sub_font_callback, c);
+  str_db_init(&job.font, c->alloc, 0, 1);
+  if (!vec_append(&p->jobs, &job, 1)) {
+    fl_sub_file_reset(c, job.rec);
+    return FL_OUT_OF_MEMORY;
+  }
+  return FL_OK;
+}
 
-    if (MOCK_DELAY_SUB)
-      Sleep(MOCK_DELAY_SUB);
-  } while (0);
+static int fl_sub_pool_open(FL_SubPool *p, FL_LoaderCtx *c) {
+  zmemset(p, 0, sizeof *p);
+  p->c = c;
+  vec_init(&p->jobs, sizeof(FL_SubJob), c->alloc);
+  for (uint32_t i = 0; i != kSubMaxWorker + 1; i++)
+    p->worker[i].pool = p;
+  p->evt_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+  return p->evt_done ? FL_OK : FL_OS_ERROR;
+}
 
-  FlMemUnmap(&map);
-  c->alloc->alloc(content, 0, c->alloc->arg);
+// start workers, after the subtitles are listed
+static void fl_sub_pool_start(FL_SubPool *p) {
+  const uint32_t n = (uint32_t)p->jobs.n;
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  uint32_t num_worker = info.dwNumberOfProcessors;
+  if (num_worker > kSubMaxWorker)
+    num_worker = kSubMaxWorker;
+  // the caller takes a share
+  if (num_worker >= n)
+    num_worker = n ? n - 1 : 0;
+  for (uint32_t i = 0; i < num_worker; i++) {
+    p->thread[p->num_worker] =
+        CreateThread(NULL, 0, fl_sub_worker, &p->worker[i], 0, NULL);
+    if (p->thread[p->num_worker])
+      p->num_worker++;
+  }
+}
 
-  return FL_OK;
+// merge the faces in order, parsing the subtitles meanwhile
+static int fl_sub_pool_merge(FL_SubPool *p) {
+  FL_LoaderCtx *c = p->c;
+  FL_SubJob *jobs = p->jobs.data;
+  FL_SubWorker *self = &p->worker[kSubMaxWorker];
+  int r = FL_OK;
+  for (size_t i = 0; i != p->jobs.n; i++) {
+    FL_SubJob *job = &jobs[i];
+    while (!InterlockedCompareExchange(&job->done, 0, 0)) {
+      if (!fl_sub_run_one(self))
+        WaitForSingleObject(p->evt_done, INFINITE);
+    }
+    if (r == FL_OK)
+      r = fl_check_cancel(c);
+    size_t pos = 0;
+    const wchar_t *font;
+    while (r == FL_OK && (font = str_db_next(&job->font, &pos)) != NULL) {
+      r = fl_sub_font_push(&c->sub_font, font, 0);
+      if (r == FL_OK) {
+        // not duplicated
+        c->num_sub_font++;
+      } else if (r == FL_DUP) {
+        r = FL_OK;
+      }
+    }
+    FL_SubFile *rec = (FL_SubFile *)c->sub_file_rec.data + job->rec;
+    if (r != FL_OK || !job->parsed) {
+      InterlockedExchange(&p->closing, 1);
+      fl_sub_file_reset(c, job->rec);
+    } else if (job->read && !rec->counted) {
+      rec->counted = 1;
+      c->num_sub++;
+    }
+  }
+  return r;
+}
+
+static void fl_sub_pool_close(FL_SubPool *p) {
+  allocator_t *alloc = p->c->alloc;
+  FL_SubJob *jobs = p->jobs.data;
+  InterlockedExchange(&p->closing, 1);
+  if (p->num_worker)
+    WaitForMultipleObjects(p->num_worker, p->thread, TRUE, INFINITE);
+  for (uint32_t i = 0; i != p->num_worker; i++)
+    CloseHandle(p->thread[i]);
+  for (uint32_t i = 0; i != kSubMaxWorker + 1; i++)
+    alloc->alloc(p->worker[i].window, 0, alloc->arg);
+  for (size_t i = 0; i != p->jobs.n; i++)
+    str_db_free(&jobs[i].font);
+  if (p->evt_done)
+    CloseHandle(p->evt_done);
+  vec_free(&p->jobs);
 }
 
 int fl_add_subs(FL_LoaderCtx *c, const wchar_t *path) {
-  int r;
+  FL_SubPool pool;
+  int r = fl_sub_pool_open(&pool, c);
   do {
+    if (r != FL_OK)
+      break;
     str_db_seek(&c->walk_path, 0);
     r = FlResolvePath(path, &c->walk_path);
     if (r == FL_OS_ERROR) {
@@ -146,13 +484,40 @@ int fl_add_subs(FL_LoaderCtx *c, const wchar_t *path) {
       break;
     }
 
-    r = FlWalkDirStr(&c->walk_path, fl_walk_sub_callback, c);
-    if (r != FL_OK)
-      break;
+    r = FlWalkDirStr(&c->walk_path, fl_walk_sub_callback, &pool);
+    if (r == FL_OK) {
+      fl_sub_pool_start(&pool);
+    } else {
+      // listed but not parsed
+      InterlockedExchange(&pool.closing, 1);
+    }
+    const int r_merge = fl_sub_pool_merge(&pool);
+    if (r == FL_OK)
+      r = r_merge;
   } while (0);
+  fl_sub_pool_close(&pool);
   return r;
 }
 
+static int fl_query_file_id(const wchar_t *path, FS_FileMeta *meta) {
+  BY_HANDLE_FILE_INFORMATION info;
+  int ok = 0;
+  HANDLE h = CreateFile(
+      path, FILE_READ_ATTRIBUTES,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h != INVALID_HANDLE_VALUE) {
+    if (GetFileInformationByHandle(h, &info)) {
+      meta->id_lo = info.nFileIndexLow;
+      meta->id_hi = info.nFileIndexHigh;
+      meta->volume = info.dwVolumeSerialNumber;
+      ok = 1;
+    }
+    CloseHandle(h);
+  }
+  return ok;
+}
+
 static int
 fl_walk_font_callback(const wchar_t *path, WIN32_FIND_DATA *data, void *arg) {
   FL_LoaderCtx *c = arg;
@@ -171,13 +536,27 @@ fl_walk_font_callback(const wchar_t *path, WIN32_FIND_DATA *data, void *arg) {
   if (!(match_attr && match_ext))
     return FL_OK;
 
+  // skip the base path + '\'
+  const wchar_t *tag = path + str_db_tell(&c->font_path) + 1;
+  FS_FileMeta meta = {
+      .size_lo = data->nFileSizeLow,
+      .size_hi = data->nFileSizeHigh,
+      .mtime_lo = data->ftLastWriteTime.dwLowDateTime,
+      .mtime_hi = data->ftLastWriteTime.dwHighDateTime};
+
+  // unchanged since last scan?
+  if (fs_add_cached(c->font_set, c->prev_font_set, tag, &meta) == FL_OK)
+    return FL_OK;
+  // maybe renamed or moved, check again by file id
+  if (fl_query_file_id(path, &meta) &&
+      fs_add_cached(c->font_set, c->prev_font_set, tag, &meta) == FL_OK)
+    return FL_OK;
+
   // try load the file
   memmap_t map;
   FlMemMap(path, &map);
   if (map.data) {
-    // skip the base path + '\'
-    const wchar_t *tag = path + str_db_tell(&c->font_path) + 1;
-    fs_add_font(c->font_set, tag, map.data, map.size);
+    fs_add_font(c->font_set, tag, &meta, map.data, map.size);
     FlMemUnmap(&map);
   }
   return FL_OK;
@@ -237,8 +616,9 @@ int fl_scan_fonts(
     const wchar_t *black) {
   // caller: fl_unload_fonts
 
-  // free previous font set
-  fs_free(c->font_set);
+  // keep previous font set, unchanged files are copied from it on rescan
+  fs_free(c->prev_font_set);
+  c->prev_font_set = c->font_set;
   c->font_set = NULL;
 
   int r = FlResolvePath(path, &c->font_path);
@@ -287,8 +667,8 @@ int fl_scan_fonts(
     }
   }
   if (r == FL_OK) {
-    r = fs_build_index(c->font_set);
     fl_blacklist_load(c, black);
+    r = fs_build_index(c->font_set);
   }
 
   // failed
@@ -296,82 +676,232 @@ int fl_scan_fonts(
     fs_free(c->font_set);
     c->font_set = NULL;
   }
+  fs_free(c->prev_font_set);
+  c->prev_font_set = NULL;
 
   return r;
 }
 
 int fl_save_cache(FL_LoaderCtx *c, const wchar_t *cache) {
+  // write aside and rename over, the cache may be mapped by the font set
   int r = FL_OK;
-  str_db_seek(&c->walk_path, 0);
-  if (!str_db_push_u16_le(&c->walk_path, str_db_get(&c->font_path, 0), 0) ||
-      !str_db_push_u16_le(&c->walk_path, L"\\", 1) ||
-      !str_db_push_u16_le(&c->walk_path, cache, 0)) {
+  str_db_t path;
+  str_db_init(&path, c->alloc, 0, 1);
+  const wchar_t *dir = str_db_get(&c->font_path, 0);
+  const size_t pos_tmp = 0;
+  size_t pos_old = 0, pos_dst = 0;
+  if (!str_db_push_prefix(&path, dir, 0) ||
+      !str_db_push_prefix(&path, L"\\", 1) ||
+      !str_db_push_prefix(&path, cache, 0) ||
+      !str_db_push_u16_le(&path, L".tmp", 0) ||
+      (pos_old = str_db_tell(&path)) == 0 ||
+      !str_db_push_prefix(&path, dir, 0) ||
+      !str_db_push_prefix(&path, L"\\", 1) ||
+      !str_db_push_prefix(&path, cache, 0) ||
+      !str_db_push_u16_le(&path, L".old", 0) ||
+      (pos_dst = str_db_tell(&path)) == 0 ||
+      !str_db_push_prefix(&path, dir, 0) ||
+      !str_db_push_prefix(&path, L"\\", 1) ||
+      !str_db_push_u16_le(&path, cache, 0)) {
     r = FL_OUT_OF_MEMORY;
   }
 
   if (r == FL_OK) {
-    r = fs_cache_dump(c->font_set, str_db_get(&c->walk_path, 0));
+    r = fs_cache_dump(c->font_set, str_db_get(&path, pos_tmp));
   }
+  if (r == FL_OK) {
+    const wchar_t *tmp = str_db_get(&path, pos_tmp);
+    const wchar_t *old = str_db_get(&path, pos_old);
+    const wchar_t *dst = str_db_get(&path, pos_dst);
+    DeleteFile(old);
+    if (GetFileAttributes(tmp) == INVALID_FILE_ATTRIBUTES) {
+      // empty set, deleted on close
+      if (!DeleteFile(dst))
+        MoveFileEx(dst, old, MOVEFILE_REPLACE_EXISTING);
+    } else if (!MoveFileEx(tmp, dst, MOVEFILE_REPLACE_EXISTING)) {
+      // a mapped file can be renamed, but not replaced
+      if (!MoveFileEx(dst, old, MOVEFILE_REPLACE_EXISTING) ||
+          !MoveFileEx(tmp, dst, MOVEFILE_REPLACE_EXISTING)) {
+        DeleteFile(tmp);
+        r = FL_OS_ERROR;
+      }
+    }
+  }
+  str_db_free(&path);
   return r;
 }
 
+// 1 if installed, 0 if not, -1 if the face is unknown to the snapshot
+static int fl_sys_font_find(FL_LoaderCtx *c, const wchar_t *face, uint32_t h) {
+  uint32_t probe = 0, pos;
+  while ((pos = hash_tab_next(&c->sys_font_hash, h, &probe)) != kHashTabNone) {
+    if (FlStrCmpIW(face, str_db_get(&c->sys_font, pos & ~kSysFontMiss)) == 0)
+      return !(pos & kSysFontMiss);
+  }
+  return -1;
+}
+
+static int
+fl_sys_font_put(FL_LoaderCtx *c, const wchar_t *face, uint32_t h, int miss) {
+  const size_t pos = str_db_tell(&c->sys_font);
+  if (!str_db_push_u16_le(&c->sys_font, face, 0) ||
+      !hash_tab_insert(
+          &c->sys_font_hash, h, (uint32_t)pos | (miss ? kSysFontMiss : 0)))
+    return FL_OUT_OF_MEMORY;
+  return FL_OK;
+}
+
+int fl_sys_font_add(FL_LoaderCtx *c, const wchar_t *face) {
+  const uint32_t h = fl_sys_font_hash(face);
+  if (fl_sys_font_find(c, face, h) >= 0)
+    return FL_OK;  // same family, another charset
+  return fl_sys_font_put(c, face, h, 0);
+}
+
+int fl_sys_font_invalidate(FL_LoaderCtx *c) {
+  InterlockedExchange(&c->sys_font_ok, 0);
+  return FL_OK;
+}
+
+typedef struct {
+  FL_LoaderCtx *c;
+  int r;
+} FL_EnumFontCtx;
+
 static int CALLBACK enum_fonts(
     const LOGFONTW *lfp,
     const TEXTMETRICW *tmp,
     DWORD fontType,
     LPARAM lParam) {
+  FL_EnumFontCtx *ctx = (FL_EnumFontCtx *)lParam;
+  ctx->r = fl_sys_font_add(ctx->c, lfp->lfFaceName);
+  return ctx->r == FL_OK;  // continue
+}
+
+static int fl_enum_sys_fonts(FL_LoaderCtx *c, void *param) {
+  if (MOCK_NO_SYS)
+    return FL_OK;
+  // every family of every charset, by its name in the UI language only
+  FL_EnumFontCtx ctx = {.c = c, .r = FL_OK};
+  LOGFONTW lf = {.lfCharSet = DEFAULT_CHARSET};
+  HDC dc = GetDC(0);
+  EnumFontFamiliesEx(dc, &lf, enum_fonts, (LPARAM)&ctx, 0);
+  ReleaseDC(0, dc);
+  return ctx.r;
+}
+
+static int fl_sys_font_update(FL_LoaderCtx *c) {
+  if (InterlockedExchange(&c->sys_font_ok, 1))
+    return FL_OK;
+
+  str_db_seek(&c->sys_font, 0);
+  hash_tab_clear(&c->sys_font_hash);
+  FL_SysFontCallback cb = c->sys_font_cb ? c->sys_font_cb : fl_enum_sys_fonts;
+  const int r = cb(c, c->sys_font_param);
+  if (r != FL_OK)
+    fl_sys_font_invalidate(c);
+  return r;
+}
+
+static int CALLBACK enum_face_found(
+    const LOGFONTW *lfp,
+    const TEXTMETRICW *tmp,
+    DWORD fontType,
+    LPARAM lParam) {
   int *r = (int *)lParam;
   *r = 1;
-  return 1;  // continue
+  return 0;  // stop
 }
 
-static int IsFontInstalled(const wchar_t *face) {
+// a query by name matches localized and other names of a family too
+static int fl_gdi_has_face(const wchar_t *face) {
   if (MOCK_NO_SYS)
     return 0;
   int found = 0;
   HDC dc = GetDC(0);
-  EnumFontFamilies(dc, face, enum_fonts, (LPARAM)&found);
+  EnumFontFamilies(dc, face, enum_face_found, (LPARAM)&found);
   ReleaseDC(0, dc);
   return found;
 }
 
+static int IsFontInstalled(FL_LoaderCtx *c, const wchar_t *face) {
+  const uint32_t h = fl_sys_font_hash(face);
+  const int found = fl_sys_font_find(c, face, h);
+  if (found >= 0 || c->sys_font_cb)
+    return found > 0;
+
+  // missed by the enumeration, ask GDI and keep the answer in the snapshot
+  const int installed = fl_gdi_has_face(face);
+  fl_sys_font_put(c, face, h, !installed);
+  return installed;
+}
+
+static uint32_t fl_ptr_hash(const void *ptr) {
+  return str_hash(
+      kStrHashInit, (const wchar_t *)&ptr, sizeof ptr / sizeof(wchar_t));
+}
+
 static int fl_face_loaded(FL_LoaderCtx *c, const wchar_t *face) {
-  const size_t pos = str_db_tell(&c->walk_path);
   FL_FontMatch *data = c->loaded_font.data;
-  for (size_t i = 0; i != c->loaded_font.n; i++) {
-    FL_FontMatch *m = &data[i];
-    if (m->face == face)
+  const uint32_t h = fl_ptr_hash(face);
+  uint32_t probe = 0, i;
+  while ((i = hash_tab_next(&c->loaded_face, h, &probe)) != kHashTabNone) {
+    if (data[i].face == face)
       return 1;
   }
   return 0;
 }
 
 static int fl_file_loaded(FL_LoaderCtx *c, const wchar_t *file) {
-  const size_t pos = str_db_tell(&c->walk_path);
   FL_FontMatch *data = c->loaded_font.data;
-  for (size_t i = 0; i != c->loaded_font.n; i++) {
-    FL_FontMatch *m = &data[i];
-    if (m->filename == file)
+  const uint32_t h = fl_ptr_hash(file);
+  uint32_t probe = 0, i;
+  while ((i = hash_tab_next(&c->loaded_file, h, &probe)) != kHashTabNone) {
+    if (data[i].filename == file)
       return i;
   }
   return -1;
 }
 
-static int fl_hash_loaded(FL_LoaderCtx *c, const uint8_t hash[32]) {
-  const size_t pos = str_db_tell(&c->walk_path);
-  FL_FontMatch *data = c->loaded_font.data;
-  for (size_t i = 0; i != c->loaded_font.n; i++) {
-    FL_FontMatch *m = &data[i];
-    if (m->flag & FL_LOAD_OK) {
-      uint8_t dif = 0;
-      for (int j = 0; j != 32; j++) {
-        dif |= m->hash[j] ^ hash[j];
-      }
-      if (!dif)
-        return i;
-    }
-  }
-  return -1;
+// the first record of each face and file is indexed
+static int fl_index_rec(FL_LoaderCtx *c, uint32_t i) {
+  const FL_FontMatch *m = (const FL_FontMatch *)c->loaded_font.data + i;
+  int ok = 1;
+  if (!fl_face_loaded(c, m->face))
+    ok = hash_tab_insert(&c->loaded_face, fl_ptr_hash(m->face), i);
+  if (ok && m->filename && fl_file_loaded(c, m->filename) == -1)
+    ok = hash_tab_insert(&c->loaded_file, fl_ptr_hash(m->filename), i);
+  if (ok && (m->flag & (FL_LOAD_OK | FL_LOAD_PENDING)) &&
+      !(m->flag & FL_LOAD_DUP))
+    ok = hash_tab_insert(&c->loaded_fp, m->fingerprint, i);
+  return ok ? FL_OK : FL_OUT_OF_MEMORY;
+}
+
+// append to loaded_font
+static int fl_add_match(FL_LoaderCtx *c, FL_FontMatch *m) {
+  const uint32_t i = (uint32_t)c->loaded_font.n;
+  if (!vec_append(&c->loaded_font, m, 1))
+    return FL_OUT_OF_MEMORY;
+  return fl_index_rec(c, i);
+}
+
+// index loaded_font again, e.g. after sorting
+static int fl_index_match(FL_LoaderCtx *c) {
+  int r = FL_OK;
+  hash_tab_clear(&c->loaded_face);
+  hash_tab_clear(&c->loaded_file);
+  hash_tab_clear(&c->loaded_fp);
+  for (uint32_t i = 0; r == FL_OK && i != c->loaded_font.n; i++)
+    r = fl_index_rec(c, i);
+  return r;
+}
+
+static void fl_clear_match(FL_LoaderCtx *c) {
+  fl_cache_release(c);
+  vec_clear(&c->loaded_font);
+  hash_tab_clear(&c->loaded_face);
+  hash_tab_clear(&c->loaded_file);
+  hash_tab_clear(&c->loaded_fp);
 }
 
 static int
@@ -379,24 +909,10 @@ fl_calc_hash(FL_LoaderCtx *c, const void *data, size_t size, uint8_t res[32]) {
   int ok = 0;
   NTSTATUS status;
   BCRYPT_HASH_HANDLE hash = NULL;
-  void *hash_obj = NULL;
-  DWORD sz_hash_obj = 0;
-  DWORD sz_data = 0;
-  allocator_t *alloc = c->alloc;
 
   do {
-    status = BCryptGetProperty(
-        c->hash_alg, BCRYPT_OBJECT_LENGTH, (PBYTE)&sz_hash_obj,
-        sizeof sz_hash_obj, &sz_data, 0);
-    if (!NT_SUCCESS(status))
-      break;
-
-    hash_obj = alloc->alloc(hash_obj, sz_hash_obj, alloc->arg);
-    if (hash_obj == NULL)
-      break;
-
-    status =
-        BCryptCreateHash(c->hash_alg, &hash, hash_obj, sz_hash_obj, NULL, 0, 0);
+    status = BCryptCreateHash(
+        c->hash_alg, &hash, c->hash_obj, c->sz_hash_obj, NULL, 0, 0);
     if (!NT_SUCCESS(status))
       break;
 
@@ -412,19 +928,502 @@ fl_calc_hash(FL_LoaderCtx *c, const void *data, size_t size, uint8_t res[32]) {
   } while (0);
 
   BCryptDestroyHash(hash);
-  alloc->alloc(hash_obj, 0, alloc->arg);
   return ok ? FL_OK : FL_OS_ERROR;
 }
 
-static int fl_load_file(
-    FL_LoaderCtx *c,
-    const wchar_t *face,
-    const wchar_t *file,
-    int *dup) {
+static int fl_hash_equal(const uint8_t x[32], const uint8_t y[32]) {
+  const uint64_t *a = (const uint64_t *)x;
+  const uint64_t *b = (const uint64_t *)y;
+  return ((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]) | (a[3] ^ b[3])) == 0;
+}
+
+static uint32_t fl_fingerprint(const void *data, size_t size) {
+  // size, head and tail blocks, where font files tend to differ
+  const size_t block = 4096;
+  const uint8_t *p = (const uint8_t *)data;
+  uint32_t h = FlFastHash((uint32_t)size, p, size < block ? size : block);
+  if (size > block) {
+    const size_t tail = size - block < block ? size - block : block;
+    h = FlFastHash(h, p + size - tail, tail);
+  }
+  return h;
+}
+
+static const wchar_t *fl_font_full_path(FL_LoaderCtx *c, const wchar_t *file) {
+  str_db_seek(&c->walk_path, 0);
+  if (!str_db_push_u16_le(&c->walk_path, str_db_get(&c->font_path, 0), 0) ||
+      !str_db_push_u16_le(&c->walk_path, L"\\", 1) ||
+      !str_db_push_u16_le(&c->walk_path, file, 0))
+    return NULL;
+  return str_db_get(&c->walk_path, 0);
+}
+
+// SHA256 of a file, from the font set if it's unchanged since then
+static int
+fl_file_digest(FL_LoaderCtx *c, const wchar_t *file, uint8_t hash[32]) {
+  const wchar_t *path = fl_font_full_path(c, file);
+  if (path == NULL)
+    return FL_OUT_OF_MEMORY;
+
+  WIN32_FILE_ATTRIBUTE_DATA attr;
+  FS_FileMeta meta;
+  const int has_meta = GetFileAttributesEx(path, GetFileExInfoStandard, &attr);
+  if (has_meta) {
+    zmemset(&meta, 0, sizeof meta);
+    meta.size_lo = attr.nFileSizeLow;
+    meta.size_hi = attr.nFileSizeHigh;
+    meta.mtime_lo = attr.ftLastWriteTime.dwLowDateTime;
+    meta.mtime_hi = attr.ftLastWriteTime.dwHighDateTime;
+    if (c->font_set_lock)
+      EnterCriticalSection(c->font_set_lock);
+    const int found = fs_digest_get(c->font_set, file, &meta, hash);
+    if (c->font_set_lock)
+      LeaveCriticalSection(c->font_set_lock);
+    if (found)
+      return FL_OK;
+  }
+
+  memmap_t map;
+  FlMemMap(path, &map);
+  if (map.data == NULL)
+    return FL_OS_ERROR;
+  const int r = fl_calc_hash(c, map.data, map.size, hash);
+  FlMemUnmap(&map);
+  if (r == FL_OK && has_meta) {
+    // failure only costs another hash next time
+    if (c->font_set_lock)
+      EnterCriticalSection(c->font_set_lock);
+    fs_digest_put(c->font_set, file, &meta, hash);
+    if (c->font_set_lock)
+      LeaveCriticalSection(c->font_set_lock);
+  }
+  return r;
+}
+
+// pass 2 of fl_load_fonts runs as a pipeline. faces are resolved to candidate
+// files up front, workers fingerprint them ahead of the dedup pass, which
+// stays in order on the calling thread and hands registration back to the
+// workers. results are committed in order, so the records are the same as
+// loading the files one by one.
+//
+// candidates of a face share format and version, as the index groups them.
+// they're ranked before any I/O, and bucketed by full name: one file is
+// registered per bucket, the next one only if it fails.
+#define kFlMaxWorker (4)
+#define kFlItemReg (0x80000000u)
+
+typedef struct {
+  const wchar_t *face;
+  const wchar_t *file;  // NULL if the face is not found
+  const wchar_t *full;  // full name of the font, or NULL
+  int fuzzy;
+  int exact;      // found by the face itself, not a face prefixed by it
+  uint32_t kind;  // FS_NameKind
+  uint64_t file_size;
+  uint32_t bucket;  // first job of the face with the same full name
+  int queued;       // fingerprint is queued
+  int tried;
+  int taken;  // of the bucket, a file is loaded or pending
+  int retry;  // of the bucket, registration failed
+  int mapped;
+  size_t size;
+  uint32_t fingerprint;
+  uint32_t rec;  // in loaded_font, while registering
+  int reg_ok;
+  volatile LONG hashed;
+  volatile LONG registered;
+} FL_LoadJob;
+
+typedef struct _FL_LoadPipe FL_LoadPipe;
+
+typedef struct {
+  FL_LoadPipe *pipe;
+  str_db_t path;
+} FL_LoadWorker;
+
+struct _FL_LoadPipe {
+  FL_LoaderCtx *c;
+  vec_t jobs;               // FL_LoadJob, fixed once workers start
+  uint32_t *item;           // job to run, with kFlItemReg to register it
+  volatile LONG num_item;   // published to workers
+  volatile LONG next_item;  // claimed by workers
+  uint32_t *reg;            // jobs in order of registration
+  uint32_t num_reg;
+  uint32_t num_commit;
+  volatile LONG closing;  // skip the remaining items
+  HANDLE sem_item;        // a count per item
+  HANDLE evt_done;        // an item is done
+  uint32_t num_worker;
+  HANDLE thread[kFlMaxWorker];
+  FL_LoadWorker worker[kFlMaxWorker + 1];  // the last one is the caller
+};
+
+static int fl_gdi_add(FL_FontRegistry *reg, const wchar_t *path) {
+  if (MOCK_FAKE_LOAD) {
+    if (MOCK_DELAY_FONT)
+      Sleep(MOCK_DELAY_FONT);
+    return 1;
+  }
+  return AddFontResource(path) != 0;
+}
+
+static int fl_gdi_remove(FL_FontRegistry *reg, const wchar_t *path) {
+  const int ok = RemoveFontResource(path) != 0;
+  if (MOCK_DELAY_FONT)
+    Sleep(MOCK_DELAY_FONT);
+  return ok;
+}
+
+static FL_FontRegistry kFlGdiRegistry = {fl_gdi_add, fl_gdi_remove};
+
+static FL_FontRegistry *fl_registry(FL_LoaderCtx *c) {
+  return c->registry ? c->registry : &kFlGdiRegistry;
+}
+
+static int fl_face_retained(FL_LoaderCtx *c, const wchar_t *face) {
+  const FL_RetainRec *data = c->retain_font.data;
+  const uint32_t h = fl_sys_font_hash(face);
+  uint32_t probe = 0, i;
+  while ((i = hash_tab_next(&c->retain_face, h, &probe)) != kHashTabNone) {
+    if (FlStrCmpIW(face, str_db_get(&c->retain, data[i].face)) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static int fl_file_retained(FL_LoaderCtx *c, const wchar_t *file) {
+  const FL_RetainRec *data = c->retain_font.data;
+  const uint32_t h = fl_sys_font_hash(file);
+  uint32_t probe = 0, i;
+  while ((i = hash_tab_next(&c->retain_file, h, &probe)) != kHashTabNone) {
+    if (FlStrCmpIW(file, str_db_get(&c->retain, data[i].file)) == 0)
+      return i;
+  }
+  return -1;
+}
+
+// a face of the retained files, by a record or by the index. a face new to the
+// subtitles isn't recorded, but its file may be retained for another one
+static int fl_face_in_retained(FL_LoaderCtx *c, const wchar_t *face) {
+  if (fl_face_retained(c, face))
+    return 1;
+  if (c->retain_file.n == 0 || c->font_set == NULL)
+    return 0;
+  FS_Iter it;
+  int found = fs_iter_new(c->font_set, face, &it);
+  for (; found; found = fs_iter_next_version(&it)) {
+    if (fl_file_retained(c, it.info.tag) != -1)
+      return 1;
+  }
+  return 0;
+}
+
+// reuse the registration of the same file, if its content is unchanged
+static int fl_keep_retained(FL_LoaderCtx *c, FL_FontMatch *m) {
+  const int i = fl_file_retained(c, m->filename);
+  if (i == -1)
+    return 0;
+  FL_RetainRec *rec = (FL_RetainRec *)c->retain_font.data + i;
+  if (rec->size != m->size || rec->fingerprint != m->fingerprint)
+    return 0;
+  if (rec->has_hash) {
+    if (!m->has_hash) {
+      if (fl_file_digest(c, m->filename, m->hash) != FL_OK)
+        return 0;
+      m->has_hash = 1;
+    }
+    if (!fl_hash_equal(m->hash, rec->hash))
+      return 0;
+  }
+  rec->kept = 1;
+  return 1;
+}
+
+static void fl_retain_clear(FL_LoaderCtx *c) {
+  str_db_seek(&c->retain, 0);
+  vec_clear(&c->retain_font);
+  hash_tab_clear(&c->retain_face);
+  hash_tab_clear(&c->retain_file);
+}
+
+// remove the retained fonts not reused by the current load
+static void fl_release_fonts(FL_LoaderCtx *c) {
+  FL_FontRegistry *reg = fl_registry(c);
+  const FL_RetainRec *data = c->retain_font.data;
+  for (size_t i = 0; i != c->retain_font.n; i++) {
+    if (!data[i].registered || data[i].kept)
+      continue;
+    const wchar_t *file = str_db_get(&c->retain, data[i].file);
+    const wchar_t *path = fl_font_full_path(c, file);
+    if (path != NULL)
+      reg->remove(reg, path);
+    c->num_font_changed++;
+  }
+  fl_retain_clear(c);
+}
+
+static int fl_retain_match(FL_LoaderCtx *c, const FL_FontMatch *m) {
+  // FL_RetainRec rec = {0};
+  FL_RetainRec rec;
+  zmemset(&rec, 0, sizeof rec);
+  const uint32_t id = (uint32_t)c->retain_font.n;
+  rec.face = str_db_tell(&c->retain);
+  if (!str_db_push_u16_le(&c->retain, m->face, 0))
+    return FL_OUT_OF_MEMORY;
+  if (!(m->flag & FL_LOAD_DUP)) {
+    rec.registered = 1;
+    rec.file = str_db_tell(&c->retain);
+    rec.size = m->size;
+    rec.fingerprint = m->fingerprint;
+    rec.has_hash = m->has_hash;
+    zmemcpy(rec.hash, m->hash, sizeof rec.hash);
+    if (!str_db_push_u16_le(&c->retain, m->filename, 0))
+      return FL_OUT_OF_MEMORY;
+  }
+  if (!vec_append(&c->retain_font, &rec, 1) ||
+      !hash_tab_insert(&c->retain_face, fl_sys_font_hash(m->face), id))
+    return FL_OUT_OF_MEMORY;
+  if (rec.registered &&
+      !hash_tab_insert(&c->retain_file, fl_sys_font_hash(m->filename), id))
+    return FL_OUT_OF_MEMORY;
+  return FL_OK;
+}
+
+int fl_retain_fonts(FL_LoaderCtx *c) {
+  fl_release_fonts(c);
   int r = FL_OK;
-  int candidate;
+  const FL_FontMatch *data = c->loaded_font.data;
+  for (size_t i = 0; r == FL_OK && i != c->loaded_font.n; i++) {
+    if (data[i].flag & FL_LOAD_OK)
+      r = fl_retain_match(c, &data[i]);
+  }
+  if (r != FL_OK) {
+    // unload all of them instead
+    fl_retain_clear(c);
+    return fl_unload_fonts(c);
+  }
+
+  fl_clear_match(c);
+  c->num_font_loaded = 0;
+  c->num_font_failed = 0;
+  c->num_font_unmatched = 0;
+  c->num_font_skipped = 0;
+  return FL_OK;
+}
+
+static const wchar_t *fl_worker_path(FL_LoadWorker *w, const wchar_t *file) {
+  FL_LoaderCtx *c = w->pipe->c;
+  str_db_seek(&w->path, 0);
+  if (!str_db_push_u16_le(&w->path, str_db_get(&c->font_path, 0), 0) ||
+      !str_db_push_u16_le(&w->path, L"\\", 1) ||
+      !str_db_push_u16_le(&w->path, file, 0))
+    return NULL;
+  return str_db_get(&w->path, 0);
+}
+
+static void fl_pipe_hash(FL_LoadWorker *w, FL_LoadJob *job) {
   memmap_t map = {0};
-  uint8_t hash[32];
+  const wchar_t *path = w->pipe->closing ? NULL : fl_worker_path(w, job->file);
+  if (path != NULL)
+    FlMemMap(path, &map);
+  if (map.data != NULL) {
+    job->mapped = 1;
+    job->size = map.size;
+    job->fingerprint = fl_fingerprint(map.data, map.size);
+  }
+  FlMemUnmap(&map);
+  InterlockedExchange(&job->hashed, 1);
+}
+
+static void fl_pipe_register(FL_LoadWorker *w, FL_LoadJob *job) {
+  FL_FontRegistry *reg = fl_registry(w->pipe->c);
+  const wchar_t *path = w->pipe->closing ? NULL : fl_worker_path(w, job->file);
+  job->reg_ok = path != NULL && reg->add(reg, path);
+  InterlockedExchange(&job->registered, 1);
+}
+
+// run the next item, 0 if there's none
+static int fl_pipe_run_one(FL_LoadWorker *w) {
+  FL_LoadPipe *p = w->pipe;
+  const uint32_t i = (uint32_t)InterlockedIncrement(&p->next_item) - 1;
+  if (i >= (uint32_t)p->num_item)
+    return 0;
+  FL_LoadJob *jobs = p->jobs.data;
+  const uint32_t item = p->item[i];
+  if (item & kFlItemReg) {
+    fl_pipe_register(w, &jobs[item & ~kFlItemReg]);
+  } else {
+    fl_pipe_hash(w, &jobs[item]);
+  }
+  SetEvent(p->evt_done);
+  return 1;
+}
+
+static DWORD WINAPI fl_load_worker(LPVOID param) {
+  FL_LoadWorker *w = (FL_LoadWorker *)param;
+  while (WaitForSingleObject(w->pipe->sem_item, INFINITE) == WAIT_OBJECT_0) {
+    if (!fl_pipe_run_one(w))
+      break;
+  }
+  return 0;
+}
+
+static void fl_pipe_push(FL_LoadPipe *p, uint32_t item) {
+  p->item[p->num_item] = item;
+  InterlockedIncrement(&p->num_item);
+  ReleaseSemaphore(p->sem_item, 1, NULL);
+}
+
+// wait for a flag of a job, running queued items meanwhile
+static void fl_pipe_wait(FL_LoadPipe *p, volatile LONG *flag) {
+  FL_LoadWorker *self = &p->worker[kFlMaxWorker];
+  while (!InterlockedCompareExchange(flag, 0, 0)) {
+    if (WaitForSingleObject(p->sem_item, 0) == WAIT_OBJECT_0) {
+      fl_pipe_run_one(self);
+    } else {
+      WaitForSingleObject(p->evt_done, INFINITE);
+    }
+  }
+}
+
+// wait for pending registrations, and update their records in order
+static void fl_pipe_sync(FL_LoadPipe *p) {
+  FL_LoaderCtx *c = p->c;
+  FL_LoadJob *jobs = p->jobs.data;
+  FL_FontMatch *data = c->loaded_font.data;
+  for (; p->num_commit != p->num_reg; p->num_commit++) {
+    FL_LoadJob *job = &jobs[p->reg[p->num_commit]];
+    fl_pipe_wait(p, &job->registered);
+    FL_FontMatch *m = &data[job->rec];
+    if (job->reg_ok) {
+      m->flag = (m->flag & FL_LOAD_FUZZY) | FL_LOAD_OK;
+      c->num_font_loaded++;
+      c->num_font_changed++;
+    } else {
+      m->flag = (m->flag & FL_LOAD_FUZZY) | FL_LOAD_ERR;
+      c->num_font_failed++;
+      // the next file of the bucket is tried by fl_load_retry
+      jobs[job->bucket].taken = 0;
+      jobs[job->bucket].retry = 1;
+    }
+  }
+}
+
+static int fl_pipe_open(FL_LoadPipe *p, FL_LoaderCtx *c) {
+  zmemset(p, 0, sizeof *p);
+  p->c = c;
+  vec_init(&p->jobs, sizeof(FL_LoadJob), c->alloc);
+  for (uint32_t i = 0; i != kFlMaxWorker + 1; i++) {
+    p->worker[i].pipe = p;
+    str_db_init(&p->worker[i].path, c->alloc, 0, 0);
+  }
+  p->sem_item = CreateSemaphore(NULL, 0, 0x7fffffff, NULL);
+  p->evt_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+  return p->sem_item && p->evt_done ? FL_OK : FL_OS_ERROR;
+}
+
+// queue the fingerprints and start workers, after jobs are resolved
+static int fl_pipe_start(FL_LoadPipe *p) {
+  allocator_t *alloc = p->c->alloc;
+  const uint32_t n = (uint32_t)p->jobs.n;
+  p->item = alloc->alloc(NULL, 2 * n * sizeof p->item[0] + 1, alloc->arg);
+  p->reg = alloc->alloc(NULL, n * sizeof p->reg[0] + 1, alloc->arg);
+  if (p->item == NULL || p->reg == NULL)
+    return FL_OUT_OF_MEMORY;
+
+  FL_LoadJob *jobs = p->jobs.data;
+  uint32_t num_item = 0;
+  for (uint32_t i = 0; i != n; i++) {
+    if (jobs[i].file && jobs[i].queued)
+      p->item[num_item++] = i;
+  }
+  p->num_item = num_item;
+  if (num_item == 0)
+    return FL_OK;
+  ReleaseSemaphore(p->sem_item, num_item, NULL);
+
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  uint32_t num_worker = info.dwNumberOfProcessors;
+  if (num_worker > kFlMaxWorker)
+    num_worker = kFlMaxWorker;
+  if (num_worker > num_item)
+    num_worker = num_item;
+  for (uint32_t i = 0; i < num_worker; i++) {
+    // the caller runs the items by itself, if there's no worker
+    p->thread[p->num_worker] =
+        CreateThread(NULL, 0, fl_load_worker, &p->worker[i], 0, NULL);
+    if (p->thread[p->num_worker])
+      p->num_worker++;
+  }
+  return FL_OK;
+}
+
+static void fl_pipe_close(FL_LoadPipe *p) {
+  allocator_t *alloc = p->c->alloc;
+  if (p->reg)
+    fl_pipe_sync(p);
+  InterlockedExchange(&p->closing, 1);
+  if (p->num_worker) {
+    ReleaseSemaphore(p->sem_item, p->num_worker, NULL);
+    WaitForMultipleObjects(p->num_worker, p->thread, TRUE, INFINITE);
+  }
+  for (uint32_t i = 0; i != p->num_worker; i++)
+    CloseHandle(p->thread[i]);
+  for (uint32_t i = 0; i != kFlMaxWorker + 1; i++)
+    str_db_free(&p->worker[i].path);
+  CloseHandle(p->sem_item);
+  CloseHandle(p->evt_done);
+  alloc->alloc(p->item, 0, alloc->arg);
+  alloc->alloc(p->reg, 0, alloc->arg);
+  vec_free(&p->jobs);
+}
+
+// compare with loaded files of the same fingerprint, then by SHA256
+static int fl_content_loaded(FL_LoadPipe *p, FL_FontMatch *m) {
+  FL_LoaderCtx *c = p->c;
+  FL_FontMatch *data = c->loaded_font.data;
+  uint32_t probe = 0, i;
+  while ((i = hash_tab_next(&c->loaded_fp, m->fingerprint, &probe)) !=
+         kHashTabNone) {
+    FL_FontMatch *got = &data[i];
+    if (got->fingerprint != m->fingerprint || got->size != m->size)
+      continue;
+    if (got->flag & FL_LOAD_PENDING) {
+      // a duplicate only if it's loaded
+      fl_pipe_sync(p);
+    }
+    if (!(got->flag & FL_LOAD_OK))
+      continue;
+    if (!m->has_hash) {
+      if (fl_file_digest(c, m->filename, m->hash) != FL_OK)
+        return -1;
+      m->has_hash = 1;
+    }
+    if (!got->has_hash) {
+      if (fl_file_digest(c, got->filename, got->hash) != FL_OK)
+        continue;
+      got->has_hash = 1;
+    }
+    if (fl_hash_equal(m->hash, got->hash))
+      return i;
+  }
+  return -1;
+}
+
+// FL_OK if the file is queued for registration, its record is pending
+static int fl_load_file(FL_LoadPipe *p, uint32_t id, int *dup) {
+  FL_LoaderCtx *c = p->c;
+  FL_LoadJob *job = (FL_LoadJob *)p->jobs.data + id;
+  int r = FL_OK;
+  int kept = 0;
+  int candidate;
+  FL_FontMatch m;
+  m.face = job->face;
+  m.filename = job->file;
+  m.size = 0;
+  m.fingerprint = 0;
+  m.has_hash = 0;
 
   do {
     if (vec_prealloc(&c->loaded_font, 1) == 0) {
@@ -433,74 +1432,147 @@ static int fl_load_file(
     }
 
     // check 1: if file pointer is loaded
-    candidate = fl_file_loaded(c, file);
+    candidate = fl_file_loaded(c, job->file);
     if (candidate != -1) {
       *dup = candidate;
       r = FL_DUP;
       break;
     }
 
-    // check 2: hash
-    str_db_seek(&c->walk_path, 0);
-    if (!str_db_push_u16_le(&c->walk_path, str_db_get(&c->font_path, 0), 0) ||
-        !str_db_push_u16_le(&c->walk_path, L"\\", 1) ||
-        !str_db_push_u16_le(&c->walk_path, file, 0)) {
-      r = FL_OUT_OF_MEMORY;
-      break;
-    }
-
-    const wchar_t *full_path = str_db_get(&c->walk_path, 0);
-    FlMemMap(full_path, &map);
-    if (map.data == NULL) {
+    // check 2: fingerprint, then hash on collision
+    fl_pipe_wait(p, &job->hashed);
+    if (!job->mapped) {
       r = FL_OS_ERROR;
       break;
     }
+    m.size = job->size;
+    m.fingerprint = job->fingerprint;
 
-    r = fl_calc_hash(c, map.data, map.size, hash);
-    if (r != FL_OK)
-      break;
-
-    candidate = fl_hash_loaded(c, hash);
+    candidate = fl_content_loaded(p, &m);
     if (candidate != -1) {
       *dup = candidate;
       r = FL_DUP;
       break;
     }
 
-    if (MOCK_FAKE_LOAD) {
-      if (MOCK_DELAY_FONT) {
-        Sleep(MOCK_DELAY_FONT);
-      }
-    } else if (AddFontResource(full_path) == 0) {
-      r = FL_OS_ERROR;
-      break;
-    }
+    // check 3: still registered by the previous load
+    kept = fl_keep_retained(c, &m);
   } while (0);
 
-  FlMemUnmap(&map);
   if (r != FL_OUT_OF_MEMORY && r != FL_DUP) {
-    FL_FontMatch m;
-    if (r == FL_OK) {
+    if (kept) {
       m.flag = FL_LOAD_OK;
       c->num_font_loaded++;
+    } else if (r == FL_OK) {
+      m.flag = FL_LOAD_PENDING;
+      job->rec = (uint32_t)c->loaded_font.n;
     } else {
       m.flag = FL_LOAD_ERR;
       c->num_font_failed++;
     }
-    m.face = face;
-    m.filename = file;
-    // copy SHA256 without memcpy
-    uint64_t *src = (uint64_t *)hash;
-    uint64_t *dst = (uint64_t *)m.hash;
-    dst[0] = src[0];
-    dst[1] = src[1];
-    dst[2] = src[2];
-    dst[3] = src[3];
-    vec_append(&c->loaded_font, &m, 1);
+    if (job->fuzzy)
+      m.flag |= FL_LOAD_FUZZY;
+    if (fl_add_match(c, &m) != FL_OK) {
+      r = FL_OUT_OF_MEMORY;
+    } else if (r == FL_OK && !kept) {
+      p->reg[p->num_reg++] = id;
+      fl_pipe_push(p, kFlItemReg | id);
+    }
+  }
+  return r;
+}
+
+// try a candidate, FL_OK or FL_DUP if it takes the bucket
+static int fl_load_candidate(FL_LoadPipe *p, uint32_t id, int *dup) {
+  FL_LoadJob *jobs = p->jobs.data;
+  FL_LoadJob *job = &jobs[id];
+  if (!job->queued) {
+    // a fallback, fingerprinted on demand
+    job->queued = 1;
+    fl_pipe_push(p, id);
   }
+  job->tried = 1;
+  const int r = fl_load_file(p, id, dup);
+  const FL_FontMatch *data = p->c->loaded_font.data;
+  if (r == FL_OK || (r == FL_DUP && !(data[*dup].flag & FL_LOAD_ERR)))
+    jobs[job->bucket].taken = 1;
   return r;
 }
 
+static int fl_kind_score(uint32_t kind) {
+  if (kind & FS_NameFamily)
+    return 3;
+  if (kind & FS_NameFull)
+    return 2;
+  if (kind & FS_NamePostScript)
+    return 1;
+  return 0;
+}
+
+// best candidate first
+static int fl_job_rank_sort(const void *ptr_a, const void *ptr_b, void *arg) {
+  const FL_LoadJob *a = ptr_a, *b = ptr_b;
+  if (a->exact != b->exact)
+    return b->exact - a->exact;
+
+  const int dk = fl_kind_score(b->kind) - fl_kind_score(a->kind);
+  if (dk != 0)
+    return dk;
+
+  // more glyphs, likely
+  if (a->file_size != b->file_size)
+    return a->file_size < b->file_size ? 1 : -1;
+  return 0;
+}
+
+// rank the candidates of a face, and bucket them by full name
+static void fl_rank_jobs(FL_LoadPipe *p, uint32_t first) {
+  FL_LoaderCtx *c = p->c;
+  FL_LoadJob *jobs = p->jobs.data;
+  const uint32_t end = (uint32_t)p->jobs.n;
+  tim_sort(
+      jobs + first, end - first, sizeof jobs[0], c->alloc, fl_job_rank_sort,
+      NULL);
+  for (uint32_t i = first; i != end; i++) {
+    FL_LoadJob *job = &jobs[i];
+    job->bucket = i;
+    for (uint32_t j = first; job->full && j != i; j++) {
+      if (jobs[j].full && FlStrCmpIW(jobs[j].full, job->full) == 0) {
+        job->bucket = jobs[j].bucket;
+        break;
+      }
+    }
+    // only the best of each bucket is fingerprinted ahead
+    job->queued = job->bucket == i;
+  }
+}
+
+// load the next file of the buckets failed to register, until all is settled
+static int fl_load_retry(FL_LoadPipe *p) {
+  FL_LoaderCtx *c = p->c;
+  int r = FL_OK;
+  int more;
+  do {
+    fl_pipe_sync(p);
+    more = 0;
+    FL_LoadJob *jobs = p->jobs.data;
+    for (uint32_t id = 0; r != FL_OUT_OF_MEMORY && id != p->jobs.n; id++) {
+      FL_LoadJob *job = &jobs[id];
+      const FL_LoadJob *leader = &jobs[job->bucket];
+      if (!job->file || job->tried || !leader->retry || leader->taken)
+        continue;
+      if ((r = fl_check_cancel(c)) != FL_OK)
+        return r;
+
+      int dup;
+      r = fl_load_candidate(p, id, &dup);
+      if (r == FL_OK)
+        more = 1;
+    }
+  } while (r != FL_OUT_OF_MEMORY && more);
+  return r == FL_OUT_OF_MEMORY ? r : FL_OK;
+}
+
 int fl_load_rec_sort(const void *ptr_a, const void *ptr_b, void *arg) {
   const FL_FontMatch *a = ptr_a, *b = ptr_b;
 
@@ -529,20 +1601,23 @@ int fl_load_rec_sort(const void *ptr_a, const void *ptr_b, void *arg) {
   return FlStrCmpIW(a->face, b->face);
 }
 
-int fl_load_fonts(FL_LoaderCtx *c) {
-  // caller: fl_unload_fonts
-
+// load the faces of sub_font from pos_begin, appended to loaded_font
+static int fl_load_faces(FL_LoaderCtx *c, size_t pos_begin) {
   int r = FL_OK;
-  c->num_font_failed = c->num_font_loaded = c->num_font_unmatched = 0;
 
   // pass 1: scan for existing fonts
-  size_t pos_it = 0;
+  if ((r = fl_sys_font_update(c)) != FL_OK)
+    return r;
+  size_t pos_it = pos_begin;
   const wchar_t *face;
   while (r == FL_OK && (face = str_db_next(&c->sub_font, &pos_it)) != NULL) {
     if ((r = fl_check_cancel(c)) != FL_OK)
       return r;
+    if (fl_face_loaded(c, face))
+      continue;
 
-    if (IsFontInstalled(face)) {
+    // fonts retained are found in the snapshot, but they're not installed
+    if (IsFontInstalled(c, face) && !fl_face_in_retained(c, face)) {
       if (vec_prealloc(&c->loaded_font, 1) == 0)
         r = FL_OUT_OF_MEMORY;
       if (r == FL_OK) {
@@ -551,65 +1626,184 @@ int fl_load_fonts(FL_LoaderCtx *c) {
         m.flag = FL_OS_LOADED;
         m.face = face;
         m.filename = NULL;
-        vec_append(&c->loaded_font, &m, 1);
+        r = fl_add_match(c, &m);
       }
     }
   }
+  if (r != FL_OK)
+    return r;
 
-  // pass 2: load the missing font
+  // pass 2: resolve the missing faces to files
   const size_t sys_fonts = c->loaded_font.n;
-  pos_it = 0;
-  while (r != FL_OUT_OF_MEMORY &&
-         (face = str_db_next(&c->sub_font, &pos_it)) != NULL) {
+  int font_set_tried = c->font_set != NULL;
+  FL_LoadPipe pipe;
+  r = fl_pipe_open(&pipe, c);
+  pos_it = pos_begin;
+  while (r == FL_OK && (face = str_db_next(&c->sub_font, &pos_it)) != NULL) {
     if (fl_face_loaded(c, face))
       continue;
-    if (vec_prealloc(&c->loaded_font, 1) == 0) {
-      r = FL_OUT_OF_MEMORY;
+    if ((r = fl_check_cancel(c)) != FL_OK)
       break;
+
+    if (!font_set_tried) {
+      // first face to look up, time to get the index
+      font_set_tried = 1;
+      if (c->font_set_cb && (r = c->font_set_cb(c, c->font_set_param)) != FL_OK)
+        break;
     }
 
     FS_Iter it;
-    if (!fs_iter_new(c->font_set, face, &it)) {
+    // FL_LoadJob job = {.face = face};
+    FL_LoadJob job;
+    zmemset(&job, 0, sizeof job);
+    job.face = face;
+    int found = fs_iter_new(c->font_set, face, &it);
+    if (!found) {
+      // fall back to the closest face
+      found = job.fuzzy = fs_iter_fuzzy(c->font_set, face, &c->fuzzy_buf, &it);
+    }
+    const uint32_t first_job = (uint32_t)pipe.jobs.n;
+    do {
+      FS_FileMeta meta;
+      job.file = NULL;
+      if (found) {
+        job.file = it.info.tag;
+        job.full = it.info.full;
+        job.kind = it.info.kind;
+        job.exact = !job.fuzzy && FlStrCmpIW(it.info.face, face) == 0;
+        job.file_size = 0;
+        if (fs_file_meta(c->font_set, it.info.tag, &meta))
+          job.file_size = (uint64_t)meta.size_hi << 32 | meta.size_lo;
+      }
+      if (!vec_append(&pipe.jobs, &job, 1))
+        r = FL_OUT_OF_MEMORY;
+    } while (r == FL_OK && found && fs_iter_next(&it));
+    if (r == FL_OK && found)
+      fl_rank_jobs(&pipe, first_job);
+  }
+  if (r == FL_OK)
+    r = fl_pipe_start(&pipe);
+  if (r != FL_OK) {
+    fl_pipe_close(&pipe);
+    return r;
+  }
+
+  // pass 3: load the best file of each bucket, face by face. a file already
+  // loaded or retained is preferred, as it costs no registration
+  FL_LoadJob *jobs = pipe.jobs.data;
+  uint32_t id = 0;
+  while (r != FL_OUT_OF_MEMORY && id != pipe.jobs.n) {
+    face = jobs[id].face;
+    if (jobs[id].file == NULL) {
       // FL_FontMatch m = {.flag = FL_LOAD_MISS, .face = face};
       FL_FontMatch m;
       m.flag = FL_LOAD_MISS;
       m.face = face;
       m.filename = NULL;
-      vec_append(&c->loaded_font, &m, 1);
+      r = fl_add_match(c, &m);
       c->num_font_unmatched++;
-    } else {
-      int num_loaded = 0;
-      int num_dup = 0;
-      int num_total = 0;
-      int dup_candidate = 0;
-      do {
-        if ((r = fl_check_cancel(c)) != FL_OK)
+      id++;
+      continue;
+    }
+
+    int num_loaded = 0;  // pending ones included
+    int num_dup = 0;
+    int num_total = 0;
+    int dup_candidate = 0;
+    const size_t first_rec = c->loaded_font.n;
+    const uint32_t first = id;
+    while (id != pipe.jobs.n && jobs[id].face == face)
+      id++;
+    for (int pass = 0; pass != 2; pass++) {
+      for (uint32_t i = first; i != id; i++) {
+        FL_LoadJob *job = &jobs[i];
+        if (r == FL_OUT_OF_MEMORY || num_loaded > 16)
+          break;
+        if (job->tried || jobs[job->bucket].taken)
+          continue;
+        const int loaded = fl_file_loaded(c, job->file) != -1 ||
+                           fl_file_retained(c, job->file) != -1;
+        if ((pass == 0) != loaded)
+          continue;
+        if ((r = fl_check_cancel(c)) != FL_OK) {
+          fl_pipe_close(&pipe);
           return r;
+        }
 
-        r = fl_load_file(c, face, it.info.tag, &dup_candidate);
+        r = fl_load_candidate(&pipe, i, &dup_candidate);
         num_total++;
         if (r == FL_DUP)
           num_dup++;
         if (r == FL_OK)
           num_loaded++;
-      } while (r != FL_OUT_OF_MEMORY && num_loaded <= 16 && fs_iter_next(&it));
-      if (num_dup == num_total) {
-        // FL_FontMatch m = {.flag = FL_LOAD_DUP, .face = face};
-        FL_FontMatch m;
-        FL_FontMatch *data = c->loaded_font.data;
-        FL_FontMatch *ref = &data[dup_candidate];
-        m.flag = FL_LOAD_DUP | data[dup_candidate].flag;
-        m.face = face;
-        m.filename = ref->filename;
-        vec_append(&c->loaded_font, &m, 1);
+        if (num_loaded > 16) {
+          // the limit is on fonts actually loaded
+          fl_pipe_sync(&pipe);
+          FL_FontMatch *data = c->loaded_font.data;
+          num_loaded = 0;
+          for (size_t k = first_rec; k != c->loaded_font.n; k++)
+            num_loaded += (data[k].flag & FL_LOAD_OK) != 0;
+        }
       }
     }
+    if (num_total != 0 && num_dup == num_total) {
+      // FL_FontMatch m = {.flag = FL_LOAD_DUP, .face = face};
+      FL_FontMatch m;
+      FL_FontMatch *data = c->loaded_font.data;
+      if (data[dup_candidate].flag & FL_LOAD_PENDING)
+        fl_pipe_sync(&pipe);
+      FL_FontMatch *ref = &data[dup_candidate];
+      m.flag = FL_LOAD_DUP | data[dup_candidate].flag;
+      m.face = face;
+      m.filename = ref->filename;
+      if (fl_add_match(c, &m) != FL_OK)
+        r = FL_OUT_OF_MEMORY;
+    }
+  }
+  if (r != FL_OUT_OF_MEMORY && (r = fl_load_retry(&pipe)) != FL_OK &&
+      r != FL_OUT_OF_MEMORY) {
+    fl_pipe_close(&pipe);
+    return r;
   }
+  for (id = 0; id != pipe.jobs.n; id++)
+    c->num_font_skipped += jobs[id].file && !jobs[id].tried;
+  fl_pipe_close(&pipe);
+  fl_release_fonts(c);
   tim_sort(
       c->loaded_font.data, c->loaded_font.n, c->loaded_font.size, c->alloc,
       fl_load_rec_sort, NULL);
 
-  return FL_OK;
+  c->sub_font_done = str_db_tell(&c->sub_font);
+  c->sub_font_base = str_db_get(&c->sub_font, 0);
+  return fl_index_match(c);
+}
+
+int fl_load_fonts(FL_LoaderCtx *c) {
+  // caller: fl_unload_fonts
+  c->num_font_failed = c->num_font_loaded = c->num_font_unmatched = 0;
+  c->num_font_skipped = 0;
+  c->num_font_changed = 0;
+  fl_clear_match(c);
+  return fl_load_faces(c, 0);
+}
+
+int fl_load_new_fonts(FL_LoaderCtx *c) {
+  // the views are mapped again with the new fonts
+  fl_cache_release(c);
+  c->num_font_changed = 0;
+
+  const wchar_t *base = str_db_get(&c->sub_font, 0);
+  if (base != c->sub_font_base) {
+    // sub_font is moved by fl_add_subs
+    FL_FontMatch *data = c->loaded_font.data;
+    for (size_t i = 0; i != c->loaded_font.n; i++)
+      data[i].face = base + (data[i].face - c->sub_font_base);
+    c->sub_font_base = base;
+    int r = fl_index_match(c);
+    if (r != FL_OK)
+      return r;
+  }
+  return fl_load_faces(c, c->sub_font_done);
 }
 
 int fl_walk_loaded_fonts(FL_LoaderCtx *c, WalkLoadedCallback cb, void *param) {
@@ -648,60 +1842,74 @@ fl_unload_cb(FL_LoaderCtx *c, size_t i, const wchar_t *path, void *param) {
     if (m->flag & FL_LOAD_OK) {
       c->num_font_loaded--;
     }
-    RemoveFontResource(path);
-    if (MOCK_DELAY_FONT) {
-      Sleep(MOCK_DELAY_FONT);
-    }
+    FL_FontRegistry *reg = fl_registry(c);
+    reg->remove(reg, path);
   }
   return 0;
 }
 
 int fl_unload_fonts(FL_LoaderCtx *c) {
   fl_walk_loaded_fonts(c, fl_unload_cb, NULL);
-  vec_clear(&c->loaded_font);
+  fl_release_fonts(c);
+  fl_clear_match(c);
   c->num_font_loaded = 0;
   c->num_font_failed = 0;
   c->num_font_unmatched = 0;
+  c->num_font_skipped = 0;
 
   return FL_OK;
 }
 
 static int
-fl_cache_cb(FL_LoaderCtx *c, size_t i, const wchar_t *path, void *param) {
+fl_cache_map_cb(FL_LoaderCtx *c, size_t i, const wchar_t *path, void *param) {
   FL_FontMatch *data = c->loaded_font.data;
   FL_FontMatch *m = &data[i];
-  if (m->flag & FL_LOAD_DUP) {
+  if ((m->flag & FL_LOAD_DUP) || !(m->flag & FL_LOAD_OK))
     return FL_OK;
-  }
 
   HANDLE evt_cancel = *(HANDLE *)param;
-  if (WaitForSingleObject(evt_cancel, 0) != WAIT_TIMEOUT) {
+  if (WaitForSingleObject(evt_cancel, 0) != WAIT_TIMEOUT)
     return FL_OS_ERROR;
-  }
 
-  // read the file
-  memmap_t mmap;
-  DWORD tick = 0;
-  FlMemMap(path, &mmap);
-  const size_t step = 4 * 1024;
-  volatile char chksum = 0;
-  volatile const char *bytes = mmap.data;
-  for (size_t pos = 0; pos < mmap.size; pos += step) {
-    const DWORD now = GetTickCount();
-    if (now - tick > 10) {
-      tick = now;
-      if (WaitForSingleObject(evt_cancel, 0) != WAIT_TIMEOUT) {
-        // loop will be terminated on next file
-        break;
-      }
-    }
-    chksum ^= bytes[pos];
+  FL_CacheView view;
+  FlMemMap(path, &view.map);
+  if (view.map.data == NULL)
+    return FL_OK;
+  if (!vec_append(&c->cache_view, &view, 1)) {
+    FlMemUnmap(&view.map);
+    return FL_OUT_OF_MEMORY;
   }
-  FlMemUnmap(&mmap);
   return FL_OK;
 }
 
+static void fl_cache_release(FL_LoaderCtx *c) {
+  FL_CacheView *view = c->cache_view.data;
+  for (size_t i = 0; i != c->cache_view.n; i++)
+    FlMemUnmap(&view[i].map);
+  vec_clear(&c->cache_view);
+  c->cache_mapped = 0;
+}
+
 int fl_cache_fonts(FL_LoaderCtx *c, HANDLE evt_cancel) {
-  fl_walk_loaded_fonts(c, fl_cache_cb, &evt_cancel);
+  if (!c->cache_mapped) {
+    // views are kept until the fonts are unloaded if possible, so that the
+    // pages still resident are found in the working set
+    const int r = fl_walk_loaded_fonts(c, fl_cache_map_cb, &evt_cancel);
+    if (r != FL_OK) {
+      fl_cache_release(c);
+      return r;
+    }
+    c->cache_mapped = 1;
+  }
+
+  FL_CacheView *view = c->cache_view.data;
+  c->cache_bytes_read = 0;
+  for (size_t i = 0; i != c->cache_view.n; i++) {
+    if (WaitForSingleObject(evt_cancel, 0) != WAIT_TIMEOUT)
+      break;
+    c->cache_bytes_read += FlMemWarm(&view[i].map, evt_cancel);
+  }
+  if (!kFlCacheKeepViews)
+    fl_cache_release(c);
   return FL_OK;
 }
@@ -9,33 +9,88 @@ typedef enum {
   FL_LOAD_OK = 2,
   FL_LOAD_ERR = 16,
   FL_LOAD_DUP = 4,
-  FL_LOAD_MISS = 8
+  FL_LOAD_MISS = 8,
+  FL_LOAD_FUZZY = 32,   // loaded by a near-miss face
+  FL_LOAD_PENDING = 64  // being registered, within fl_load_fonts only
 } FL_MatchFlag;
 
 typedef struct {
   FL_MatchFlag flag;
   const wchar_t *face;
   const wchar_t *filename;
+  size_t size;
+  uint32_t fingerprint;  // of size, head and tail
+  int has_hash;          // hash is computed on fingerprint collision
   uint8_t hash[32];
 } FL_FontMatch;
 
-typedef struct {
+typedef struct _FL_LoaderCtx FL_LoaderCtx;
+
+// called by fl_load_fonts on the first face not installed, while there's no
+// font set yet. it's expected to fill font_set.
+typedef int (*FL_FontSetCallback)(FL_LoaderCtx *c, void *param);
+
+// enumerates installed font families into the snapshot by fl_sys_font_add.
+// defaults to GDI enumeration, which lists a family by one name only: faces
+// it misses are then queried one by one, and the answers kept.
+typedef int (*FL_SysFontCallback)(FL_LoaderCtx *c, void *param);
+
+// registers font files to the system, defaults to GDI. both return nonzero on
+// success, add may be called from worker threads of fl_load_fonts.
+typedef struct _FL_FontRegistry FL_FontRegistry;
+struct _FL_FontRegistry {
+  int (*add)(FL_FontRegistry *reg, const wchar_t *path);
+  int (*remove)(FL_FontRegistry *reg, const wchar_t *path);
+};
+
+struct _FL_LoaderCtx {
   allocator_t *alloc;
   str_db_t sub_font;
+  size_t sub_font_done;         // end of sub_font resolved by the last load
+  const wchar_t *sub_font_base; // faces of loaded_font point into it
+  str_db_t sub_file;            // subtitles parsed
+  vec_t sub_file_rec;           // write time and size of them
+  hash_tab_t sub_file_hash;     // by case folded path
   str_db_t font_path;
   str_db_t walk_path;
   FS_Set *font_set;
+  FS_Set *prev_font_set;  // previous scan, reused while scanning
+  CRITICAL_SECTION *font_set_lock;  // guards digests of a shared font_set
+  FS_FuzzyBuf fuzzy_buf;            // scratch of fs_iter_fuzzy
+  FL_FontSetCallback font_set_cb;  // lazily loads font_set, optional
+  void *font_set_param;
+  FL_SysFontCallback sys_font_cb;  // optional
+  void *sys_font_param;
+  str_db_t sys_font;          // installed families, snapshot
+  hash_tab_t sys_font_hash;   // hash of case folded family, to its position
+  volatile LONG sys_font_ok;  // cleared by fl_sys_font_invalidate
+  FL_FontRegistry *registry;  // optional
 
   uint32_t num_sub;
   uint32_t num_sub_font;
   uint32_t num_font_loaded;
   uint32_t num_font_failed;
   uint32_t num_font_unmatched;
+  uint32_t num_font_skipped;  // candidates ranked out, not registered
+  uint32_t num_font_changed;  // registered or removed by the last load
 
   void *event_cancel;
   void *hash_alg;
+  void *hash_obj;  // reused by each hash
+  DWORD sz_hash_obj;
   vec_t loaded_font;
-} FL_LoaderCtx;
+  hash_tab_t loaded_face;  // indices of loaded_font, by face pointer
+  hash_tab_t loaded_file;  // by filename pointer
+  hash_tab_t loaded_fp;    // by fingerprint, loaded or pending, every record
+  str_db_t retain;         // faces and files of fl_retain_fonts
+  vec_t retain_font;       // fonts kept registered for the next load
+  hash_tab_t retain_face;  // by case folded face
+  hash_tab_t retain_file;  // by case folded filename, registered ones
+
+  vec_t cache_view;  // loaded fonts mapped by fl_cache_fonts
+  int cache_mapped;
+  size_t cache_bytes_read;  // trimmed from the working set, by the last call
+};
 
 int fl_init(FL_LoaderCtx *c, allocator_t *alloc);
 
@@ -43,6 +98,8 @@ int fl_free(FL_LoaderCtx *c);
 
 int fl_cancel(FL_LoaderCtx *c);
 
+// a subtitle file, or a directory of them. files parsed before are skipped,
+// unless they're changed since then.
 int fl_add_subs(FL_LoaderCtx *c, const wchar_t *path);
 
 int fl_scan_fonts(
@@ -55,8 +112,24 @@ int fl_save_cache(FL_LoaderCtx *c, const wchar_t *cache);
 
 int fl_load_fonts(FL_LoaderCtx *c);
 
+// resolves the faces added since the last load, keeping the loaded fonts
+int fl_load_new_fonts(FL_LoaderCtx *c);
+
+int fl_sys_font_add(FL_LoaderCtx *c, const wchar_t *face);
+
+// the snapshot is taken again by the next fl_load_fonts, e.g. on
+// WM_FONTCHANGE. safe to call from another thread.
+int fl_sys_font_invalidate(FL_LoaderCtx *c);
+
 int fl_unload_fonts(FL_LoaderCtx *c);
 
+// keeps the loaded fonts registered, as if unloaded. the next fl_load_fonts
+// reuses the unchanged files, and removes the ones no longer needed.
+int fl_retain_fonts(FL_LoaderCtx *c);
+
+// keeps the pages of loaded fonts in memory, only the ones trimmed from the
+// working set are read again. on x64, the fonts are mapped until they're
+// unloaded, on x86 for each call only.
 int fl_cache_fonts(FL_LoaderCtx *c, HANDLE evt_cancel);
 
 typedef int (*WalkLoadedCallback)(
@@ -11,16 +11,114 @@
    (uint32_t)(((uint8_t)(b) << 8)) | (uint32_t)(((uint8_t)(a))))
 
 #define KFontDbMagic (MAKE_TAG('f', 'l', 'd', 'd'))
+#define KFontIdxMagic (MAKE_TAG('f', 'l', 'd', 'x'))
+#define kFontIdxVersion (7)
+
+#define kFsNoStr ((uint32_t)-1)
+
+// strings of the index are offsets (in wchar_t) into the string pool
+
+// distinct face, its groups are group[group] to group[next face's group]
+typedef struct {
+  uint32_t face;   // first seen spelling
+  uint32_t key;    // case folded face, offset into the key pool
+  uint32_t group;  // preferred first
+  uint32_t span;   // faces before span are prefixed by this key
+} FS_FaceRec;
+
+// fonts of a face with the same format and version, they are post[post] to
+// post[next group's post]
+typedef struct {
+  uint32_t post;
+  uint32_t rank;
+} FS_GroupRec;
+
+// a font of a file, one per version in the file
+typedef struct {
+  uint32_t tag;
+  uint32_t ver;   // or kFsNoStr
+  uint32_t rank;  // format and version, higher is preferred, equal if the
+                  // version strings are equal. spellings FlVersionCmp treats
+                  // as equal, like "1.0" and "1.00", are ranked by spelling
+  uint32_t full;  // full name, or kFsNoStr
+} FS_FontRec;
+
+#define kFsRankFmtShift (24)
+#define kFsRankVerMask ((1u << kFsRankFmtShift) - 1)
+
+// a posting is a font id, with the name kinds of the face on top
+#define kFsPostKindShift (29)
+#define kFsPostFontMask ((1u << kFsPostKindShift) - 1)
+
+// (face, font) pair while building the index
+typedef struct {
+  uint32_t key;
+  uint32_t face;
+  uint32_t font;
+  uint32_t rank;
+  uint32_t kind;  // FS_NameKind
+} FS_IndexRec;
+
+// content digest of a file, keyed by its tag
+typedef struct {
+  uint32_t tag;
+  uint32_t size_lo;
+  uint32_t size_hi;
+  uint32_t mtime_lo;
+  uint32_t mtime_hi;
+  uint8_t hash[32];
+} FS_DigestRec;
+
+// secondary index for near-miss lookup, built on first use
+typedef struct {
+  uint32_t num;         // number of distinct faces
+  uint32_t *norm;       // normalized face, offset into the pool
+  str_db_t pool;        // normalized faces
+  hash_tab_t hash;      // hash of normalized face, to face id
+  uint32_t mask;        // number of trigram buckets - 1
+  uint32_t *gram_off;   // postings of bucket b: gram_off[b] to gram_off[b+1]
+  uint32_t *gram_post;  // face ids, ascending in each bucket
+} FS_Fuzzy;
 
 struct _FS_Set {
   allocator_t *alloc;
   str_db_t db;
+  str_db_t keys;  // case folded faces, for sorting and lookup
   str_db_t blacklist;
   FS_Stat stat;
-  FS_Index *index;
+  // index, either built or mapped
+  const FS_FaceRec *face;    // sorted by key, with a sentinel
+  const FS_GroupRec *group;  // with a sentinel
+  const uint32_t *post;      // font ids of each group, one per file
+  const FS_FontRec *font;
+  uint32_t num_face;  // distinct faces
+  uint32_t num_group;
+  uint32_t num_post;
+  uint32_t num_font;
+  FS_FaceRec *face_buf;  // NULL if mapped
+  FS_GroupRec *group_buf;
+  uint32_t *post_buf;
+  FS_FontRec *font_buf;
+  uint8_t *hidden;  // ignored fonts, by blacklist
   memmap_t map;
+  hash_tab_t face_hash;   // hash of key, to face id
+  hash_tab_t black_hash;  // reversed hash of blacklist, to its position
+  vec_t files;            // FS_FileRec sorted by tag, for rescan
+  uint32_t *files_by_id;  // index to files, sorted by file id
+  FS_Fuzzy *fuzzy;        // near-miss index, built on first use
+  vec_t digests;          // FS_DigestRec
+  hash_tab_t digest_hash;  // hash of tag, to index of digests
+  uint32_t num_digest_new;  // not saved yet
 };
 
+typedef struct {
+  uint32_t pos;  // position of the filename in the pool
+  FS_FileMeta meta;
+} FS_FileRec;
+
+// faces of a font with their name kinds recorded, others are left unknown
+#define kFsMaxKind (64)
+
 typedef struct {
   FS_Set *set;
   uint32_t id;
@@ -28,20 +126,53 @@ typedef struct {
   size_t pos_face;      // point to first face name
   uint32_t count_face;  // number of discovered face name
   uint16_t last_lang_id;
+  uint32_t num_kind;  // faces of the font so far
+  wchar_t kind[kFsMaxKind + 1];
 } FS_ParseCtx;
 
+// legacy cache: header followed by the text database
 typedef struct {
   uint32_t magic;
   FS_Stat stat;
   uint32_t size;
 } FS_CacheHeader;
 
+// binary cache: header, faces, groups, postings, fonts, digests, hash, keys,
+// then the pool
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  FS_Stat stat;
+  uint32_t size;       // bytes of the whole file
+  uint32_t num_face;   // number of FS_FaceRec, without the sentinel
+  uint32_t off_face;   // bytes from the beginning
+  uint32_t num_group;  // number of FS_GroupRec, without the sentinel
+  uint32_t off_group;  // bytes from the beginning
+  uint32_t num_post;   // number of font ids
+  uint32_t off_post;   // bytes from the beginning
+  uint32_t num_font;   // number of FS_FontRec
+  uint32_t off_font;   // bytes from the beginning
+  uint32_t num_digest;  // number of FS_DigestRec
+  uint32_t off_digest;  // bytes from the beginning
+  uint32_t off_pool;   // bytes from the beginning
+  uint32_t cch_pool;   // number of wchar_t in the pool
+  uint32_t off_hash;   // bytes from the beginning
+  uint32_t num_hash;   // number of hash_slot_t, power of 2
+  uint32_t off_keys;   // bytes from the beginning
+  uint32_t cch_keys;   // number of wchar_t in the key pool
+} FS_IndexHeader;
+
 #define kTagVersion L"\tv:"
 #define kTagVersionLen (3)
 #define kTagFormat L"\tt:"
 #define kTagFormatLen (3)
 #define kTagError L"\t!!"
 #define kTagErrorLen (3)
+#define kTagMeta L"\tm:"
+#define kTagMetaLen (3)
+#define kTagKind L"\tk:"  // a digit of FS_NameKind per face of the font
+#define kTagKindLen (3)
+#define kMetaHexLen (8 * 7)
 
 static const WCHAR kFsFmtTag[FS_FmtMax][4] = {  // format hack
     [FS_FmtNone] = L"",
@@ -51,6 +182,48 @@ static const WCHAR kFsFmtTag[FS_FmtMax][4] = {  // format hack
 
 static void fs_format_tag_to_str(FS_Format fmt, WCHAR s[4]);
 
+static uint32_t fs_name_kind(uint16_t name_id) {
+  switch (name_id) {
+  case 1:
+    return FS_NameFamily;
+  case 4:
+    return FS_NameFull;
+  case 6:
+    return FS_NamePostScript;
+  default:
+    return 0;
+  }
+}
+
+// write name kinds of the faces of the font, after its last face
+static int fs_parser_flush_kind(FS_ParseCtx *c) {
+  if (c->num_kind == 0)
+    return FL_OK;
+  str_db_t *db = &c->set->db;
+  c->kind[c->num_kind] = 0;
+  c->num_kind = 0;
+  if (!str_db_push_prefix(db, kTagKind, kTagKindLen) ||
+      !str_db_push_u16_le(db, c->kind, 0))
+    return FL_OUT_OF_MEMORY;
+  return FL_OK;
+}
+
+static void
+fs_parser_add_kind(FS_ParseCtx *c, const wchar_t *face, uint32_t kind) {
+  // index of the face among the ones of the font
+  uint32_t i = 0;
+  size_t pos = c->pos_face;
+  const wchar_t *line;
+  while ((line = str_db_next(&c->set->db, &pos)) != NULL && line != face) {
+    i++;
+  }
+  if (i < c->num_kind) {
+    c->kind[i] |= kind;
+  } else if (i == c->num_kind && i < kFsMaxKind) {
+    c->kind[c->num_kind++] = L'0' + kind;
+  }
+}
+
 static int fs_parser_name_cb(
     uint32_t font_id,
     OTF_NameRecord *r,
@@ -62,6 +235,8 @@ static int fs_parser_name_cb(
 
   if (font_id != c->id) {
     // new font
+    if (fs_parser_flush_kind(c) != FL_OK)
+      return FL_OUT_OF_MEMORY;
     c->id = font_id;
     c->pos_ver = str_db_tell(&s->db);
     c->pos_face = c->pos_ver;
@@ -101,6 +276,7 @@ static int fs_parser_name_cb(
       // duplicated, revert
       str_db_seek(&s->db, pos_insert);
     }
+    fs_parser_add_kind(c, prev_face, fs_name_kind(be16(r->name_id)));
   }
 
   return FL_OK;
@@ -114,7 +290,13 @@ int fs_create(allocator_t *alloc, FS_Set **out) {
     if (!p)
       break;
     str_db_init(&p->db, alloc, '\n', 2);
+    str_db_init(&p->keys, alloc, 0, 1);
     str_db_init(&p->blacklist, alloc, 0, 1);
+    vec_init(&p->files, sizeof(FS_FileRec), alloc);
+    vec_init(&p->digests, sizeof(FS_DigestRec), alloc);
+    hash_tab_init(&p->face_hash, alloc);
+    hash_tab_init(&p->black_hash, alloc);
+    hash_tab_init(&p->digest_hash, alloc);
 
     p->alloc = alloc;
     ok = 1;
@@ -128,11 +310,26 @@ int fs_create(allocator_t *alloc, FS_Set **out) {
   return ok ? FL_OK : FL_OUT_OF_MEMORY;
 }
 
+static void fs_fuzzy_free(FS_Set *s);
+
 int fs_free(FS_Set *s) {
   if (s) {
     allocator_t *alloc = s->alloc;
+    fs_fuzzy_free(s);
     str_db_free(&s->db);
+    str_db_free(&s->keys);
     str_db_free(&s->blacklist);
+    alloc->alloc(s->face_buf, 0, alloc->arg);
+    alloc->alloc(s->group_buf, 0, alloc->arg);
+    alloc->alloc(s->post_buf, 0, alloc->arg);
+    alloc->alloc(s->font_buf, 0, alloc->arg);
+    vec_free(&s->files);
+    vec_free(&s->digests);
+    hash_tab_free(&s->face_hash);
+    hash_tab_free(&s->black_hash);
+    hash_tab_free(&s->digest_hash);
+    alloc->alloc(s->hidden, 0, alloc->arg);
+    alloc->alloc(s->files_by_id, 0, alloc->arg);
     FlMemUnmap(&s->map);
     alloc->alloc(s, 0, alloc->arg);
   }
@@ -146,7 +343,48 @@ int fs_stat(FS_Set *s, FS_Stat *stat) {
   return 0;
 }
 
-int fs_add_font(FS_Set *s, const wchar_t *tag, void *buf, size_t size) {
+static void fs_meta_to_str(const FS_FileMeta *meta, wchar_t *s) {
+  static const wchar_t kHex[] = L"0123456789abcdef";
+  const uint32_t *v = (const uint32_t *)meta;
+  for (int i = 0; i != 7; i++) {
+    for (int j = 0; j != 8; j++) {
+      s[i * 8 + j] = kHex[(v[i] >> (28 - j * 4)) & 0xf];
+    }
+  }
+  s[kMetaHexLen] = 0;
+}
+
+static int fs_meta_from_str(const wchar_t *s, FS_FileMeta *meta) {
+  uint32_t *v = (uint32_t *)meta;
+  for (int i = 0; i != 7; i++) {
+    uint32_t n = 0;
+    for (int j = 0; j != 8; j++) {
+      const wchar_t ch = s[i * 8 + j];
+      if (L'0' <= ch && ch <= L'9')
+        n = (n << 4) | (ch - L'0');
+      else if (L'a' <= ch && ch <= L'f')
+        n = (n << 4) | (ch - L'a' + 10);
+      else
+        return 0;
+    }
+    v[i] = n;
+  }
+  return s[kMetaHexLen] == 0;
+}
+
+static int fs_push_meta(str_db_t *db, const FS_FileMeta *meta) {
+  wchar_t buf[kMetaHexLen + 1];
+  fs_meta_to_str(meta, buf);
+  return str_db_push_prefix(db, kTagMeta, kTagMetaLen) != NULL &&
+         str_db_push_u16_le(db, buf, kMetaHexLen) != NULL;
+}
+
+int fs_add_font(
+    FS_Set *s,
+    const wchar_t *tag,
+    const FS_FileMeta *meta,
+    void *buf,
+    size_t size) {
   int ok = 0, r = FL_OK;
   str_db_t *db = &s->db;
   const size_t pos_filename = str_db_tell(db);
@@ -157,6 +395,8 @@ int fs_add_font(FS_Set *s, const wchar_t *tag, void *buf, size_t size) {
   do {
     if (str_db_push_u16_le(db, tag, 0) == NULL)
       break;
+    if (meta && !fs_push_meta(db, meta))
+      break;
     // try TTC
     pos_db_fmt = str_db_tell(db);
     fs_format_tag_to_str(FS_FmtTTC, fmt);
@@ -191,7 +431,8 @@ int fs_add_font(FS_Set *s, const wchar_t *tag, void *buf, size_t size) {
   } while (0);
 
   if (ok) {
-    if (!str_db_push_u16_le(db, L"", 0)) {
+    if (fs_parser_flush_kind(&ctx) != FL_OK ||
+        !str_db_push_u16_le(db, L"", 0)) {
       r = FL_OUT_OF_MEMORY;
       ok = 0;
     }
@@ -218,24 +459,72 @@ int fs_add_font(FS_Set *s, const wchar_t *tag, void *buf, size_t size) {
   return r;
 }
 
+static const wchar_t *fs_pool_str(FS_Set *s, uint32_t off) {
+  if (off == kFsNoStr)
+    return NULL;
+  return str_db_get(&s->db, 0) + off;
+}
+
+static const wchar_t *fs_key_str(FS_Set *s, uint32_t off) {
+  return str_db_get(&s->keys, 0) + off;
+}
+
+static int fs_str_cmp(const wchar_t *a, const wchar_t *b) {
+  for (; *a && *a == *b; a++, b++) {
+    // nop
+  }
+  return (int)*a - (int)*b;
+}
+
+// compare unfolded face with a key
+static int fs_key_cmp(const wchar_t *face, const wchar_t *key) {
+  wchar_t f;
+  for (; (f = FlCaseFold(*face)) != 0 && f == *key; face++, key++) {
+    // nop
+  }
+  return (int)f - (int)*key;
+}
+
+static void
+fs_font_info(FS_Set *s, uint32_t face_id, uint32_t post, FS_Index *info) {
+  const FS_FontRec *font = &s->font[post & kFsPostFontMask];
+  info->tag = fs_pool_str(s, font->tag);
+  info->face = fs_pool_str(s, s->face[face_id].face);
+  info->ver = fs_pool_str(s, font->ver);
+  info->full = fs_pool_str(s, font->full);
+  info->format = (FS_Format)(font->rank >> kFsRankFmtShift);
+  info->kind = post >> kFsPostKindShift;
+}
+
 static int fs_idx_comp(const void *pa, const void *pb, void *arg) {
-  // FS_Set *s = arg;
-  const FS_Index *a = pa, *b = pb;
+  FS_Set *s = arg;
+  const FS_IndexRec *a = pa, *b = pb;
 
   // first, compare the name
-  int cmp = FlStrCmpIW(a->face, b->face);
-  if (cmp == 0) {
-    // second, compare by format
-    cmp = 0 - (a->format - b->format);
-    if (cmp == 0) {
-      // last, compare by version
-      cmp = 0 - FlVersionCmp(a->ver, b->ver);
-    }
+  int cmp = fs_str_cmp(fs_key_str(s, a->key), fs_key_str(s, b->key));
+  if (cmp == 0 && a->rank != b->rank) {
+    // then by format and version, preferred first
+    cmp = a->rank > b->rank ? -1 : 1;
   }
 
   return cmp;
 }
 
+static int fs_ver_comp(const void *pa, const void *pb, void *arg) {
+  FS_Set *s = arg;
+  const FS_FontRec *a = &s->font_buf[*(const uint32_t *)pa];
+  const FS_FontRec *b = &s->font_buf[*(const uint32_t *)pb];
+  if (a->ver == b->ver)
+    return 0;
+  const wchar_t *va = fs_pool_str(s, a->ver), *vb = fs_pool_str(s, b->ver);
+  const int cmp = FlVersionCmp(va, vb);
+  if (cmp != 0 || va == NULL || vb == NULL)
+    return cmp;
+  // same version in another spelling, keep them apart: fs_iter_next only
+  // continues with the same version string
+  return fs_str_cmp(va, vb);
+}
+
 static FS_Format fs_format_str_to_tag(const WCHAR s[4]) {
   for (int i = 0; i != FS_FmtMax; i++) {
     if (ass_strncmp(s, kFsFmtTag[i], 4) == 0) {
@@ -264,193 +553,1457 @@ static void fs_index_debug_dump(FS_Set *s) {
   HANDLE f = CreateFile(
       L"FontIndexDebugDump.txt", GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
       FILE_ATTRIBUTE_NORMAL, NULL);
-  for (unsigned int i = 0; i != s->stat.num_face; i++) {
-    WCHAR fmt[4];
-    fs_format_tag_to_str(s->index[i].format, fmt);
-    fs_debug_write_line(f, L"[");
-    fs_debug_write_line(f, fmt);
-    fs_debug_write_line(f, L"] ");
-    fs_debug_write_line(f, s->index[i].face);
-    fs_debug_write_line(f, L" ");
-    fs_debug_write_line(f, s->index[i].tag);
-    fs_debug_write_line(f, L" ");
-    fs_debug_write_line(f, s->index[i].ver);
-    fs_debug_write_line(f, L"\n");
+  for (uint32_t i = 0; i != s->num_face; i++) {
+    const uint32_t p_begin = s->group[s->face[i].group].post;
+    const uint32_t p_end = s->group[s->face[i + 1].group].post;
+    for (uint32_t p = p_begin; p != p_end; p++) {
+      WCHAR fmt[4];
+      FS_Index info;
+      fs_font_info(s, i, s->post[p], &info);
+      fs_format_tag_to_str(info.format, fmt);
+      fs_debug_write_line(f, L"[");
+      fs_debug_write_line(f, fmt);
+      fs_debug_write_line(f, L"] ");
+      fs_debug_write_line(f, info.face);
+      fs_debug_write_line(f, L" ");
+      fs_debug_write_line(f, info.tag);
+      fs_debug_write_line(f, L" ");
+      fs_debug_write_line(f, info.ver ? info.ver : L"");
+      fs_debug_write_line(f, L"\n");
+    }
   }
   CloseHandle(f);
 }
 
-int fs_build_index(FS_Set *s) {
-  allocator_t *alloc = s->alloc;
-  const size_t idx_size = s->stat.num_face * sizeof s->index[0];
-  FS_Index *idx = (FS_Index *)alloc->alloc(s->index, idx_size, alloc->arg);
-  s->index = idx;
-  if (idx == NULL) {
-    return s->stat.num_face ? FL_OUT_OF_MEMORY : FL_OK;
+static uint32_t fs_face_hash(const wchar_t *face) {
+  // hash of the case folded name, same as hashing the key
+  uint32_t h = kStrHashInit;
+  for (; *face; face++) {
+    const wchar_t f = FlCaseFold(*face);
+    h = str_hash(h, &f, 1);
   }
+  return h;
+}
 
-  // for checking only
-  FS_Stat stat = {.num_face = 0, .num_file = 0};
+static int fs_build_face_hash(FS_Set *s) {
+  hash_tab_clear(&s->face_hash);
+  if (!hash_tab_reserve(&s->face_hash, s->num_face))
+    return FL_OUT_OF_MEMORY;
+  for (uint32_t i = 0; i != s->num_face; i++) {
+    const wchar_t *key = fs_key_str(s, s->face[i].key);
+    const uint32_t h = str_hash(kStrHashInit, key, ass_strlen(key));
+    if (!hash_tab_insert(&s->face_hash, h, i))
+      return FL_OUT_OF_MEMORY;
+  }
+  return FL_OK;
+}
+
+static int fs_blacklist_apply(FS_Set *s);
+
+// the scan and the sort are split across threads for large sets
+#define kFsParallelMin (1u << 14)
+#define kFsMaxWorker (8)
 
-  int err = 0;
-  int has_filename = 0;
+typedef struct {
+  FS_Set *set;
+  size_t begin;  // range of the pool, at record boundaries
+  size_t end;
+  vec_t recs;     // FS_IndexRec, key and font are local to the part
+  vec_t fonts;    // FS_FontRec, rank is the format for now
+  str_db_t keys;  // case folded faces
+  FS_Stat stat;
+  int err;
+} FS_ScanPart;
+
+typedef struct {
+  FS_Set *set;
+  const FS_IndexRec *src;
+  FS_IndexRec *dst;
+  uint32_t low;  // merge src[low, mid) and src[mid, high) into dst
+  uint32_t mid;
+  uint32_t high;
+} FS_SortPart;
+
+static uint32_t fs_num_worker(uint32_t num_face) {
+  if (num_face < kFsParallelMin)
+    return 1;
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  uint32_t n = info.dwNumberOfProcessors;
+  if (n > kFsMaxWorker)
+    n = kFsMaxWorker;
+  return n ? n : 1;
+}
+
+// run fn on each of the n jobs, job 0 on the calling thread
+static void fs_run_workers(
+    LPTHREAD_START_ROUTINE fn,
+    void *jobs,
+    size_t size,
+    uint32_t n) {
+  uint8_t *job = (uint8_t *)jobs;
+  HANDLE thread[kFsMaxWorker] = {0};
+  for (uint32_t i = 1; i < n; i++) {
+    thread[i] = CreateThread(NULL, 0, fn, job + i * size, 0, NULL);
+  }
+  fn(job);
+  for (uint32_t i = 1; i < n; i++) {
+    if (thread[i] == NULL) {
+      fn(job + i * size);
+    } else {
+      WaitForSingleObject(thread[i], INFINITE);
+      CloseHandle(thread[i]);
+    }
+  }
+}
+
+// first record starting at or after pos
+static size_t fs_next_record(FS_Set *s, size_t pos) {
+  const wchar_t *pool = str_db_get(&s->db, 0);
+  const size_t end = str_db_tell(&s->db);
+  // align to the beginning of a line
+  while (pos < end && pos != 0 &&
+         !(pos >= 2 && pool[pos - 2] == 0 && pool[pos - 1] == s->db.ex_pad)) {
+    pos++;
+  }
+  // then skip to the line after an empty one
   const wchar_t *line;
-  size_t pos = 0;
-  FS_Index last_idx = {0};
-  while (!err && (line = str_db_next(&s->db, &pos)) != NULL) {
+  while (pos < end && pos != 0 && (line = str_db_next(&s->db, &pos)) != NULL) {
+    if (line[0] == 0)
+      break;
+  }
+  return pos < end ? pos : end;
+}
+
+static DWORD WINAPI fs_scan_worker(LPVOID param) {
+  FS_ScanPart *part = (FS_ScanPart *)param;
+  FS_Set *s = part->set;
+
+  int has_filename = 0, font_used = 0;
+  const wchar_t *pool = str_db_get(&s->db, 0);
+  const wchar_t *line;
+  size_t pos = part->begin;
+  FS_FontRec font = {.ver = kFsNoStr, .full = kFsNoStr};
+  FS_IndexRec rec = {0};
+  size_t kind_base = 0;  // first record of the font, without kind
+  while (!part->err && pos != part->end &&
+         (line = str_db_next(&s->db, &pos)) != NULL) {
+    FS_FontRec *last = (FS_FontRec *)part->fonts.data;
+    if (part->fonts.n != 0)
+      last += part->fonts.n - 1;
     if (line[0] == 0) {
       // empty line
-      last_idx = (FS_Index){0};
       has_filename = 0;
     } else if (ass_strncmp(line, kTagVersion, kTagVersionLen) == 0) {
-      // update version
-      last_idx.ver = line + kTagVersionLen;
+      // another font of the file, unless the current one has no face yet
+      font.ver = (uint32_t)(line + kTagVersionLen - pool);
+      kind_base = part->recs.n;
+      if (has_filename && !font_used) {
+        last->ver = font.ver;
+      } else if (has_filename) {
+        part->err = !vec_append(&part->fonts, &font, 1);
+        font_used = 0;
+      }
     } else if (ass_strncmp(line, kTagFormat, kTagFormatLen) == 0) {
-      last_idx.format = fs_format_str_to_tag(line + kTagFormatLen);
+      font.rank = fs_format_str_to_tag(line + kTagFormatLen);
+      if (has_filename)
+        last->rank = font.rank;
     } else if (ass_strncmp(line, kTagError, kTagErrorLen) == 0) {
       // ignore
+    } else if (ass_strncmp(line, kTagMeta, kTagMetaLen) == 0) {
+      // ignore
+    } else if (ass_strncmp(line, kTagKind, kTagKindLen) == 0) {
+      // kinds of the faces since the font begins
+      FS_IndexRec *recs = (FS_IndexRec *)part->recs.data;
+      const wchar_t *kind = line + kTagKindLen;
+      for (; *kind && kind_base < part->recs.n; kind++, kind_base++) {
+        FS_IndexRec *r = &recs[kind_base];
+        r->kind = (*kind - L'0') & (FS_NameFamily | FS_NameFull |
+                                    FS_NamePostScript);
+        if ((r->kind & FS_NameFull) && has_filename && last->full == kFsNoStr)
+          last->full = r->face;
+      }
+      kind_base = part->recs.n;
     } else if (!has_filename) {
       // update filename
-      last_idx.tag = line;
+      font = (FS_FontRec){
+          .tag = (uint32_t)(line - pool), .ver = kFsNoStr, .full = kFsNoStr};
+      kind_base = part->recs.n;
+      part->err = !vec_append(&part->fonts, &font, 1);
       has_filename = 1;
-      stat.num_file++;
+      font_used = 0;
+      part->stat.num_file++;
     } else {
       // face
-      if (stat.num_face == s->stat.num_face) {
-        err = 1;
+      if (part->stat.num_face == s->stat.num_face) {
+        part->err = 1;
+        break;
+      }
+      // fold once, compared ordinally afterwards
+      const size_t pos_key = str_db_tell(&part->keys);
+      wchar_t *key = (wchar_t *)str_db_push_u16_le(&part->keys, line, 0);
+      if (key == NULL) {
+        part->err = 1;
+        break;
+      }
+      for (; *key; key++) {
+        *key = FlCaseFold(*key);
+      }
+      rec.key = (uint32_t)pos_key;
+      rec.face = (uint32_t)(line - pool);
+      rec.font = (uint32_t)part->fonts.n - 1;
+      rec.kind = 0;
+      if (!vec_append(&part->recs, &rec, 1)) {
+        part->err = 1;
         break;
       }
-      last_idx.face = line;
-      idx[stat.num_face++] = last_idx;
+      font_used = 1;
+      part->stat.num_face++;
+    }
+  }
+  return 0;
+}
+
+static DWORD WINAPI fs_sort_worker(LPVOID param) {
+  FS_SortPart *part = (FS_SortPart *)param;
+  FS_Set *s = part->set;
+  tim_sort(
+      part->dst + part->low, part->high - part->low, sizeof part->dst[0],
+      s->alloc, fs_idx_comp, s);
+  return 0;
+}
+
+static DWORD WINAPI fs_merge_worker(LPVOID param) {
+  // stable: the left run wins on ties, same as tim_sort
+  FS_SortPart *part = (FS_SortPart *)param;
+  const FS_IndexRec *src = part->src;
+  FS_IndexRec *dst = part->dst + part->low;
+  uint32_t a = part->low, b = part->mid;
+  while (a != part->mid && b != part->high) {
+    if (fs_idx_comp(&src[a], &src[b], part->set) <= 0) {
+      *dst++ = src[a++];
+    } else {
+      *dst++ = src[b++];
+    }
+  }
+  while (a != part->mid) {
+    *dst++ = src[a++];
+  }
+  while (b != part->high) {
+    *dst++ = src[b++];
+  }
+  return 0;
+}
+
+// sort chunks in parallel, then merge pairs of runs until one is left. the
+// result is the same as a stable sort by fs_idx_comp, i.e. by key, then by the
+// rank of fs_rank_fonts, which splits spellings of an equal version
+static int fs_sort_index(FS_Set *s, FS_IndexRec *idx, uint32_t n_worker) {
+  const uint32_t num = s->stat.num_face;
+  FS_SortPart part[kFsMaxWorker];
+  uint32_t bound[kFsMaxWorker + 1];
+  for (uint32_t i = 0; i != n_worker; i++) {
+    bound[i] = num / n_worker * i;
+  }
+  bound[n_worker] = num;
+  for (uint32_t i = 0; i != n_worker; i++) {
+    part[i] = (FS_SortPart){
+        .set = s, .dst = idx, .low = bound[i], .high = bound[i + 1]};
+  }
+  fs_run_workers(fs_sort_worker, part, sizeof part[0], n_worker);
+  if (n_worker == 1)
+    return FL_OK;
+
+  allocator_t *alloc = s->alloc;
+  FS_IndexRec *temp =
+      (FS_IndexRec *)alloc->alloc(NULL, num * sizeof temp[0], alloc->arg);
+  if (temp == NULL)
+    return FL_OUT_OF_MEMORY;
+
+  FS_IndexRec *src = idx, *dst = temp;
+  uint32_t n_run = n_worker;
+  while (n_run > 1) {
+    const uint32_t n_job = (n_run + 1) / 2;
+    for (uint32_t i = 0; i != n_job; i++) {
+      const uint32_t r = i * 2;
+      part[i] = (FS_SortPart){
+          .set = s,
+          .src = src,
+          .dst = dst,
+          .low = bound[r],
+          .mid = bound[r + 1],
+          .high = r + 2 <= n_run ? bound[r + 2] : bound[r + 1]};
+    }
+    fs_run_workers(fs_merge_worker, part, sizeof part[0], n_job);
+    for (uint32_t i = 0; i != n_job; i++) {
+      bound[i] = part[i].low;
+    }
+    bound[n_job] = num;
+    n_run = n_job;
+    FS_IndexRec *t = src;
+    src = dst;
+    dst = t;
+  }
+  if (src != idx) {
+    zmemcpy(idx, src, num * sizeof idx[0]);
+  }
+  alloc->alloc(temp, 0, alloc->arg);
+  return FL_OK;
+}
+
+// rank fonts by format, then by version, so records compare by integer.
+// versions FlVersionCmp treats as equal get adjacent ranks by spelling
+static int fs_rank_fonts(FS_Set *s, FS_IndexRec *idx) {
+  allocator_t *alloc = s->alloc;
+  FS_FontRec *font = s->font_buf;
+  const uint32_t n = s->num_font;
+  uint32_t *order =
+      (uint32_t *)alloc->alloc(NULL, (n + 1) * sizeof order[0], alloc->arg);
+  if (order == NULL)
+    return FL_OUT_OF_MEMORY;
+  for (uint32_t i = 0; i != n; i++) {
+    order[i] = i;
+  }
+  tim_sort(order, n, sizeof order[0], alloc, fs_ver_comp, s);
+
+  uint32_t rank = 0;
+  for (uint32_t i = 0; i != n; i++) {
+    if (i != 0 && rank != kFsRankVerMask &&
+        fs_ver_comp(&order[i - 1], &order[i], s) != 0)
+      rank++;
+    FS_FontRec *f = &font[order[i]];
+    f->rank = (f->rank << kFsRankFmtShift) | rank;
+  }
+  alloc->alloc(order, 0, alloc->arg);
+
+  for (uint32_t i = 0; i != s->stat.num_face; i++) {
+    idx[i].rank = font[idx[i].font].rank;
+  }
+  return FL_OK;
+}
+
+static int fs_str_prefix(const wchar_t *prefix, const wchar_t *str) {
+  for (; *prefix && *prefix == *str; prefix++, str++) {
+    // nop
+  }
+  return *prefix == 0;
+}
+
+// faces prefixed by a key are adjacent in the sorted table, find where each
+// run ends so the iterator doesn't compare strings
+static int fs_build_spans(FS_Set *s, FS_FaceRec *face, uint32_t n) {
+  allocator_t *alloc = s->alloc;
+  uint32_t *open =
+      (uint32_t *)alloc->alloc(NULL, (n + 1) * sizeof open[0], alloc->arg);
+  if (open == NULL)
+    return FL_OUT_OF_MEMORY;
+
+  // faces on the stack are prefixes of the ones above them
+  uint32_t depth = 0;
+  for (uint32_t i = 0; i != n; i++) {
+    const wchar_t *key = fs_key_str(s, face[i].key);
+    while (depth != 0 &&
+           !fs_str_prefix(fs_key_str(s, face[open[depth - 1]].key), key)) {
+      face[open[--depth]].span = i;
+    }
+    open[depth++] = i;
+  }
+  while (depth != 0) {
+    face[open[--depth]].span = n;
+  }
+  alloc->alloc(open, 0, alloc->arg);
+  return FL_OK;
+}
+
+// group sorted records by face and rank, keys are copied to a compact pool
+static int fs_build_faces(FS_Set *s, const FS_IndexRec *idx) {
+  allocator_t *alloc = s->alloc;
+  const uint32_t num = s->stat.num_face;
+  FS_FaceRec *face =
+      (FS_FaceRec *)alloc->alloc(NULL, (num + 1) * sizeof face[0], alloc->arg);
+  FS_GroupRec *group = (FS_GroupRec *)alloc->alloc(
+      NULL, (num + 1) * sizeof group[0], alloc->arg);
+  uint32_t *post =
+      (uint32_t *)alloc->alloc(NULL, (num + 1) * sizeof post[0], alloc->arg);
+  s->face = s->face_buf = face;
+  s->group = s->group_buf = group;
+  s->post = s->post_buf = post;
+  if (face == NULL || group == NULL || post == NULL)
+    return FL_OUT_OF_MEMORY;
+
+  str_db_t keys;
+  str_db_init(&keys, alloc, 0, 1);
+  uint32_t n = 0, n_group = 0, n_post = 0;
+  for (uint32_t i = 0; i != num; i++) {
+    const wchar_t *key = fs_key_str(s, idx[i].key);
+    const uint32_t tag = s->font[idx[i].font].tag;
+    if (i == 0 || fs_str_cmp(key, fs_key_str(s, idx[i - 1].key)) != 0) {
+      const size_t pos = str_db_tell(&keys);
+      if (!str_db_push_u16_le(&keys, key, 0)) {
+        str_db_free(&keys);
+        return FL_OUT_OF_MEMORY;
+      }
+      face[n++] = (FS_FaceRec){
+          .face = idx[i].face, .key = (uint32_t)pos, .group = n_group};
+      group[n_group++] = (FS_GroupRec){.post = n_post, .rank = idx[i].rank};
+    } else if (idx[i].rank != idx[i - 1].rank) {
+      group[n_group++] = (FS_GroupRec){.post = n_post, .rank = idx[i].rank};
+    } else if (s->font[post[n_post - 1] & kFsPostFontMask].tag == tag) {
+      // same file again, e.g. another font of a collection
+      post[n_post - 1] |= idx[i].kind << kFsPostKindShift;
+      continue;
     }
+    post[n_post++] = idx[i].font | idx[i].kind << kFsPostKindShift;
+  }
+  face[n] = (FS_FaceRec){.group = n_group, .span = n};
+  group[n_group] = (FS_GroupRec){.post = n_post};
+  str_db_free(&s->keys);
+  s->keys = keys;
+  s->num_face = n;
+  s->num_group = n_group;
+  s->num_post = n_post;
+  if (fs_build_spans(s, face, n) != FL_OK)
+    return FL_OUT_OF_MEMORY;
+
+  FS_FaceRec *face_shrunk =
+      (FS_FaceRec *)alloc->alloc(face, (n + 1) * sizeof face[0], alloc->arg);
+  if (face_shrunk != NULL)
+    s->face = s->face_buf = face_shrunk;
+  FS_GroupRec *group_shrunk = (FS_GroupRec *)alloc->alloc(
+      group, (n_group + 1) * sizeof group[0], alloc->arg);
+  if (group_shrunk != NULL)
+    s->group = s->group_buf = group_shrunk;
+  uint32_t *post_shrunk = (uint32_t *)alloc->alloc(
+      post, (n_post + 1) * sizeof post[0], alloc->arg);
+  if (post_shrunk != NULL)
+    s->post = s->post_buf = post_shrunk;
+  return FL_OK;
+}
+
+static void fs_index_free(FS_Set *s) {
+  allocator_t *alloc = s->alloc;
+  alloc->alloc(s->face_buf, 0, alloc->arg);
+  alloc->alloc(s->group_buf, 0, alloc->arg);
+  alloc->alloc(s->post_buf, 0, alloc->arg);
+  alloc->alloc(s->font_buf, 0, alloc->arg);
+  s->face = s->face_buf = NULL;
+  s->group = s->group_buf = NULL;
+  s->post = s->post_buf = NULL;
+  s->font = s->font_buf = NULL;
+  s->num_face = s->num_group = s->num_post = s->num_font = 0;
+}
+
+int fs_build_index(FS_Set *s) {
+  fs_fuzzy_free(s);
+  if (s->face != NULL && s->face_buf == NULL) {
+    // index is mapped from the cache, already sorted
+    return fs_blacklist_apply(s);
+  }
+
+  fs_index_free(s);
+  allocator_t *alloc = s->alloc;
+  const size_t idx_size = (s->stat.num_face + 1) * sizeof(FS_IndexRec);
+  FS_IndexRec *idx = (FS_IndexRec *)alloc->alloc(NULL, idx_size, alloc->arg);
+  if (idx == NULL) {
+    return FL_OUT_OF_MEMORY;
+  }
+
+  // scan lines, each worker takes a range of whole records
+  const uint32_t n_worker = fs_num_worker(s->stat.num_face);
+  const size_t cch_db = str_db_tell(&s->db);
+  FS_ScanPart part[kFsMaxWorker];
+  for (uint32_t i = 0; i != n_worker; i++) {
+    part[i] = (FS_ScanPart){
+        .set = s, .begin = fs_next_record(s, cch_db / n_worker * i)};
+    vec_init(&part[i].recs, sizeof(FS_IndexRec), alloc);
+    vec_init(&part[i].fonts, sizeof(FS_FontRec), alloc);
+    str_db_init(&part[i].keys, alloc, 0, 1);
+  }
+  for (uint32_t i = 0; i != n_worker; i++) {
+    part[i].end = i + 1 == n_worker ? cch_db : part[i + 1].begin;
+  }
+  fs_run_workers(fs_scan_worker, part, sizeof part[0], n_worker);
+
+  // concatenate, in the order of the pool
+  uint32_t num_font = 0;
+  for (uint32_t i = 0; i != n_worker; i++) {
+    num_font += (uint32_t)part[i].fonts.n;
+  }
+  FS_FontRec *font = (FS_FontRec *)alloc->alloc(
+      NULL, (num_font + 1) * sizeof font[0], alloc->arg);
+  s->font = s->font_buf = font;
+  s->num_font = 0;
+
+  FS_Stat stat = {.num_face = 0, .num_file = 0};
+  int err = font == NULL;
+  str_db_seek(&s->keys, 0);
+  for (uint32_t i = 0; i != n_worker; i++) {
+    const FS_IndexRec *recs = (const FS_IndexRec *)part[i].recs.data;
+    const uint32_t base_key = (uint32_t)str_db_tell(&s->keys);
+    const uint32_t base_font = s->num_font;
+    err = err || part[i].err ||
+          stat.num_face + part[i].stat.num_face > s->stat.num_face ||
+          !vec_append(&s->keys.vec, part[i].keys.vec.data, part[i].keys.vec.n);
+    for (uint32_t j = 0; !err && j != part[i].stat.num_face; j++) {
+      FS_IndexRec *r = &idx[stat.num_face++];
+      *r = recs[j];
+      r->key += base_key;
+      r->font += base_font;
+    }
+    if (!err) {
+      zmemcpy(
+          font + base_font, part[i].fonts.data,
+          part[i].fonts.n * sizeof font[0]);
+      s->num_font += (uint32_t)part[i].fonts.n;
+    }
+    stat.num_file += part[i].stat.num_file;
+    vec_free(&part[i].recs);
+    vec_free(&part[i].fonts);
+    str_db_free(&part[i].keys);
   }
 
   if (stat.num_face != s->stat.num_face || stat.num_file != s->stat.num_file)
     err = 1;
 
   if (!err) {
-    // sort
-    tim_sort(idx, stat.num_face, sizeof idx[0], s->alloc, fs_idx_comp, s);
+    err = fs_rank_fonts(s, idx) != FL_OK;
+  }
+  if (!err) {
+    err = fs_sort_index(s, idx, n_worker) != FL_OK;
+  }
+  if (!err) {
+    err = fs_build_faces(s, idx) != FL_OK;
     // fs_index_debug_dump(s);
-  } else {
-    alloc->alloc(idx, 0, alloc->arg);
-    idx = NULL;
-    s->index = idx;
+  }
+  if (!err) {
+    err = fs_build_face_hash(s) != FL_OK || fs_blacklist_apply(s) != FL_OK;
+  }
+  alloc->alloc(idx, 0, alloc->arg);
+  if (err) {
+    fs_index_free(s);
   }
 
   return err ? FL_OUT_OF_MEMORY : FL_OK;
 }
 
-int fs_iter_new(FS_Set *s, const wchar_t *face, FS_Iter *it) {
-  if (s == NULL || s->index == NULL || it == NULL)
-    return 0;
-  int a = 0, b = s->stat.num_face - 1;
-  int m = 0;
-  if (s->index != NULL && s->stat.num_face != 0) {
-    while (a <= b) {
-      m = a + (b - a) / 2;
-      const wchar_t *got = s->index[m].face;
-      const int t = FlStrCmpIW(face, got);
-      if (t == 0) {
-        a = b = m;
-        break;
-      }
-      if (t > 0) {
-        a = m + 1;
-      } else {
-        b = m - 1;
-      }
+static int fs_font_hidden(FS_Set *s, uint32_t font_id) {
+  return s->hidden != NULL && s->hidden[font_id];
+}
+
+static int fs_find_face(FS_Set *s, const wchar_t *face) {
+  if (s->face_hash.slot != NULL) {
+    // lookup in hash table
+    const uint32_t h = fs_face_hash(face);
+    uint32_t probe = 0, i;
+    while ((i = hash_tab_next(&s->face_hash, h, &probe)) != kHashTabNone) {
+      if (i < s->num_face &&
+          fs_key_cmp(face, fs_key_str(s, s->face[i].key)) == 0)
+        return (int)i;
     }
+    return -1;
   }
 
-  do {
-    if (!(a == b && a == m)) {
-      break;
+  int a = 0, b = s->num_face - 1;
+  while (a <= b) {
+    const int m = a + (b - a) / 2;
+    const int t = fs_key_cmp(face, fs_key_str(s, s->face[m].key));
+    if (t == 0) {
+      return m;
     }
-    // found by fontface, skip to first match
-    while (m > 0 && FlStrCmpIW(face, s->index[m - 1].face) == 0) {
-      m--;
+    if (t > 0) {
+      a = m + 1;
+    } else {
+      b = m - 1;
     }
+  }
+  return -1;
+}
+
+static int fs_iter_face(FS_Set *s, int face_id, FS_Iter *it) {
+  if (face_id >= 0) {
     // enforce blacklist
-    while (m != s->stat.num_face && fs_blacklist_match(s, s->index[m].tag)) {
-      m++;
-    }
-    if (m == s->stat.num_face) {
-      break;
+    const FS_FaceRec *face = &s->face[face_id];
+    for (uint32_t g = face[0].group; g != face[1].group; g++) {
+      for (uint32_t p = s->group[g].post; p != s->group[g + 1].post; p++) {
+        if (!fs_font_hidden(s, s->post[p] & kFsPostFontMask)) {
+          *it = (FS_Iter){
+              .set = s,
+              .face_id = face_id,
+              .span = face->span,
+              .group_id = g,
+              .post_id = p,
+              .rank = s->group[g].rank};
+          fs_font_info(s, face_id, s->post[p], &it->info);
+          return 1;
+        }
+      }
     }
-    *it =
-        (FS_Iter){.set = s, .query_id = m, .index_id = m, .info = s->index[m]};
-    return 1;
-  } while ((0));
+  }
 
   // *it = (FS_Iter){0};
   it->set = NULL;
-  it->query_id = 0;
-  it->index_id = 0;
+  it->face_id = 0;
+  it->span = 0;
+  it->group_id = 0;
+  it->post_id = 0;
+  it->rank = 0;
   return 0;
 }
 
-static size_t str_cmp_x(const wchar_t *a, const wchar_t *b) {
-  size_t r;
-  for (r = 0; a[r] == b[r] && a[r]; r++) {
-    // nop;
+int fs_iter_new(FS_Set *s, const wchar_t *face, FS_Iter *it) {
+  if (s == NULL || s->face == NULL || it == NULL)
+    return 0;
+  return fs_iter_face(s, fs_find_face(s, face), it);
+}
+
+// move to the group of the same format and version in the next faces
+// prefixed by the query
+static int fs_iter_next_group(FS_Set *s, FS_Iter *it) {
+  while (++it->face_id < it->span) {
+    const FS_FaceRec *face = &s->face[it->face_id];
+    for (uint32_t g = face[0].group; g != face[1].group; g++) {
+      const uint32_t rank = s->group[g].rank;
+      if (rank == it->rank) {
+        it->group_id = g;
+        it->post_id = s->group[g].post;
+        return 1;
+      }
+      if (rank < it->rank)
+        break;
+    }
   }
-  return r;
+  return 0;
 }
 
 int fs_iter_next(FS_Iter *it) {
   FS_Set *s = it->set;
   if (s == NULL)
     return 0;
-  if (it->index_id == s->stat.num_face)
-    return 0;
-  it->index_id++;
-  const wchar_t *face = s->index[it->query_id].face;
-  const wchar_t *ver = s->index[it->query_id].ver;
-  FS_Format fmt = s->index[it->query_id].format;
-
-  for (; it->index_id != s->stat.num_face; it->index_id++) {
-    const wchar_t *got_face = s->index[it->index_id].face;
-    const wchar_t *got_ver = s->index[it->index_id].ver;
-    FS_Format got_fmt = s->index[it->index_id].format;
-
-    // check if prefix matches
-    const size_t df = str_cmp_x(face, got_face);
-    if (face[df] != 0) {
-      break;
+
+  while (1) {
+    it->post_id++;
+    while (it->post_id >= s->group[it->group_id + 1].post) {
+      if (!fs_iter_next_group(s, it)) {
+        // iter end
+        // *it = (FS_Iter){0};
+        it->set = NULL;
+        return 0;
+      }
     }
 
-    // check format
-    if (fmt != got_fmt) {
+    const uint32_t post = s->post[it->post_id];
+    if (fs_font_hidden(s, post & kFsPostFontMask)) {
       continue;
     }
 
-    // check version
-    if (ver == NULL) {
-      if (got_ver != NULL)
-        continue;
-    } else {
-      if (got_ver == NULL)
-        continue;
-      const size_t dv = str_cmp_x(ver, got_ver);
-      if (ver[dv] != 0 || got_ver[dv] != 0)
-        continue;
+    // match found
+    fs_font_info(s, it->face_id, post, &it->info);
+    return 1;
+  }
+}
+
+int fs_iter_next_version(FS_Iter *it) {
+  FS_Set *s = it->set;
+  if (s == NULL)
+    return 0;
+
+  while (1) {
+    it->post_id++;
+    while (it->post_id >= s->group[it->group_id + 1].post) {
+      if (++it->group_id == s->face[it->face_id + 1].group) {
+        // iter end
+        it->set = NULL;
+        return 0;
+      }
+      it->rank = s->group[it->group_id].rank;
     }
 
-    if (fs_blacklist_match(s, s->index[it->index_id].tag)) {
+    const uint32_t post = s->post[it->post_id];
+    if (fs_font_hidden(s, post & kFsPostFontMask)) {
       continue;
     }
 
-    // match found
-    it->info = s->index[it->index_id];
+    fs_font_info(s, it->face_id, post, &it->info);
     return 1;
   }
-  // iter end
-  // *it = (FS_Iter){0};
+}
+
+#define kFuzzyMaxLen (128)
+#define kFuzzyMaxDist (3)
+
+static int fs_fuzzy_skip(wchar_t ch) {
+  return ch == ' ' || ch == '\t' || ch == '-' || ch == '_' || ch == 0x3000;
+}
+
+static wchar_t fs_fuzzy_fold(wchar_t ch) {
+  if (ch >= 0xff01 && ch <= 0xff5e) {
+    // full-width ASCII
+    ch = ch - 0xff01 + '!';
+  }
+  return FlCaseFold(ch);
+}
+
+// fold in place, drop spaces and separators, return the new length
+static size_t fs_fuzzy_normalize(wchar_t *str) {
+  size_t n = 0;
+  for (const wchar_t *p = str; *p; p++) {
+    if (!fs_fuzzy_skip(*p)) {
+      str[n++] = fs_fuzzy_fold(*p);
+    }
+  }
+  str[n] = 0;
+  return n;
+}
+
+static uint32_t fs_fuzzy_gram(FS_Fuzzy *z, const wchar_t *str) {
+  return str_hash(kStrHashInit, str, 3) & z->mask;
+}
+
+static const wchar_t *fs_fuzzy_str(FS_Fuzzy *z, uint32_t id) {
+  return str_db_get(&z->pool, z->norm[id]);
+}
+
+static uint32_t fs_fuzzy_len(FS_Fuzzy *z, uint32_t id) {
+  const size_t end =
+      id + 1 == z->num ? str_db_tell(&z->pool) : (size_t)z->norm[id + 1];
+  return (uint32_t)(end - z->norm[id] - 1);
+}
+
+static void fs_fuzzy_free(FS_Set *s) {
+  FS_Fuzzy *z = s->fuzzy;
+  if (z == NULL)
+    return;
+  allocator_t *alloc = s->alloc;
+  alloc->alloc(z->norm, 0, alloc->arg);
+  str_db_free(&z->pool);
+  hash_tab_free(&z->hash);
+  alloc->alloc(z->gram_off, 0, alloc->arg);
+  alloc->alloc(z->gram_post, 0, alloc->arg);
+  alloc->alloc(z, 0, alloc->arg);
+  s->fuzzy = NULL;
+}
+
+static int fs_fuzzy_build_grams(FS_Set *s, FS_Fuzzy *z) {
+  allocator_t *alloc = s->alloc;
+  uint32_t num_bucket = 256;
+  while (num_bucket < z->num && num_bucket < (1u << 20))
+    num_bucket *= 2;
+  z->mask = num_bucket - 1;
+
+  // count distinct trigrams of each face, cursor is reused for filling
+  uint32_t *cursor = (uint32_t *)alloc->alloc(
+      NULL, num_bucket * sizeof cursor[0], alloc->arg);
+  z->gram_off = (uint32_t *)alloc->alloc(
+      NULL, (num_bucket + 1) * sizeof z->gram_off[0], alloc->arg);
+  if (cursor == NULL || z->gram_off == NULL) {
+    alloc->alloc(cursor, 0, alloc->arg);
+    return FL_OUT_OF_MEMORY;
+  }
+
+  zmemset(cursor, 0xff, num_bucket * sizeof cursor[0]);
+  for (uint32_t id = 0; id != z->num; id++) {
+    const wchar_t *str = fs_fuzzy_str(z, id);
+    for (size_t i = 0; str[i] && str[i + 1] && str[i + 2]; i++) {
+      const uint32_t b = fs_fuzzy_gram(z, str + i);
+      if (cursor[b] != id) {
+        cursor[b] = id;
+        z->gram_off[b + 1]++;
+      }
+    }
+  }
+  for (uint32_t b = 0; b != num_bucket; b++) {
+    z->gram_off[b + 1] += z->gram_off[b];
+    cursor[b] = z->gram_off[b];
+  }
+
+  const uint32_t num_post = z->gram_off[num_bucket];
+  z->gram_post = (uint32_t *)alloc->alloc(
+      NULL, (num_post ? num_post : 1) * sizeof z->gram_post[0], alloc->arg);
+  if (z->gram_post == NULL) {
+    alloc->alloc(cursor, 0, alloc->arg);
+    return FL_OUT_OF_MEMORY;
+  }
+  for (uint32_t id = 0; id != z->num; id++) {
+    const wchar_t *str = fs_fuzzy_str(z, id);
+    for (size_t i = 0; str[i] && str[i + 1] && str[i + 2]; i++) {
+      const uint32_t b = fs_fuzzy_gram(z, str + i);
+      // ids are ascending, repeated trigram shows up as the last posting
+      if (cursor[b] == z->gram_off[b] || z->gram_post[cursor[b] - 1] != id) {
+        z->gram_post[cursor[b]++] = id;
+      }
+    }
+  }
+  alloc->alloc(cursor, 0, alloc->arg);
+  return FL_OK;
+}
+
+static int fs_fuzzy_build(FS_Set *s) {
+  allocator_t *alloc = s->alloc;
+  FS_Fuzzy *z = (FS_Fuzzy *)alloc->alloc(NULL, sizeof *z, alloc->arg);
+  if (z == NULL)
+    return FL_OUT_OF_MEMORY;
+  s->fuzzy = z;
+  str_db_init(&z->pool, alloc, 0, 1);
+  hash_tab_init(&z->hash, alloc);
+
+  // same ids as the faces of the index
+  const size_t cap = s->num_face ? s->num_face : 1;
+  z->norm = (uint32_t *)alloc->alloc(NULL, cap * sizeof z->norm[0], alloc->arg);
+  if (z->norm == NULL)
+    return FL_OUT_OF_MEMORY;
+
+  for (uint32_t i = 0; i != s->num_face; i++) {
+    const wchar_t *key = fs_key_str(s, s->face[i].key);
+    const size_t pos = str_db_tell(&z->pool);
+    wchar_t *str = (wchar_t *)str_db_push_u16_le(&z->pool, key, 0);
+    if (str == NULL)
+      return FL_OUT_OF_MEMORY;
+    const size_t len = fs_fuzzy_normalize(str);
+    str_db_seek(&z->pool, pos + len + 1);
+
+    const uint32_t id = z->num++;
+    z->norm[id] = (uint32_t)pos;
+    if (!hash_tab_insert(&z->hash, str_hash(kStrHashInit, str, len), id))
+      return FL_OUT_OF_MEMORY;
+  }
+
+  return fs_fuzzy_build_grams(s, z);
+}
+
+// edit distance of a and b, or max_dist + 1 if it's larger than max_dist
+static uint32_t fs_edit_dist(
+    const wchar_t *a,
+    uint32_t len_a,
+    const wchar_t *b,
+    uint32_t max_dist) {
+  uint16_t row[kFuzzyMaxLen + 1];
+  for (uint32_t j = 0; j <= len_a; j++) {
+    row[j] = (uint16_t)j;
+  }
+  uint32_t i;
+  for (i = 0; b[i]; i++) {
+    uint16_t diag = row[0];
+    uint16_t row_min = row[0] = (uint16_t)(i + 1);
+    for (uint32_t j = 1; j <= len_a; j++) {
+      const uint16_t up = row[j];
+      uint16_t v = diag + (a[j - 1] != b[i]);
+      if (up + 1 < v)
+        v = up + 1;
+      if (row[j - 1] + 1 < v)
+        v = row[j - 1] + 1;
+      row[j] = v;
+      diag = up;
+      if (v < row_min)
+        row_min = v;
+    }
+    if (row_min > max_dist)
+      return max_dist + 1;
+  }
+  return row[len_a] > max_dist ? max_dist + 1 : row[len_a];
+}
+
+static int fs_fuzzy_post_find(const uint32_t *post, uint32_t n, uint32_t id) {
+  uint32_t a = 0, b = n;
+  while (a < b) {
+    const uint32_t m = a + (b - a) / 2;
+    if (post[m] < id)
+      a = m + 1;
+    else
+      b = m;
+  }
+  return a != n && post[a] == id;
+}
+
+// pick the closest visible face among candidates, or -1
+static int fs_fuzzy_search(
+    FS_Set *s,
+    const wchar_t *query,
+    uint32_t len,
+    FS_FuzzyBuf *buf,
+    FS_Iter *it) {
+  FS_Fuzzy *z = s->fuzzy;
+
+  // 1. same face after normalization
+  uint32_t probe = 0, id, best = kFsNoStr;
+  const uint32_t h = str_hash(kStrHashInit, query, len);
+  while ((id = hash_tab_next(&z->hash, h, &probe)) != kHashTabNone) {
+    if (id < best && fs_str_cmp(query, fs_fuzzy_str(z, id)) == 0 &&
+        fs_iter_face(s, id, it))
+      best = id;
+  }
+  if (best != kFsNoStr)
+    return fs_iter_face(s, best, it);
+  if (len < 4)
+    return 0;
+
+  // 2. candidates sharing enough trigrams, then verify with edit distance.
+  // an edit breaks at most 3 trigrams, so a face within max_dist must
+  // appear in all but 3 * max_dist of the buckets, i.e. in one of the
+  // (3 * max_dist + 1) shortest lists, then check the rest by bisection.
+  uint32_t max_dist = 1 + len / 12;
+  if (max_dist > kFuzzyMaxDist)
+    max_dist = kFuzzyMaxDist;
+
+  uint32_t grams[kFuzzyMaxLen];
+  uint32_t num_gram = 0;
+  for (uint32_t i = 0; i + 2 < len; i++) {
+    const uint32_t b = fs_fuzzy_gram(z, query + i);
+    const uint32_t n = z->gram_off[b + 1] - z->gram_off[b];
+    uint32_t j;
+    for (j = 0; j != num_gram && grams[j] != b; j++) {
+      // nop;
+    }
+    if (j != num_gram)
+      continue;
+    // insertion sort by the length of postings
+    for (j = num_gram++; j != 0; j--) {
+      const uint32_t p = grams[j - 1];
+      if (z->gram_off[p + 1] - z->gram_off[p] <= n)
+        break;
+      grams[j] = p;
+    }
+    grams[j] = b;
+  }
+
+  const uint32_t skip = 3 * max_dist;
+  const uint32_t min_score = num_gram > skip ? num_gram - skip : 1;
+  const uint32_t num_scan = num_gram - min_score + 1;
+
+  uint32_t num_touched = 0;
+  for (uint32_t g = 0; g != num_scan; g++) {
+    const uint32_t b = grams[g];
+    for (uint32_t k = z->gram_off[b]; k != z->gram_off[b + 1]; k++) {
+      const uint32_t cand = z->gram_post[k];
+      if (buf->score[cand]++ == 0)
+        buf->touched[num_touched++] = cand;
+    }
+  }
+
+  uint32_t best_dist = max_dist + 1;
+  for (uint32_t t = 0; t != num_touched; t++) {
+    const uint32_t cand = buf->touched[t];
+    uint32_t score = buf->score[cand];
+    buf->score[cand] = 0;
+    const uint32_t len_cand = fs_fuzzy_len(z, cand);
+    if (len_cand > len + max_dist || len_cand + max_dist < len)
+      continue;
+    for (uint32_t g = num_scan; g != num_gram && score < min_score &&
+                                score + (num_gram - g) >= min_score;
+         g++) {
+      const uint32_t b = grams[g];
+      score += fs_fuzzy_post_find(
+          z->gram_post + z->gram_off[b], z->gram_off[b + 1] - z->gram_off[b],
+          cand);
+    }
+    if (score < min_score)
+      continue;
+
+    const uint32_t limit = best_dist > max_dist ? max_dist : best_dist;
+    const uint32_t d = fs_edit_dist(query, len, fs_fuzzy_str(z, cand), limit);
+    if (d > limit || (d == best_dist && cand > best))
+      continue;
+    if (fs_iter_face(s, cand, it)) {
+      best_dist = d;
+      best = cand;
+    }
+  }
+
+  if (best == kFsNoStr)
+    return 0;
+  return fs_iter_face(s, best, it);
+}
+
+int fs_build_fuzzy(FS_Set *s) {
+  if (s == NULL || s->face == NULL)
+    return FL_UNRECOGNIZED;
+  if (s->fuzzy)
+    return FL_OK;
+  const int r = fs_fuzzy_build(s);
+  if (r != FL_OK)
+    fs_fuzzy_free(s);
+  return r;
+}
+
+void fs_fuzzy_buf_free(FS_FuzzyBuf *buf) {
+  allocator_t *alloc = buf->alloc;
+  if (alloc) {
+    alloc->alloc(buf->score, 0, alloc->arg);
+    alloc->alloc(buf->touched, 0, alloc->arg);
+  }
+  zmemset(buf, 0, sizeof *buf);
+}
+
+// sized for the faces of the set, scores are zero
+static int fs_fuzzy_buf_reserve(FS_Set *s, FS_FuzzyBuf *buf) {
+  const uint32_t num = s->fuzzy->num ? s->fuzzy->num : 1;
+  if (buf->num >= num)
+    return FL_OK;
+  fs_fuzzy_buf_free(buf);
+  allocator_t *alloc = s->alloc;
+  buf->alloc = alloc;
+  buf->score =
+      (uint16_t *)alloc->alloc(NULL, num * sizeof buf->score[0], alloc->arg);
+  buf->touched =
+      (uint32_t *)alloc->alloc(NULL, num * sizeof buf->touched[0], alloc->arg);
+  if (buf->score == NULL || buf->touched == NULL) {
+    fs_fuzzy_buf_free(buf);
+    return FL_OUT_OF_MEMORY;
+  }
+  zmemset(buf->score, 0, num * sizeof buf->score[0]);
+  buf->num = num;
+  return FL_OK;
+}
+
+int fs_iter_fuzzy(
+    FS_Set *s,
+    const wchar_t *face,
+    FS_FuzzyBuf *buf,
+    FS_Iter *it) {
+  if (s == NULL || s->face == NULL || it == NULL)
+    return 0;
   it->set = NULL;
+  if (fs_build_fuzzy(s) != FL_OK || fs_fuzzy_buf_reserve(s, buf) != FL_OK)
+    return 0;
+
+  wchar_t query[kFuzzyMaxLen + 1];
+  size_t len = 0;
+  for (; *face; face++) {
+    if (fs_fuzzy_skip(*face))
+      continue;
+    if (len == kFuzzyMaxLen)
+      return 0;
+    query[len++] = fs_fuzzy_fold(*face);
+  }
+  query[len] = 0;
+  if (len == 0)
+    return 0;
+
+  return fs_fuzzy_search(s, query, (uint32_t)len, buf, it);
+}
+
+static int fs_line_is_tag(const wchar_t *line) {
+  return ass_strncmp(line, kTagVersion, kTagVersionLen) == 0 ||
+         ass_strncmp(line, kTagFormat, kTagFormatLen) == 0 ||
+         ass_strncmp(line, kTagError, kTagErrorLen) == 0 ||
+         ass_strncmp(line, kTagMeta, kTagMetaLen) == 0 ||
+         ass_strncmp(line, kTagKind, kTagKindLen) == 0;
+}
+
+static int fs_meta_id_known(const FS_FileMeta *m) {
+  return m->id_lo != 0 || m->id_hi != 0 || m->volume != 0;
+}
+
+static int fs_meta_id_cmp(const FS_FileMeta *a, const FS_FileMeta *b) {
+  if (a->volume != b->volume)
+    return a->volume < b->volume ? -1 : 1;
+  if (a->id_hi != b->id_hi)
+    return a->id_hi < b->id_hi ? -1 : 1;
+  if (a->id_lo != b->id_lo)
+    return a->id_lo < b->id_lo ? -1 : 1;
   return 0;
 }
 
+static int fs_file_tag_comp(const void *pa, const void *pb, void *arg) {
+  FS_Set *s = arg;
+  const FS_FileRec *a = pa, *b = pb;
+  return fs_str_cmp(fs_pool_str(s, a->pos), fs_pool_str(s, b->pos));
+}
+
+static int fs_file_id_comp(const void *pa, const void *pb, void *arg) {
+  FS_Set *s = arg;
+  const FS_FileRec *files = s->files.data;
+  const uint32_t a = *(const uint32_t *)pa, b = *(const uint32_t *)pb;
+  return fs_meta_id_cmp(&files[a].meta, &files[b].meta);
+}
+
+// collect files with metadata, sorted by tag and by file id
+static int fs_build_files(FS_Set *s) {
+  if (s->files_by_id != NULL)
+    return FL_OK;
+
+  const wchar_t *pool = str_db_get(&s->db, 0);
+  const wchar_t *line;
+  size_t pos = 0;
+  int has_filename = 0, expect_meta = 0;
+  FS_FileRec rec = {0};
+  while ((line = str_db_next(&s->db, &pos)) != NULL) {
+    if (line[0] == 0) {
+      has_filename = 0;
+      expect_meta = 0;
+    } else if (!has_filename) {
+      has_filename = 1;
+      expect_meta = 1;
+      rec.pos = (uint32_t)(line - pool);
+    } else if (expect_meta) {
+      // metadata always follows the filename
+      expect_meta = 0;
+      if (ass_strncmp(line, kTagMeta, kTagMetaLen) == 0 &&
+          fs_meta_from_str(line + kTagMetaLen, &rec.meta)) {
+        if (!vec_append(&s->files, &rec, 1))
+          return FL_OUT_OF_MEMORY;
+      }
+    }
+  }
+
+  allocator_t *alloc = s->alloc;
+  const size_t n = s->files.n;
+  uint32_t *by_id =
+      (uint32_t *)alloc->alloc(NULL, (n + 1) * sizeof by_id[0], alloc->arg);
+  if (by_id == NULL)
+    return FL_OUT_OF_MEMORY;
+  for (size_t i = 0; i != n; i++) {
+    by_id[i] = (uint32_t)i;
+  }
+  tim_sort(s->files.data, n, s->files.size, alloc, fs_file_tag_comp, s);
+  tim_sort(by_id, n, sizeof by_id[0], alloc, fs_file_id_comp, s);
+  s->files_by_id = by_id;
+  return FL_OK;
+}
+
+static const FS_FileRec *fs_find_file_by_tag(FS_Set *s, const wchar_t *tag) {
+  const FS_FileRec *files = s->files.data;
+  size_t a = 0, b = s->files.n;
+  while (a < b) {
+    const size_t m = a + (b - a) / 2;
+    const int t = fs_str_cmp(tag, fs_pool_str(s, files[m].pos));
+    if (t == 0)
+      return &files[m];
+    if (t > 0)
+      a = m + 1;
+    else
+      b = m;
+  }
+  return NULL;
+}
+
+static const FS_FileRec *
+fs_find_file_by_id(FS_Set *s, const FS_FileMeta *meta) {
+  const FS_FileRec *files = s->files.data;
+  size_t a = 0, b = s->files.n;
+  while (a < b) {
+    const size_t m = a + (b - a) / 2;
+    const FS_FileRec *got = &files[s->files_by_id[m]];
+    const int t = fs_meta_id_cmp(meta, &got->meta);
+    if (t == 0)
+      return got;
+    if (t > 0)
+      a = m + 1;
+    else
+      b = m;
+  }
+  return NULL;
+}
+
+static FS_DigestRec *fs_digest_find(FS_Set *s, uint32_t tag) {
+  FS_DigestRec *digests = s->digests.data;
+  const uint32_t h = str_hash(kStrHashInit, (const wchar_t *)&tag, 2);
+  uint32_t probe = 0, i;
+  while ((i = hash_tab_next(&s->digest_hash, h, &probe)) != kHashTabNone) {
+    if (i < s->digests.n && digests[i].tag == tag)
+      return &digests[i];
+  }
+  return NULL;
+}
+
+// add or replace the digest of rec->tag
+static int fs_digest_set(FS_Set *s, const FS_DigestRec *rec) {
+  FS_DigestRec *got = fs_digest_find(s, rec->tag);
+  if (got != NULL) {
+    *got = *rec;
+    return FL_OK;
+  }
+  const uint32_t h = str_hash(kStrHashInit, (const wchar_t *)&rec->tag, 2);
+  const uint32_t i = (uint32_t)s->digests.n;
+  if (!vec_append(&s->digests, (void *)rec, 1) ||
+      !hash_tab_insert(&s->digest_hash, h, i))
+    return FL_OUT_OF_MEMORY;
+  return FL_OK;
+}
+
+// position of a tag returned by the set, or kFsNoStr
+static uint32_t fs_tag_pos(FS_Set *s, const wchar_t *tag) {
+  const wchar_t *pool = str_db_get(&s->db, 0);
+  if (pool == NULL || tag < pool || tag >= pool + str_db_tell(&s->db))
+    return kFsNoStr;
+  return (uint32_t)(tag - pool);
+}
+
+int fs_file_meta(FS_Set *s, const wchar_t *tag, FS_FileMeta *meta) {
+  if (s == NULL)
+    return 0;
+  const uint32_t at = fs_tag_pos(s, tag);
+  if (at == kFsNoStr)
+    return 0;
+  size_t pos = at;
+  str_db_next(&s->db, &pos);  // filename
+  const wchar_t *line = str_db_next(&s->db, &pos);
+  return line != NULL && ass_strncmp(line, kTagMeta, kTagMetaLen) == 0 &&
+         fs_meta_from_str(line + kTagMetaLen, meta);
+}
+
+int fs_digest_get(
+    FS_Set *s,
+    const wchar_t *tag,
+    const FS_FileMeta *meta,
+    uint8_t hash[32]) {
+  if (s == NULL)
+    return 0;
+  const uint32_t pos = fs_tag_pos(s, tag);
+  const FS_DigestRec *d = pos != kFsNoStr ? fs_digest_find(s, pos) : NULL;
+  if (d == NULL || d->size_lo != meta->size_lo ||
+      d->size_hi != meta->size_hi || d->mtime_lo != meta->mtime_lo ||
+      d->mtime_hi != meta->mtime_hi)
+    return 0;
+  zmemcpy(hash, d->hash, sizeof d->hash);
+  return 1;
+}
+
+int fs_digest_put(
+    FS_Set *s,
+    const wchar_t *tag,
+    const FS_FileMeta *meta,
+    const uint8_t hash[32]) {
+  if (s == NULL)
+    return FL_UNRECOGNIZED;
+  const uint32_t pos = fs_tag_pos(s, tag);
+  if (pos == kFsNoStr)
+    return FL_UNRECOGNIZED;
+
+  FS_DigestRec rec;
+  rec.tag = pos;
+  rec.size_lo = meta->size_lo;
+  rec.size_hi = meta->size_hi;
+  rec.mtime_lo = meta->mtime_lo;
+  rec.mtime_hi = meta->mtime_hi;
+  zmemcpy(rec.hash, hash, sizeof rec.hash);
+  const int r = fs_digest_set(s, &rec);
+  if (r == FL_OK)
+    s->num_digest_new++;
+  return r;
+}
+
+uint32_t fs_digest_dirty(FS_Set *s) {
+  return s ? s->num_digest_new : 0;
+}
+
+int fs_add_cached(
+    FS_Set *s,
+    FS_Set *prev,
+    const wchar_t *tag,
+    const FS_FileMeta *meta) {
+  if (prev == NULL)
+    return FL_UNRECOGNIZED;
+  int r = fs_build_files(prev);
+  if (r != FL_OK)
+    return r;
+
+  const int id_known = fs_meta_id_known(meta);
+  const FS_FileRec *f = fs_find_file_by_tag(prev, tag);
+  if (f != NULL && id_known && fs_meta_id_known(&f->meta) &&
+      fs_meta_id_cmp(meta, &f->meta) != 0) {
+    // same name, but another file
+    f = NULL;
+  }
+  if (f == NULL && id_known) {
+    // renamed or moved
+    f = fs_find_file_by_id(prev, meta);
+  }
+  if (f == NULL)
+    return FL_UNRECOGNIZED;
+  if (f->meta.size_lo != meta->size_lo || f->meta.size_hi != meta->size_hi ||
+      f->meta.mtime_lo != meta->mtime_lo || f->meta.mtime_hi != meta->mtime_hi)
+    return FL_UNRECOGNIZED;
+
+  FS_FileMeta new_meta = *meta;
+  if (!id_known) {
+    new_meta.id_lo = f->meta.id_lo;
+    new_meta.id_hi = f->meta.id_hi;
+    new_meta.volume = f->meta.volume;
+  }
+
+  // copy the record, replacing filename and metadata
+  str_db_t *db = &s->db;
+  const size_t pos_filename = str_db_tell(db);
+  uint32_t count_face = 0;
+  int ok = 0;
+  do {
+    if (!str_db_push_u16_le(db, tag, 0) || !fs_push_meta(db, &new_meta))
+      break;
+
+    size_t pos = f->pos;
+    const wchar_t *line;
+    str_db_next(&prev->db, &pos);  // filename
+    str_db_next(&prev->db, &pos);  // metadata
+    int terminated = 0, err = 0;
+    while (!terminated && (line = str_db_next(&prev->db, &pos)) != NULL) {
+      if (!str_db_push_u16_le(db, line, 0)) {
+        err = 1;
+        break;
+      }
+      if (line[0] == 0)
+        terminated = 1;
+      else if (!fs_line_is_tag(line))
+        count_face++;
+    }
+    if (err || (!terminated && !str_db_push_u16_le(db, L"", 0)))
+      break;
+    ok = 1;
+  } while (0);
+
+  // the file is unchanged, so is its digest
+  const FS_DigestRec *d = ok ? fs_digest_find(prev, f->pos) : NULL;
+  if (d != NULL) {
+    FS_DigestRec rec = *d;
+    rec.tag = (uint32_t)pos_filename;
+    ok = fs_digest_set(s, &rec) == FL_OK;
+  }
+
+  if (!ok) {
+    str_db_seek(db, pos_filename);
+    return FL_OUT_OF_MEMORY;
+  }
+  s->stat.num_file++;
+  s->stat.num_face += count_face;
+  return FL_OK;
+}
+
+static int fs_cache_load_legacy(memmap_t *map, FS_Set *s) {
+  FS_CacheHeader *head = map->data;
+  if (head->size != map->size)
+    return FL_UNRECOGNIZED;
+  if (head->size < 8)
+    return FL_UNRECOGNIZED;
+
+  // ensure NUL terminated
+  const wchar_t *buf_tail = (wchar_t *)((char *)map->data + head->size);
+  if (buf_tail[-1] != 0 && buf_tail[-2] != 0)
+    return FL_UNRECOGNIZED;
+
+  str_db_loads(
+      &s->db, (const wchar_t *)&head[1],
+      (head->size - sizeof head[0]) / sizeof(wchar_t), '\n');
+  s->stat = head->stat;
+  return FL_OK;
+}
+
+// check a section of n items of the given size, aligned to align
+static int fs_cache_section(
+    const FS_IndexHeader *head,
+    uint32_t off,
+    uint32_t n,
+    size_t size,
+    size_t align) {
+  const size_t sz = (size_t)n * size;
+  return off % align == 0 && off >= sizeof *head && off <= head->size &&
+         n <= (head->size - off) / size && sz <= head->size - off;
+}
+
+static int fs_cache_load_index(memmap_t *map, FS_Set *s) {
+  const FS_IndexHeader *head = map->data;
+  if (map->size < sizeof *head || head->size != map->size)
+    return FL_UNRECOGNIZED;
+  if (head->version != kFontIdxVersion)
+    return FL_UNRECOGNIZED;
+
+  // range check for all sections
+  const uint32_t num_post = head->num_post;
+  if (!fs_cache_section(
+          head, head->off_face, head->num_face + 1, sizeof(FS_FaceRec),
+          sizeof(uint32_t)) ||
+      head->num_face == kFsNoStr ||
+      !fs_cache_section(
+          head, head->off_group, head->num_group + 1, sizeof(FS_GroupRec),
+          sizeof(uint32_t)) ||
+      head->num_group == kFsNoStr ||
+      !fs_cache_section(
+          head, head->off_post, num_post, sizeof(uint32_t), sizeof(uint32_t)) ||
+      !fs_cache_section(
+          head, head->off_font, head->num_font, sizeof(FS_FontRec),
+          sizeof(uint32_t)) ||
+      !fs_cache_section(
+          head, head->off_digest, head->num_digest, sizeof(FS_DigestRec),
+          sizeof(uint32_t)) ||
+      !fs_cache_section(
+          head, head->off_hash, head->num_hash, sizeof(hash_slot_t),
+          sizeof(uint32_t)) ||
+      !fs_cache_section(
+          head, head->off_keys, head->cch_keys, sizeof(wchar_t),
+          sizeof(wchar_t)) ||
+      !fs_cache_section(
+          head, head->off_pool, head->cch_pool, sizeof(wchar_t),
+          sizeof(wchar_t)))
+    return FL_CORRUPTED;
+  if ((head->num_hash & (head->num_hash - 1)) != 0)
+    return FL_CORRUPTED;
+
+  // ensure NUL terminated
+  const uint8_t *base = (const uint8_t *)map->data;
+  const wchar_t *pool = (const wchar_t *)(base + head->off_pool);
+  if (head->cch_pool != 0 &&
+      (head->cch_pool < 2 || pool[head->cch_pool - 2] != 0))
+    return FL_CORRUPTED;
+  const wchar_t *keys = (const wchar_t *)(base + head->off_keys);
+  if (head->cch_keys != 0 && keys[head->cch_keys - 1] != 0)
+    return FL_CORRUPTED;
+
+  // ensure every record points into its pool
+  const uint32_t cch = head->cch_pool;
+  const FS_FaceRec *face = (const FS_FaceRec *)(base + head->off_face);
+  for (uint32_t i = 0; i != head->num_face; i++) {
+    const FS_FaceRec *r = &face[i];
+    if (r->face >= cch || r->key >= head->cch_keys || r->group > r[1].group ||
+        r->span <= i || r->span > head->num_face)
+      return FL_CORRUPTED;
+  }
+  if (face[0].group != 0 || face[head->num_face].group != head->num_group)
+    return FL_CORRUPTED;
+  const FS_GroupRec *group = (const FS_GroupRec *)(base + head->off_group);
+  for (uint32_t i = 0; i != head->num_group; i++) {
+    if (group[i].post > group[i + 1].post)
+      return FL_CORRUPTED;
+  }
+  if (group[0].post != 0 || group[head->num_group].post != num_post)
+    return FL_CORRUPTED;
+  const uint32_t *post = (const uint32_t *)(base + head->off_post);
+  for (uint32_t i = 0; i != num_post; i++) {
+    if ((post[i] & kFsPostFontMask) >= head->num_font)
+      return FL_CORRUPTED;
+  }
+  const FS_FontRec *font = (const FS_FontRec *)(base + head->off_font);
+  for (uint32_t i = 0; i != head->num_font; i++) {
+    const FS_FontRec *r = &font[i];
+    if (r->tag >= cch || (r->ver != kFsNoStr && r->ver >= cch) ||
+        (r->full != kFsNoStr && r->full >= cch) ||
+        (r->rank >> kFsRankFmtShift) >= FS_FmtMax)
+      return FL_CORRUPTED;
+  }
+
+  // digests are copied, new ones are added on load
+  const FS_DigestRec *digest = (const FS_DigestRec *)(base + head->off_digest);
+  for (uint32_t i = 0; i != head->num_digest; i++) {
+    if (digest[i].tag < cch && fs_digest_set(s, &digest[i]) != FL_OK)
+      return FL_OUT_OF_MEMORY;
+  }
+
+  str_db_loads(&s->db, pool, cch, '\n');
+  str_db_loads(&s->keys, keys, head->cch_keys, 0);
+  s->stat = head->stat;
+  s->face = face;
+  s->group = group;
+  s->post = post;
+  s->font = font;
+  s->num_face = head->num_face;
+  s->num_group = head->num_group;
+  s->num_post = num_post;
+  s->num_font = head->num_font;
+  if (head->num_hash) {
+    // values are checked on lookup
+    const hash_slot_t *slot = (const hash_slot_t *)(base + head->off_hash);
+    hash_tab_loads(&s->face_hash, slot, head->num_hash);
+  }
+  return FL_OK;
+}
+
 int fs_cache_load(const wchar_t *path, allocator_t *alloc, FS_Set **out) {
   int ok = 0, r;
   FS_Set *s = NULL;
@@ -464,27 +2017,25 @@ int fs_cache_load(const wchar_t *path, allocator_t *alloc, FS_Set **out) {
     }
 
     r = FL_UNRECOGNIZED;
-    FS_CacheHeader *head = map.data;
-    if (head->magic != KFontDbMagic)
-      break;
-    if (head->size != map.size)
-      break;
-    if (head->size < 8)
-      break;
-
-    // ensure NUL terminated
-    const wchar_t *buf_tail = (wchar_t *)((char *)map.data + head->size);
-    if (buf_tail[-1] != 0 && buf_tail[-2] != 0)
+    if (map.size < sizeof(FS_CacheHeader))
       break;
 
     r = FL_OUT_OF_MEMORY;
     fs_create(alloc, &s);
     if (s == NULL)
       break;
-    str_db_loads(
-        &s->db, (const wchar_t *)&head[1],
-        (head->size - sizeof head[0]) / sizeof(wchar_t), '\n');
-    s->stat = head->stat;
+
+    const uint32_t magic = *(const uint32_t *)map.data;
+    if (magic == KFontIdxMagic) {
+      r = fs_cache_load_index(&map, s);
+    } else if (magic == KFontDbMagic) {
+      // older text format, index will be built by fs_build_index
+      r = fs_cache_load_legacy(&map, s);
+    } else {
+      r = FL_UNRECOGNIZED;
+    }
+    if (r != FL_OK)
+      break;
 
     ok = 1;
   } while (0);
@@ -513,16 +2064,71 @@ int fs_cache_dump(FS_Set *s, const wchar_t *path) {
     if (h == INVALID_HANDLE_VALUE)
       break;
     const wchar_t *buf = str_db_get(&s->db, 0);
-    FS_CacheHeader head = {
-        .magic = KFontDbMagic,
+    const int indexed = s->face != NULL;
+    const uint32_t num_face = indexed ? s->num_face : 0;
+    const uint32_t sz_face = indexed ? (num_face + 1) * sizeof s->face[0] : 0;
+    const uint32_t num_group = indexed ? s->num_group : 0;
+    const uint32_t sz_group =
+        indexed ? (num_group + 1) * sizeof s->group[0] : 0;
+    const uint32_t num_post = indexed ? s->num_post : 0;
+    const uint32_t sz_post = num_post * sizeof s->post[0];
+    const uint32_t num_font = indexed ? s->num_font : 0;
+    const uint32_t sz_font = num_font * sizeof s->font[0];
+    const uint32_t num_digest = (uint32_t)s->digests.n;
+    const uint32_t sz_digest = num_digest * sizeof(FS_DigestRec);
+    const uint32_t num_hash = s->face_hash.slot ? s->face_hash.mask + 1 : 0;
+    const uint32_t sz_hash = num_hash * sizeof s->face_hash.slot[0];
+    const uint32_t cch_pool = (uint32_t)str_db_tell(&s->db);
+    const uint32_t cch_keys = indexed ? (uint32_t)str_db_tell(&s->keys) : 0;
+    const uint32_t sz_keys = cch_keys * sizeof buf[0];
+    FS_IndexHeader head = {
+        .magic = KFontIdxMagic,
+        .version = kFontIdxVersion,
         .stat = s->stat,
-        .size = sizeof head + str_db_tell(&s->db) * sizeof buf[0]};
+        .num_face = num_face,
+        .num_group = num_group,
+        .num_post = num_post,
+        .num_font = num_font,
+        .num_digest = num_digest,
+        .num_hash = num_hash,
+        .cch_keys = cch_keys,
+        .cch_pool = cch_pool};
+    head.off_face = sizeof head;
+    head.off_group = head.off_face + sz_face;
+    head.off_post = head.off_group + sz_group;
+    head.off_font = head.off_post + sz_post;
+    head.off_digest = head.off_font + sz_font;
+    head.off_hash = head.off_digest + sz_digest;
+    head.off_keys = head.off_hash + sz_hash;
+    head.off_pool = head.off_keys + sz_keys;
+    head.size = head.off_pool + cch_pool * sizeof buf[0];
+    if (!indexed) {
+      // without an index, the cache can't be loaded anyway
+      head.version = 0;
+    }
 
     DWORD dw_out;
     if (!WriteFile(h, &head, sizeof head, &dw_out, NULL))
       break;
-    if (!WriteFile(h, buf, str_db_tell(&s->db) * sizeof buf[0], &dw_out, NULL))
+    if (sz_face && !WriteFile(h, s->face, sz_face, &dw_out, NULL))
+      break;
+    if (sz_group && !WriteFile(h, s->group, sz_group, &dw_out, NULL))
+      break;
+    if (sz_post && !WriteFile(h, s->post, sz_post, &dw_out, NULL))
+      break;
+    if (sz_font && !WriteFile(h, s->font, sz_font, &dw_out, NULL))
+      break;
+    if (sz_digest &&
+        !WriteFile(h, s->digests.data, sz_digest, &dw_out, NULL))
       break;
+    if (sz_hash && !WriteFile(h, s->face_hash.slot, sz_hash, &dw_out, NULL))
+      break;
+    if (sz_keys &&
+        !WriteFile(h, str_db_get(&s->keys, 0), sz_keys, &dw_out, NULL))
+      break;
+    if (!WriteFile(h, buf, cch_pool * sizeof buf[0], &dw_out, NULL))
+      break;
+    s->num_digest_new = 0;
     ok = 1;
   } while (0);
 
@@ -532,29 +2138,84 @@ int fs_cache_dump(FS_Set *s, const wchar_t *path) {
 
 int fs_blacklist_clear(FS_Set *s) {
   str_db_seek(&s->blacklist, 0);
+  hash_tab_clear(&s->black_hash);
   return 0;
 }
 
+static uint32_t fs_black_hash_step(uint32_t h, wchar_t ch) {
+  const wchar_t f = FlCaseFold(ch);
+  return str_hash(h, &f, 1);
+}
+
 int fs_blacklist_add(FS_Set *s, const wchar_t *path, size_t cch) {
+  const size_t pos = str_db_tell(&s->blacklist);
   const wchar_t *ret = str_db_push_u16_le(&s->blacklist, path, cch);
-  return ret == NULL;
+  if (ret == NULL)
+    return 1;
+
+  // hashed from the last char, same as the suffix in fs_blacklist_match
+  uint32_t h = kStrHashInit;
+  for (size_t i = ass_strlen(ret); i != 0; i--) {
+    h = fs_black_hash_step(h, ret[i - 1]);
+  }
+  if (!hash_tab_insert(&s->black_hash, h, (uint32_t)pos)) {
+    str_db_seek(&s->blacklist, pos);
+    return 1;
+  }
+  return 0;
+}
+
+static int fs_blacklist_test(FS_Set *s, uint32_t h, const wchar_t *suffix) {
+  uint32_t probe = 0, pos;
+  while ((pos = hash_tab_next(&s->black_hash, h, &probe)) != kHashTabNone) {
+    const wchar_t *rule = str_db_get(&s->blacklist, pos);
+    if (FlStrCmpIW(suffix, rule) == 0)
+      return 1;
+  }
+  return 0;
 }
 
 int fs_blacklist_match(FS_Set *s, const wchar_t *path) {
-  size_t pos_it = 0;
-  const size_t len_path = ass_strlen(path);
-  const wchar_t *suffix;
-  while ((suffix = str_db_next(&s->blacklist, &pos_it)) != NULL) {
-    const size_t len_suffix = ass_strlen(suffix);
-    if (len_suffix > len_path) {
-      continue;
-    }
-    const wchar_t *path_sfx = path + len_path - len_suffix;
-    if (ass_strncasecmp(path_sfx, suffix, len_suffix) == 0) {
-      if (len_path == len_suffix || path_sfx[-1] == '\\') {
+  if (s->black_hash.n == 0)
+    return 0;
+
+  // walk backwards, test every suffix starting after a '\\'
+  uint32_t h = kStrHashInit;
+  for (size_t i = ass_strlen(path); i != 0; i--) {
+    h = fs_black_hash_step(h, path[i - 1]);
+    if (i == 1 || path[i - 2] == '\\') {
+      if (fs_blacklist_test(s, h, path + i - 1))
         return 1;
-      }
     }
   }
   return 0;
 }
+
+// flag fonts from ignored files, once for the index
+static int fs_blacklist_apply(FS_Set *s) {
+  allocator_t *alloc = s->alloc;
+  if (s->black_hash.n == 0 || s->font == NULL) {
+    alloc->alloc(s->hidden, 0, alloc->arg);
+    s->hidden = NULL;
+    return FL_OK;
+  }
+
+  uint8_t *hidden =
+      (uint8_t *)alloc->alloc(s->hidden, s->num_font + 1, alloc->arg);
+  if (hidden == NULL)
+    return FL_OUT_OF_MEMORY;
+  s->hidden = hidden;
+
+  // fonts of a file are adjacent
+  uint32_t last_tag = kFsNoStr;
+  uint8_t last_hidden = 0;
+  for (uint32_t i = 0; i != s->num_font; i++) {
+    const uint32_t tag = s->font[i].tag;
+    if (tag != last_tag) {
+      last_tag = tag;
+      last_hidden = (uint8_t)fs_blacklist_match(s, fs_pool_str(s, tag));
+    }
+    hidden[i] = last_hidden;
+  }
+  return FL_OK;
+}
@@ -19,40 +19,130 @@ typedef enum {
   FS_FmtMax   // number of formats
 } FS_Format;
 
+// name records of a font a face is found in
+typedef enum {
+  FS_NameFamily = 1,
+  FS_NameFull = 2,
+  FS_NamePostScript = 4
+} FS_NameKind;
+
 typedef struct {
   const wchar_t *tag;
   const wchar_t *face;
   const wchar_t *ver;
+  const wchar_t *full;  // full name of the font, or NULL
   FS_Format format;
+  uint32_t kind;  // FS_NameKind of the face, 0 if unknown
 } FS_Index;
 
+// identifies a file between scans, as found in the file system
+typedef struct {
+  uint32_t size_lo;
+  uint32_t size_hi;
+  uint32_t mtime_lo;  // last write time
+  uint32_t mtime_hi;
+  uint32_t id_lo;  // file index on the volume, 0 if unknown
+  uint32_t id_hi;
+  uint32_t volume;  // volume serial number
+} FS_FileMeta;
+
 typedef struct {
   // private:
   FS_Set *set;
-  uint32_t query_id;
-  uint32_t index_id;
+  uint32_t face_id;  // queried face, or a face prefixed by it
+  uint32_t span;     // end of faces prefixed by the query
+  uint32_t group_id;
+  uint32_t post_id;
+  uint32_t rank;  // format and version of the first match
   // public:
   FS_Index info;
 } FS_Iter;
 
+// scratch of fs_iter_fuzzy, one per thread, sized by the first lookup
+typedef struct {
+  allocator_t *alloc;
+  uint16_t *score;    // shared trigrams of each face, zero between lookups
+  uint32_t *touched;  // faces with a non-zero score
+  uint32_t num;
+} FS_FuzzyBuf;
+
 int fs_create(allocator_t *alloc, FS_Set **out);
 
 int fs_free(FS_Set *s);
 
 int fs_stat(FS_Set *s, FS_Stat *stat);
 
-int fs_add_font(FS_Set *s, const wchar_t *tag, void *buf, size_t size);
+int fs_add_font(
+    FS_Set *s,
+    const wchar_t *tag,
+    const FS_FileMeta *meta,
+    void *buf,
+    size_t size);
+
+// copy the record of an unchanged file from previous set, matched by tag, or
+// by file id if known. FL_UNRECOGNIZED if the file needs to be parsed.
+int fs_add_cached(
+    FS_Set *s,
+    FS_Set *prev,
+    const wchar_t *tag,
+    const FS_FileMeta *meta);
 
 int fs_build_index(FS_Set *s);
 
+// fonts of a face, preferred first by format, then by version. versions
+// FlVersionCmp treats as equal are told apart by spelling, e.g. "1.00" before
+// "1.0". fs_iter_next continues with the same format and version string, in
+// the face and the faces prefixed by it.
 int fs_iter_new(FS_Set *s, const wchar_t *face, FS_Iter *it);
 
 int fs_iter_next(FS_Iter *it);
 
+// after fs_iter_new, every font of the face itself, in any format and version,
+// preferred first. faces prefixed by it are not visited.
+int fs_iter_next_version(FS_Iter *it);
+
+// near-miss lookup, ignoring case, width, spaces, '-' and '_', and a few
+// typos. info.face of the iterator is the matched face. buf is the scratch of
+// the caller, zeroed before the first lookup.
+int fs_iter_fuzzy(
+    FS_Set *s,
+    const wchar_t *face,
+    FS_FuzzyBuf *buf,
+    FS_Iter *it);
+
+void fs_fuzzy_buf_free(FS_FuzzyBuf *buf);
+
+// the near-miss index is built by the first fs_iter_fuzzy, or up front if the
+// set is shared by threads. the set isn't written by lookups afterwards,
+// except for digests: the scratch of fs_iter_fuzzy is owned by each caller.
+int fs_build_fuzzy(FS_Set *s);
+
+// metadata of a file recorded by the scan, 0 if there's none. tag is returned
+// by the set.
+int fs_file_meta(FS_Set *s, const wchar_t *tag, FS_FileMeta *meta);
+
 int fs_cache_load(const wchar_t *path, allocator_t *alloc, FS_Set **out);
 
 int fs_cache_dump(FS_Set *s, const wchar_t *path);
 
+// content digest of a file, tag is FS_Index.tag. it's valid as long as size
+// and mtime in meta are unchanged, and saved with the cache.
+int fs_digest_get(
+    FS_Set *s,
+    const wchar_t *tag,
+    const FS_FileMeta *meta,
+    uint8_t hash[32]);
+
+int fs_digest_put(
+    FS_Set *s,
+    const wchar_t *tag,
+    const FS_FileMeta *meta,
+    const uint8_t hash[32]);
+
+// number of digests not saved yet
+uint32_t fs_digest_dirty(FS_Set *s);
+
+// blacklist should be ready before fs_build_index
 int fs_blacklist_clear(FS_Set *s);
 
 int fs_blacklist_add(FS_Set *s, const wchar_t *path, size_t cch);
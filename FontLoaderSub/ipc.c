@@ -0,0 +1,272 @@
+#include "ipc.h"
+
+#include "ass_string.h"
+
+#define kIpcTimeout 30000  // ms to wait for a busy resident process
+
+// ms for the UI to answer a request it has taken, i.e. to finish loading
+#define kIpcWorkTimeout (10 * 60 * 1000)
+
+enum { kIpcFailed = 0, kIpcOk = 1, kIpcStopped = 2 };
+
+int FlIpcInit(FL_Ipc *p, allocator_t *alloc) {
+  zmemset(p, 0, sizeof *p);
+  p->alloc = alloc;
+  p->pipe = INVALID_HANDLE_VALUE;
+  str_db_init(&p->pending, alloc, 0, 1);
+  InitializeCriticalSection(&p->lock);
+
+  p->evt_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+  p->evt_done = CreateEvent(NULL, FALSE, FALSE, NULL);
+  p->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+  if (!p->evt_stop || !p->evt_done || !p->ov.hEvent)
+    return FL_OS_ERROR;
+  return FL_OK;
+}
+
+int FlIpcFree(FL_Ipc *p) {
+  FlIpcStop(p);
+  CloseHandle(p->evt_stop);
+  CloseHandle(p->evt_done);
+  CloseHandle(p->ov.hEvent);
+  DeleteCriticalSection(&p->lock);
+  str_db_free(&p->pending);
+  return FL_OK;
+}
+
+static int FlIpcPushHex(str_db_t *s, uint32_t v) {
+  wchar_t hex[9];
+  for (int i = 7; i >= 0; i--, v >>= 4)
+    hex[i] = L"0123456789abcdef"[v & 15];
+  hex[8] = 0;
+  return str_db_push_u16_le(s, hex, 8) != NULL;
+}
+
+int FlIpcName(str_db_t *name, const wchar_t *key) {
+  DWORD session = 0;
+  ProcessIdToSessionId(GetCurrentProcessId(), &session);
+  const uint32_t h = str_hash(kStrHashInit, key, ass_strlen(key));
+
+  str_db_seek(name, 0);
+  if (!str_db_push_u16_le(name, L"\\\\.\\pipe\\FontLoaderSub-", 0) ||
+      !FlIpcPushHex(name, session) || !str_db_push_u16_le(name, L"-", 1) ||
+      !FlIpcPushHex(name, h))
+    return FL_OUT_OF_MEMORY;
+  return FL_OK;
+}
+
+// completes an overlapped call on the pipe
+static int FlIpcComplete(FL_Ipc *p, BOOL ok, DWORD *bytes) {
+  if (!ok) {
+    const DWORD err = GetLastError();
+    if (err == ERROR_PIPE_CONNECTED)
+      return kIpcOk;  // connected before ConnectNamedPipe
+    if (err != ERROR_IO_PENDING)
+      return kIpcFailed;
+  }
+  HANDLE evt[2] = {p->evt_stop, p->ov.hEvent};
+  if (WaitForMultipleObjects(2, evt, FALSE, INFINITE) != WAIT_OBJECT_0 + 1) {
+    CancelIo(p->pipe);
+    GetOverlappedResult(p->pipe, &p->ov, bytes, TRUE);
+    return kIpcStopped;
+  }
+  return GetOverlappedResult(p->pipe, &p->ov, bytes, FALSE) ? kIpcOk
+                                                            : kIpcFailed;
+}
+
+static uint32_t FlIpcPush(FL_Ipc *p, const wchar_t *buf, size_t cch) {
+  EnterCriticalSection(&p->lock);
+  size_t it = 0;
+  while (it != cch) {
+    // strings are null-terminated, the rest is dropped
+    size_t len = 0;
+    while (it + len != cch && buf[it + len] != 0)
+      len++;
+    if (it + len == cch)
+      break;
+    const size_t pos = str_db_tell(&p->pending);
+    const wchar_t *insert =
+        len ? str_db_push_u16_le(&p->pending, buf + it, len) : NULL;
+    if (insert == NULL) {
+      // empty or out of memory
+    } else if (str_db_str(&p->pending, 0, insert) != insert) {
+      str_db_seek(&p->pending, pos);
+    } else {
+      p->num_pending++;
+    }
+    it += len + 1;
+  }
+  const uint32_t seq = ++p->seq_pushed;
+  LeaveCriticalSection(&p->lock);
+  return seq;
+}
+
+// kIpcOk once the request is answered. kIpcFailed if the UI doesn't answer in
+// time, e.g. it's under a modal dialog: the paths not taken yet are withdrawn,
+// and the client loads them by itself.
+static int FlIpcWaitDone(FL_Ipc *p, uint32_t seq, FL_IpcReply *reply) {
+  HANDLE evt[2] = {p->evt_stop, p->evt_done};
+  const DWORD start = GetTickCount();
+  DWORD limit = kIpcTimeout;
+  while (1) {
+    const DWORD elapsed = GetTickCount() - start;
+    const DWORD wait = WaitForMultipleObjects(
+        2, evt, FALSE, elapsed < limit ? limit - elapsed : 0);
+    if (wait != WAIT_OBJECT_0 + 1 && wait != WAIT_TIMEOUT)
+      return kIpcStopped;
+
+    int r = -1;  // keep waiting
+    EnterCriticalSection(&p->lock);
+    // seq_done never wraps in practice
+    if (p->seq_done >= seq) {
+      *reply = p->reply;
+      r = kIpcOk;
+    } else if (wait != WAIT_TIMEOUT) {
+      // nop
+    } else if (p->seq_taken < seq) {
+      // requests are served one by one, the pending paths are all of this one
+      str_db_seek(&p->pending, 0);
+      p->num_pending = 0;
+      p->seq_taken = p->seq_pushed;
+      r = kIpcFailed;
+    } else if (limit == kIpcTimeout) {
+      // taken, the load is under way
+      limit = kIpcWorkTimeout;
+    } else {
+      r = kIpcFailed;
+    }
+    LeaveCriticalSection(&p->lock);
+    if (r != -1)
+      return r;
+  }
+}
+
+static DWORD WINAPI FlIpcWorker(LPVOID param) {
+  FL_Ipc *p = (FL_Ipc *)param;
+  int r = kIpcOk;
+  DWORD bytes;
+
+  while (r != kIpcStopped) {
+    r = FlIpcComplete(p, ConnectNamedPipe(p->pipe, &p->ov), &bytes);
+    if (r == kIpcOk)
+      r = FlIpcComplete(
+          p, ReadFile(p->pipe, p->buf, kIpcMaxRequest, NULL, &p->ov), &bytes);
+    if (r == kIpcOk) {
+      // FL_IpcReply reply = {.status = FL_OS_ERROR};
+      FL_IpcReply reply;
+      zmemset(&reply, 0, sizeof reply);
+      reply.status = FL_OS_ERROR;
+
+      const uint32_t seq = FlIpcPush(p, p->buf, bytes / sizeof p->buf[0]);
+      PostMessage(p->hwnd, p->msg, 0, 0);
+      // on timeout, the reply is FL_OS_ERROR
+      if (FlIpcWaitDone(p, seq, &reply) == kIpcStopped) {
+        r = kIpcStopped;
+        break;
+      }
+      r = FlIpcComplete(
+          p, WriteFile(p->pipe, &reply, sizeof reply, NULL, &p->ov), &bytes);
+      // wait for the client to read the reply and close its end
+      if (r == kIpcOk)
+        r = FlIpcComplete(
+            p, ReadFile(p->pipe, p->buf, 1, NULL, &p->ov), &bytes);
+    }
+    DisconnectNamedPipe(p->pipe);
+  }
+  return 0;
+}
+
+int FlIpcStart(FL_Ipc *p, const wchar_t *name, HWND hwnd, UINT msg) {
+  int r = FL_OK;
+  do {
+    p->buf = p->alloc->alloc(NULL, kIpcMaxRequest, p->alloc->arg);
+    if (p->buf == NULL) {
+      r = FL_OUT_OF_MEMORY;
+      break;
+    }
+    // a single instance: the first process owns the name
+    p->pipe = CreateNamedPipe(
+        name,
+        PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED |
+            FILE_FLAG_FIRST_PIPE_INSTANCE,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT |
+            PIPE_REJECT_REMOTE_CLIENTS,
+        1, sizeof(FL_IpcReply), kIpcMaxRequest, 0, NULL);
+    if (p->pipe == INVALID_HANDLE_VALUE) {
+      r = FL_OS_ERROR;
+      break;
+    }
+
+    p->hwnd = hwnd;
+    p->msg = msg;
+    ResetEvent(p->evt_stop);
+    DWORD thread_id;
+    p->thread = CreateThread(NULL, 0, FlIpcWorker, p, 0, &thread_id);
+    if (p->thread == NULL) {
+      r = FL_OS_ERROR;
+      break;
+    }
+  } while (0);
+
+  if (r != FL_OK)
+    FlIpcStop(p);
+  return r;
+}
+
+int FlIpcStop(FL_Ipc *p) {
+  if (p->thread) {
+    SetEvent(p->evt_stop);
+    WaitForSingleObject(p->thread, INFINITE);
+    CloseHandle(p->thread);
+    p->thread = NULL;
+  }
+  if (p->pipe != INVALID_HANDLE_VALUE) {
+    CloseHandle(p->pipe);
+    p->pipe = INVALID_HANDLE_VALUE;
+  }
+  p->alloc->alloc(p->buf, 0, p->alloc->arg);
+  p->buf = NULL;
+  return FL_OK;
+}
+
+uint32_t FlIpcTake(FL_Ipc *p, str_db_t *out) {
+  EnterCriticalSection(&p->lock);
+  const str_db_t taken = p->pending;
+  p->pending = *out;
+  *out = taken;
+  str_db_seek(&p->pending, 0);
+  const uint32_t n = p->num_pending;
+  p->num_pending = 0;
+  p->seq_taken = p->seq_pushed;
+  LeaveCriticalSection(&p->lock);
+  return n;
+}
+
+uint32_t FlIpcPending(FL_Ipc *p) {
+  EnterCriticalSection(&p->lock);
+  const uint32_t n = p->seq_pushed - p->seq_taken;
+  LeaveCriticalSection(&p->lock);
+  return n;
+}
+
+void FlIpcDone(FL_Ipc *p, const FL_IpcReply *reply) {
+  EnterCriticalSection(&p->lock);
+  p->reply = *reply;
+  p->seq_done = p->seq_taken;
+  LeaveCriticalSection(&p->lock);
+  SetEvent(p->evt_done);
+}
+
+int FlIpcForward(const wchar_t *name, str_db_t *paths, FL_IpcReply *reply) {
+  const DWORD size = (DWORD)(str_db_tell(paths) * sizeof(wchar_t));
+  if (size == 0 || size > kIpcMaxRequest)
+    return FL_UNRECOGNIZED;
+
+  // returns at once if no process is resident
+  DWORD bytes = 0;
+  if (!CallNamedPipe(
+          name, (void *)str_db_get(paths, 0), size, reply, sizeof *reply,
+          &bytes, kIpcTimeout))
+    return FL_OS_ERROR;
+  return bytes == sizeof *reply ? FL_OK : FL_OS_ERROR;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "util.h"
+#include "cstl.h"
+
+#define kIpcMaxRequest (128 * 1024)  // bytes, more than a command line
+
+typedef struct {
+  uint32_t status;
+  uint32_t num_font_loaded;
+  uint32_t num_font_failed;
+  uint32_t num_font_unmatched;
+} FL_IpcReply;
+
+// a resident process, serving the subtitle paths of later launches
+typedef struct {
+  allocator_t *alloc;
+  HWND hwnd;
+  UINT msg;
+  HANDLE thread;
+  HANDLE pipe;
+  OVERLAPPED ov;
+  HANDLE evt_stop;
+  HANDLE evt_done;
+  wchar_t *buf;  // kIpcMaxRequest, by the worker
+
+  CRITICAL_SECTION lock;
+  str_db_t pending;  // guarded by lock
+  uint32_t num_pending;
+  uint32_t seq_pushed;  // requests received
+  uint32_t seq_taken;   // requests taken by FlIpcTake
+  uint32_t seq_done;    // requests answered with reply
+  FL_IpcReply reply;
+} FL_Ipc;
+
+int FlIpcInit(FL_Ipc *p, allocator_t *alloc);
+
+int FlIpcFree(FL_Ipc *p);
+
+// the pipe name of a font library, per session
+int FlIpcName(str_db_t *name, const wchar_t *key);
+
+// FL_OS_ERROR if another process is resident
+int FlIpcStart(FL_Ipc *p, const wchar_t *name, HWND hwnd, UINT msg);
+
+int FlIpcStop(FL_Ipc *p);
+
+// swaps the pending paths into out, which is a str_db_t of pad_len 1
+uint32_t FlIpcTake(FL_Ipc *p, str_db_t *out);
+
+// requests not taken yet, even those without a new path
+uint32_t FlIpcPending(FL_Ipc *p);
+
+// answers the requests taken so far
+void FlIpcDone(FL_Ipc *p, const FL_IpcReply *reply);
+
+// client side, paths are absolute and in a str_db_t of pad_len 1. the status
+// of reply is FL_OS_ERROR if the resident process didn't take them in time.
+int FlIpcForward(const wchar_t *name, str_db_t *paths, FL_IpcReply *reply);
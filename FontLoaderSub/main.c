@@ -1,15 +1,18 @@
 #include "main.h"
 
 #include "ass_string.h"
+#include "cli.h"
 #include "exporter.h"
+#include "ipc.h"
 #include "util.h"
 #include "path.h"
 #include "shortcut.h"
+#include "watch.h"
 #include "mock_config.h"
 #include "res/resource.h"
 
-#define kCacheFile L"fc-subs.db"
-#define kBlackFile L"fc-ignore.txt"
+#define WM_APP_NEW_SUB (WM_APP + 1)
+#define WM_APP_CACHED (WM_APP + 2)  // wParam: bytes read again
 
 static void *mem_realloc(void *existing, size_t size, void *arg) {
   HANDLE heap = (HANDLE)arg;
@@ -44,6 +47,8 @@ static int AppBuildLog(FL_AppCtx *c) {
     FL_FontMatch *m = &data[i];
     if (m->flag & (FL_LOAD_DUP))
       tag = L"[^ ] ";
+    else if (m->flag & (FL_LOAD_FUZZY))
+      tag = L"[~ ] ";
     else if (m->flag & (FL_OS_LOADED | FL_LOAD_OK))
       tag = L"[ok] ";
     else if (m->flag & (FL_LOAD_ERR))
@@ -69,7 +74,7 @@ static int AppBuildLog(FL_AppCtx *c) {
   return 1;
 }
 
-static int AppUpdateStatus(FL_AppCtx *c) {
+static void AppFormatStatus(FL_AppCtx *c) {
   FS_Stat stat = {0};
   if (c->loader.font_set) {
     fs_stat(c->loader.font_set, &stat);
@@ -83,11 +88,16 @@ static int AppUpdateStatus(FL_AppCtx *c) {
       stat.num_file,
       stat.num_face,
       c->loader.num_sub,
+      c->loader.num_font_skipped,
   };
   FormatMessage(
       FORMAT_MESSAGE_FROM_STRING | FORMAT_MESSAGE_ARGUMENT_ARRAY,
       ResLoadString(c->hInst, IDS_LOAD_STAT), 0, 0, c->status_txt,
       _countof(c->status_txt), (va_list *)args);
+}
+
+static int AppUpdateStatus(FL_AppCtx *c) {
+  AppFormatStatus(c);
 
   LPARAM cap_id;
   if (c->cancelled || c->app_state == APP_CANCELLED) {
@@ -103,6 +113,43 @@ static int AppUpdateStatus(FL_AppCtx *c) {
   return 0;
 }
 
+static int AppLoadCache(FL_AppCtx *c) {
+  fl_scan_fonts(&c->loader, c->font_path, kCacheFile, kBlackFile);
+  FS_Stat stat = {0};
+  fs_stat(c->loader.font_set, &stat);
+  return stat.num_face != 0;
+}
+
+static void AppScanFont(FL_AppCtx *c) {
+  if (fl_scan_fonts(&c->loader, c->font_path, NULL, kBlackFile) == FL_OK) {
+    fl_save_cache(&c->loader, kCacheFile);
+  }
+}
+
+static int AppFontSetCallback(FL_LoaderCtx *loader, void *param) {
+  // same as APP_LOAD_CACHE and APP_SCAN_FONT, on demand of APP_LOAD_FONT or
+  // APP_WATCH_SUB. the states are shown meanwhile, the caller's is restored
+  FL_AppCtx *c = (FL_AppCtx *)param;
+  const FL_AppState state = c->app_state;
+  c->app_state = APP_LOAD_CACHE;
+  if (!AppLoadCache(c) && !c->cancelled) {
+    c->app_state = APP_SCAN_FONT;
+    AppScanFont(c);
+  }
+  c->app_state = state;
+  return c->cancelled ? FL_OS_ERROR : FL_OK;
+}
+
+static int AppAddSubs(FL_AppCtx *c, str_db_t *paths) {
+  int r = FL_OK;
+  size_t pos = 0;
+  const wchar_t *path;
+  while (r == FL_OK && (path = str_db_next(paths, &pos)) != NULL) {
+    r = fl_add_subs(&c->loader, path);
+  }
+  return r;
+}
+
 static DWORD WINAPI AppWorker(LPVOID param) {
   FL_AppCtx *c = (FL_AppCtx *)param;
   int r = FL_OK;
@@ -115,38 +162,62 @@ static DWORD WINAPI AppWorker(LPVOID param) {
       for (int i = 1; i < c->argc && r == FL_OK; i++) {
         r = fl_add_subs(&c->loader, c->argv[i]);
       }
-      c->app_state = APP_LOAD_CACHE;
+      // the index is loaded by AppFontSetCallback, only if needed
+      if (c->loader.num_sub_font) {
+        c->app_state = APP_LOAD_FONT;
+      } else {
+        c->app_state = APP_LOAD_CACHE;
+      }
       break;
     }
     case APP_LOAD_CACHE: {
-      fl_scan_fonts(&c->loader, c->font_path, kCacheFile, kBlackFile);
-      FS_Stat stat = {0};
-      fs_stat(c->loader.font_set, &stat);
-      if (stat.num_face == 0) {
-        c->app_state = APP_SCAN_FONT;
-      } else {
+      if (AppLoadCache(c)) {
         c->app_state = APP_LOAD_FONT;
+      } else {
+        c->app_state = APP_SCAN_FONT;
       }
       break;
     }
     case APP_SCAN_FONT: {
-      if (fl_scan_fonts(&c->loader, c->font_path, NULL, kBlackFile) == FL_OK) {
-        fl_save_cache(&c->loader, kCacheFile);
-      }
+      AppScanFont(c);
       c->app_state = APP_LOAD_FONT;
       break;
     }
     case APP_LOAD_FONT: {
       r = fl_load_fonts(&c->loader);
+      if (r == FL_OK) {
+        // keep digests of duplicates for the next run
+        if (fs_digest_dirty(c->loader.font_set))
+          fl_save_cache(&c->loader, kCacheFile);
+        c->app_state = APP_DONE;
+      }
+      break;
+    }
+    case APP_WATCH_SUB: {
+      // only the new subtitles and their faces, the rest is kept loaded
+      FlWatchTake(&c->watch, &c->watch_path);
+      r = AppAddSubs(c, &c->watch_path);
+      if (r == FL_OK) {
+        // from later launches
+        FlIpcTake(&c->ipc, &c->watch_path);
+        r = AppAddSubs(c, &c->watch_path);
+      }
       if (r == FL_OK)
+        r = fl_load_new_fonts(&c->loader);
+      if (r == FL_OK) {
+        if (fs_digest_dirty(c->loader.font_set))
+          fl_save_cache(&c->loader, kCacheFile);
         c->app_state = APP_DONE;
+      }
       break;
     }
     case APP_UNLOAD_FONT: {
-      fl_unload_fonts(&c->loader);
       if (c->req_exit) {
+        fl_unload_fonts(&c->loader);
         c->cancelled = 1;
       } else {
+        // on retry, only the changes are applied by APP_LOAD_FONT
+        fl_retain_fonts(&c->loader);
         c->app_state = APP_SCAN_FONT;
       }
       break;
@@ -169,12 +240,153 @@ static DWORD WINAPI AppCacheWorker(LPVOID param) {
 
   while (1) {
     fl_cache_fonts(&c->loader, c->evt_stop_cache);
+    if (WaitForSingleObject(c->evt_stop_cache, 0) != WAIT_TIMEOUT)
+      break;
+    PostMessage(
+        c->work_hwnd, WM_APP_CACHED, (WPARAM)c->loader.cache_bytes_read, 0);
     if (WaitForSingleObject(c->evt_stop_cache, 5 * 60 * 1000) != WAIT_TIMEOUT)
       break;
   }
   return 0;
 }
 
+static void AppStopCache(FL_AppCtx *c) {
+  // the thread owns the views of the fonts, it stops between pages
+  SetEvent(c->evt_stop_cache);
+  if (c->thread_cache) {
+    WaitForSingleObject(c->thread_cache, INFINITE);
+    CloseHandle(c->thread_cache);
+  }
+  c->thread_cache = NULL;
+}
+
+static void AppNewSubNotify(FL_AppCtx *c, HWND hWnd) {
+  // changes noticed or requests received while busy
+  if (FlWatchPending(&c->watch) || FlIpcPending(&c->ipc))
+    PostMessage(hWnd, WM_APP_NEW_SUB, 0, 0);
+}
+
+static LRESULT CALLBACK AppNewSubProc(
+    HWND hWnd,
+    UINT uMsg,
+    WPARAM wParam,
+    LPARAM lParam,
+    UINT_PTR uIdSubclass,
+    DWORD_PTR dwRefData) {
+  if (uMsg == WM_APP_NEW_SUB) {
+    FL_AppCtx *c = (FL_AppCtx *)dwRefData;
+    // only from the done page, not under a modal dialog or the menu.
+    // otherwise it's picked up by AppNewSubNotify
+    if (c->app_state == APP_DONE && c->thread_load == NULL &&
+        IsWindowEnabled(hWnd) && !c->menu_open) {
+      if (FlIpcPending(&c->ipc)) {
+        // show the result to the later launch
+        if (IsIconic(hWnd))
+          ShowWindow(hWnd, SW_RESTORE);
+        SetForegroundWindow(hWnd);
+      }
+      AppStopCache(c);
+      c->app_state = APP_WATCH_SUB;
+      SendMessage(hWnd, TDM_NAVIGATE_PAGE, 0, (LPARAM)&c->dlg_work);
+    }
+    return 0;
+  } else if (uMsg == WM_APP_CACHED) {
+    FL_AppCtx *c = (FL_AppCtx *)dwRefData;
+    // a pass of the cache of the done page, the stats are unchanged
+    if (c->app_state == APP_DONE && c->thread_cache != NULL) {
+      AppFormatStatus(c);
+      const size_t len = ass_strlen(c->status_txt);
+      DWORD_PTR args[] = {(DWORD)(wParam / 1024)};
+      FormatMessage(
+          FORMAT_MESSAGE_FROM_STRING | FORMAT_MESSAGE_ARGUMENT_ARRAY,
+          ResLoadString(c->hInst, IDS_CACHE_STAT), 0, 0, c->status_txt + len,
+          (DWORD)(_countof(c->status_txt) - len), (va_list *)args);
+      SendMessage(
+          hWnd, TDM_SET_ELEMENT_TEXT, TDE_CONTENT, (LPARAM)c->status_txt);
+    }
+    return 0;
+  } else if (uMsg == WM_NCDESTROY) {
+    RemoveWindowSubclass(hWnd, AppNewSubProc, uIdSubclass);
+  }
+  return DefSubclassProc(hWnd, uMsg, wParam, lParam);
+}
+
+static int AppWatchStart(FL_AppCtx *c, HWND hWnd) {
+  int r = FL_OK;
+  if (MOCK_SUB_PATH) {
+    r = FlWatchAdd(&c->watch, MOCK_SUB_PATH);
+  }
+  for (int i = 1; i < c->argc && r == FL_OK; i++) {
+    r = FlWatchAdd(&c->watch, c->argv[i]);
+  }
+  if (r == FL_OK)
+    r = FlWatchStart(&c->watch, hWnd, WM_APP_NEW_SUB);
+  if (r != FL_OK) {
+    FlWatchStop(&c->watch);
+    return 0;
+  }
+  SetWindowSubclass(hWnd, AppNewSubProc, 0, (DWORD_PTR)c);
+  return 1;
+}
+
+static int AppResidentStart(FL_AppCtx *c, HWND hWnd) {
+  const wchar_t *name = str_db_get(&c->pipe_name, 0);
+  if (FlIpcStart(&c->ipc, name, hWnd, WM_APP_NEW_SUB) != FL_OK)
+    return 0;
+  SetWindowSubclass(hWnd, AppNewSubProc, 0, (DWORD_PTR)c);
+  return 1;
+}
+
+static int AppForward(FL_AppCtx *c, FL_IpcReply *reply) {
+  // resolved here, the resident process has another working directory
+  int r = FL_OK;
+  str_db_t paths, path;
+  str_db_init(&paths, c->alloc, 0, 1);
+  str_db_init(&path, c->alloc, 0, 0);
+  for (int i = 1; i < c->argc && r == FL_OK; i++) {
+    str_db_seek(&path, 0);
+    if (FlResolvePath(c->argv[i], &path) != FL_OK)
+      continue;
+    if (!str_db_push_u16_le(&paths, str_db_get(&path, 0), 0))
+      r = FL_OUT_OF_MEMORY;
+  }
+  if (r == FL_OK) {
+    // the resident window may come to the front
+    AllowSetForegroundWindow(ASFW_ANY);
+    r = FlIpcForward(str_db_get(&c->pipe_name, 0), &paths, reply);
+  }
+  str_db_free(&paths);
+  str_db_free(&path);
+  return r;
+}
+
+static void AppReplyLaunches(FL_AppCtx *c) {
+  // FL_IpcReply reply = {.status = FL_OK, ...};
+  FL_IpcReply reply;
+  reply.status = FL_OK;
+  reply.num_font_loaded = c->loader.num_font_loaded;
+  reply.num_font_failed = c->loader.num_font_failed;
+  reply.num_font_unmatched = c->loader.num_font_unmatched;
+  FlIpcDone(&c->ipc, &reply);
+}
+
+static LRESULT CALLBACK AppFontChangeProc(
+    HWND hWnd,
+    UINT uMsg,
+    WPARAM wParam,
+    LPARAM lParam,
+    UINT_PTR uIdSubclass,
+    DWORD_PTR dwRefData) {
+  if (uMsg == WM_FONTCHANGE) {
+    // installed fonts changed, enumerate again on next load
+    FL_AppCtx *c = (FL_AppCtx *)dwRefData;
+    fl_sys_font_invalidate(&c->loader);
+  } else if (uMsg == WM_NCDESTROY) {
+    RemoveWindowSubclass(hWnd, AppFontChangeProc, uIdSubclass);
+  }
+  return DefSubclassProc(hWnd, uMsg, wParam, lParam);
+}
+
 static HRESULT CALLBACK DlgWorkProc(
     HWND hWnd,
     UINT uNotification,
@@ -186,6 +398,7 @@ static HRESULT CALLBACK DlgWorkProc(
   if (uNotification == TDN_CREATED || uNotification == TDN_NAVIGATED) {
     c->work_hwnd = hWnd;
     SendMessage(hWnd, TDM_SET_PROGRESS_BAR_MARQUEE, TRUE, 0);
+    SetWindowSubclass(hWnd, AppFontChangeProc, 0, (DWORD_PTR)c);
 
     DWORD thread_id;
     c->thread_load = CreateThread(NULL, 0, AppWorker, c, 0, &thread_id);
@@ -226,7 +439,9 @@ static HRESULT CALLBACK DlgWorkProc(
           }
           AppUpdateStatus(c);
           c->dlg_done.pszContent = c->status_txt;
-          PostMessage(HWND_BROADCAST, WM_FONTCHANGE, 0, 0);
+          if (c->loader.num_font_changed)
+            PostMessage(HWND_BROADCAST, WM_FONTCHANGE, 0, 0);
+          AppReplyLaunches(c);
           SendMessage(hWnd, TDM_NAVIGATE_PAGE, 0, (LPARAM)&c->dlg_done);
           navigated = 1;
         } else {
@@ -285,12 +500,7 @@ static HRESULT CALLBACK DlgDoneButtonDispatch(
     if (wParam != ID_BTN_RESCAN) {
       c->req_exit = 1;
     }
-    SetEvent(c->evt_stop_cache);
-    if (WaitForSingleObject(c->thread_cache, 1000) != WAIT_OBJECT_0) {
-      TerminateThread(c->thread_cache, 2);
-    }
-    CloseHandle(c->thread_cache);
-    c->thread_cache = NULL;
+    AppStopCache(c);
     c->app_state = APP_UNLOAD_FONT;
     SendMessage(hWnd, TDM_NAVIGATE_PAGE, 0, (LPARAM)&c->dlg_work);
     return S_FALSE;
@@ -310,19 +520,49 @@ static HRESULT CALLBACK DlgDoneButtonDispatch(
     } else {
       GetCursorPos(&pt);
     }
+    c->menu_open = 1;
     BOOL r = TrackPopupMenu(
         menu, TPM_NONOTIFY | TPM_RETURNCMD, pt.x, pt.y, 0, hWnd, NULL);
+    c->menu_open = 0;
+    HRESULT hr = S_FALSE;
     if (r != FALSE) {
-      return DlgDoneButtonDispatch(hWnd, uNotification, r, lParam, c);
+      hr = DlgDoneButtonDispatch(hWnd, uNotification, r, lParam, c);
     }
-    return S_FALSE;
+    AppNewSubNotify(c, hWnd);
+    return hr;
   }
   case ID_BTN_EXPORT: {
     ExportLoadedFonts(hWnd, c);
+    AppNewSubNotify(c, hWnd);
+    return S_FALSE;
+  }
+  case ID_BTN_WATCH: {
+    if (c->watching) {
+      FlWatchStop(&c->watch);
+      c->watching = 0;
+    } else {
+      c->watching = AppWatchStart(c, hWnd);
+    }
+    CheckMenuItem(
+        c->btn_menu, ID_BTN_WATCH,
+        MF_BYCOMMAND | (c->watching ? MF_CHECKED : MF_UNCHECKED));
+    return S_FALSE;
+  }
+  case ID_BTN_RESIDENT: {
+    if (c->resident) {
+      FlIpcStop(&c->ipc);
+      c->resident = 0;
+    } else {
+      c->resident = AppResidentStart(c, hWnd);
+    }
+    CheckMenuItem(
+        c->btn_menu, ID_BTN_RESIDENT,
+        MF_BYCOMMAND | (c->resident ? MF_CHECKED : MF_UNCHECKED));
     return S_FALSE;
   }
   case ID_BTN_HELP: {
     AppHelpUsage(c, hWnd);
+    AppNewSubNotify(c, hWnd);
     return S_FALSE;
   }
   default: { return S_FALSE; }
@@ -358,7 +598,9 @@ static HRESULT CALLBACK DlgDoneProc(
 
     FS_Stat stat = {0};
     fs_stat(c->loader.font_set, &stat);
-    if (c->loader.num_sub_font == 0 || stat.num_face == 0) {
+    // no font set if every face is installed
+    if (c->loader.num_sub_font == 0 ||
+        (c->loader.font_set && stat.num_face == 0)) {
       EnableMenuItem(c->btn_menu, ID_BTN_EXPORT, MF_BYCOMMAND | MF_GRAYED);
       AppHelpUsage(c, hWnd);
     } else {
@@ -368,6 +610,13 @@ static HRESULT CALLBACK DlgDoneProc(
       c->thread_cache = CreateThread(NULL, 0, AppCacheWorker, c, 0, &thread_id);
     }
 
+    // nothing to watch without subtitle paths
+    const int has_path = c->argc > 1 || MOCK_SUB_PATH;
+    EnableMenuItem(
+        c->btn_menu, ID_BTN_WATCH,
+        MF_BYCOMMAND | (has_path ? MF_ENABLED : MF_GRAYED));
+    AppNewSubNotify(c, hWnd);
+
     // find the "Menu" button
     c->handle_btn_menu = NULL;
     EnumChildWindows(hWnd, DlgDoneFindMenuBtnCb, (LPARAM)c);
@@ -473,6 +722,8 @@ static int AppInit(FL_AppCtx *c, HINSTANCE hInst, allocator_t *alloc) {
   c->app_state = APP_LOAD_SUB;
   if (fl_init(&c->loader, c->alloc) != FL_OK)
     return 0;
+  c->loader.font_set_cb = AppFontSetCallback;
+  c->loader.font_set_param = c;
   str_db_init(&c->log, c->alloc, 0, 0);
   c->font_path = str_db_get(&c->full_exe_path, 0);
 
@@ -482,6 +733,15 @@ static int AppInit(FL_AppCtx *c, HINSTANCE hInst, allocator_t *alloc) {
   c->evt_stop_cache = CreateEvent(NULL, TRUE, FALSE, NULL);
   if (c->evt_stop_cache == NULL)
     return 0;
+  if (FlWatchInit(&c->watch, c->alloc) != FL_OK)
+    return 0;
+  str_db_init(&c->watch_path, c->alloc, 0, 1);
+  if (FlIpcInit(&c->ipc, c->alloc) != FL_OK)
+    return 0;
+  // one resident process per font library
+  str_db_init(&c->pipe_name, c->alloc, 0, 0);
+  if (FlIpcName(&c->pipe_name, c->font_path) != FL_OK)
+    return 0;
 
   if (SUCCEEDED(CoCreateInstance(
           &CLSID_TaskbarList, NULL, CLSCTX_INPROC_SERVER, &IID_ITaskbarList3,
@@ -501,9 +761,17 @@ static int AppRun(FL_AppCtx *c) {
     return 0;
   }
 
+  // forward to the resident process, if any. FL_OS_ERROR if it's not served
+  FL_IpcReply reply;
+  if (c->argc > 1 && AppForward(c, &reply) == FL_OK &&
+      reply.status != FL_OS_ERROR)
+    return reply.status;
+
   TaskDialogIndirect(&c->dlg_work, NULL, NULL, NULL);
 
   // clean up
+  FlIpcStop(&c->ipc);
+  FlWatchStop(&c->watch);
   if (WaitForSingleObject(c->thread_load, 16384) == WAIT_TIMEOUT) {
     TerminateThread(c->thread_load, 1);
     fl_unload_fonts(&c->loader);
@@ -521,13 +789,21 @@ int WINAPI _tWinMain(
     HINSTANCE hPrevInstance,
     LPTSTR lpCmdLine,
     int nCmdShow) {
+  HANDLE heap = HeapCreate(0, 0, 0);
+  allocator_t alloc = {.alloc = mem_realloc, .arg = heap};
+
+  // headless, before any window
+  int argc;
+  wchar_t **argv = CommandLineToArgvW(GetCommandLine(), &argc);
+  if (argv && argc > 1 && CliIsCheck(argv[1]))
+    return CliMain(argc, argv, &alloc);
+  LocalFree(argv);
+
   PerMonitorDpiHack();
   if (CoInitializeEx(NULL, COINIT_APARTMENTTHREADED) != S_OK) {
     return 0;
   }
 
-  HANDLE heap = HeapCreate(0, 0, 0);
-  allocator_t alloc = {.alloc = mem_realloc, .arg = heap};
   FL_AppCtx *ctx = &g_app;
   if (ctx == NULL || !AppInit(ctx, hInstance, &alloc)) {
     TaskDialog(
@@ -535,9 +811,7 @@ int WINAPI _tWinMain(
         TDCBF_CLOSE_BUTTON, TD_ERROR_ICON, NULL);
     return 1;
   }
-  AppRun(ctx);
-
-  return 0;
+  return AppRun(ctx);
 }
 
 extern IMAGE_DOS_HEADER __ImageBase;
@@ -7,7 +7,12 @@
 
 #include "res/resource.h"
 #include "font_loader.h"
+#include "ipc.h"
 #include "shortcut.h"
+#include "watch.h"
+
+#define kCacheFile L"fc-subs.db"
+#define kBlackFile L"fc-ignore.txt"
 
 typedef enum {
   APP_LOAD_SUB = IDS_WORK_SUBTITLE,
@@ -15,6 +20,7 @@ typedef enum {
   APP_SCAN_FONT = IDS_WORK_FONT,
   APP_LOAD_FONT = IDS_WORK_LOAD,
   APP_UNLOAD_FONT = IDS_WORK_UNLOAD,
+  APP_WATCH_SUB = IDS_WORK_WATCH,
   APP_DONE = IDS_WORK_DONE,
   APP_CANCELLED
 } FL_AppState;
@@ -40,12 +46,19 @@ typedef struct {
   HANDLE thread_load;
   HANDLE thread_cache;
   HANDLE evt_stop_cache;
+  FL_Watch watch;
+  int watching;
+  str_db_t watch_path;  // taken from watch by APP_WATCH_SUB
+  FL_Ipc ipc;
+  int resident;
+  str_db_t pipe_name;
 
   TASKDIALOGCONFIG dlg_work;
   TASKDIALOGCONFIG dlg_done;
   TASKDIALOGCONFIG dlg_help;
   HMENU btn_menu;        // handle to the menu
   HWND handle_btn_menu;  // handle to the button
+  int menu_open;         // the owner is left enabled by TrackPopupMenu
   int show_shortcut;
   FL_ShortCtx shortcut;
   ITaskbarList3 *taskbar_list3;
@@ -26,12 +26,16 @@
 #define IDS_SHORTCUT_ADD_SENDTO 38
 #define IDS_SHORTCUT_DEL_SENDTO 40
 #define IDS_MENU 42
+#define IDS_WORK_WATCH 44
+#define IDS_CACHE_STAT 46
 
 // control id
 #define ID_BTN_MENU 101
 #define ID_BTN_RESCAN 102
 #define ID_BTN_EXPORT 103
 #define ID_BTN_HELP 104
+#define ID_BTN_WATCH 105
+#define ID_BTN_RESIDENT 106
 
 // menu
 #define IDR_BTN_MENU 1
@@ -1,6 +1,5 @@
 #include "shortcut.h"
 
-#include <Shlwapi.h>
 #include <ShlObj.h>
 #include <ObjIdl.h>
 
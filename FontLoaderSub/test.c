@@ -1,12 +1,169 @@
 #include "ass_parser.h"
 
+// the cap of a line in font_loader.c (kSubMaxLine)
+#define kTestMaxLine (32768)
+#define kTestScript (kTestMaxLine + 4096)
+#define kTestFonts (1024)
+
 static int null_cb(const wchar_t *font, size_t cch, void *arg) {
   return 0;
 }
 
+// the faces reported by a parse, separated by '|'
+typedef struct {
+  wchar_t buf[kTestFonts];
+  size_t len;
+} TestFonts;
+
+static int test_font_cb(const wchar_t *font, size_t cch, void *arg) {
+  TestFonts *f = arg;
+  for (size_t i = 0; i != cch && f->len + 1 < kTestFonts; i++)
+    f->buf[f->len++] = font[i];
+  if (f->len + 1 < kTestFonts)
+    f->buf[f->len++] = '|';
+  return 0;
+}
+
+static int test_font_cb_u8(const char *font, size_t cch, void *arg) {
+  TestFonts *f = arg;
+  // the faces of the script are in ASCII
+  for (size_t i = 0; i != cch && f->len + 1 < kTestFonts; i++)
+    f->buf[f->len++] = (unsigned char)font[i];
+  if (f->len + 1 < kTestFonts)
+    f->buf[f->len++] = '|';
+  return 0;
+}
+
+static int test_fonts_eq(const TestFonts *f, const wchar_t *expect) {
+  size_t i = 0;
+  for (; i != f->len; i++) {
+    if (f->buf[i] != expect[i])
+      return 0;
+  }
+  return expect[i] == 0;
+}
+
+static char test_script[kTestScript];
+static size_t test_script_len;
+static wchar_t test_script_w[kTestScript];
+static char test_buf_u8[kTestMaxLine + 1];
+static wchar_t test_buf[kTestMaxLine + 1];
+
+static void test_append(const char *s) {
+  while (*s && test_script_len != kTestScript)
+    test_script[test_script_len++] = *s++;
+}
+
+static void test_append_pad(size_t until) {
+  while (test_script_len < until && test_script_len != kTestScript)
+    test_script[test_script_len++] = 'x';
+}
+
+// CRLF line ends, a Dialogue line longer than kTestMaxLine with blocks before,
+// across and after the cut, and a last line without a line end
+static void test_build_script() {
+  test_script_len = 0;
+  test_append(
+      "[Script Info]\r\n"
+      "ScriptType: v4.00+\r\n"
+      "\r\n"
+      "[V4+ Styles]\r\n"
+      "Format: Name, Fontname, Fontsize\r\n"
+      "Style: Default,Default Font,20\r\n"
+      "\r\n"
+      "[Events]\r\n"
+      "Format: Layer, Start, End, Style, Name, MarginL, MarginR, MarginV, "
+      "Effect, Text\r\n"
+      "Dialogue: 0,0:00:00.00,0:00:01.00,Default,,0,0,0,,"
+      "{\\fnSplit Font}text\r\n");
+  const size_t line = test_script_len;
+  test_append(
+      "Dialogue: 0,0:00:01.00,0:00:02.00,Default,,0,0,0,,"
+      "{\\fnBefore}");
+  test_append_pad(line + kTestMaxLine - 5);
+  test_append("{\\fnAcross Cut}");
+  test_append_pad(line + kTestMaxLine + 1000);
+  test_append("{\\be1\\fnAfter Cut}text\r\n");
+  test_append(
+      "Dialogue: 0,0:00:02.00,0:00:03.00,Default,,0,0,0,,"
+      "{\\fn No Newline}text");
+  for (size_t i = 0; i != test_script_len; i++)
+    test_script_w[i] = (unsigned char)test_script[i];
+}
+
+static const wchar_t kTestExpect[] =
+    L"Default Font|Split Font|Before|Across Cut|After Cut|No Newline|";
+
+// feeds the script in chunks of step chars, the first one is of first chars
+static int test_feed(size_t first, size_t step) {
+  TestFonts fonts = {0};
+  ASS_Parser parser;
+  ass_parser_begin(&parser, test_buf, kTestMaxLine, test_font_cb, &fonts);
+  for (size_t pos = 0, n = first; pos != test_script_len; n = step) {
+    if (n > test_script_len - pos)
+      n = test_script_len - pos;
+    ass_parser_feed(&parser, test_script_w + pos, n);
+    pos += n;
+  }
+  ass_parser_end(&parser);
+  return test_fonts_eq(&fonts, kTestExpect);
+}
+
+static int test_feed_u8(size_t first, size_t step) {
+  TestFonts fonts = {0};
+  ASS_ParserU8 parser;
+  ass_parser_begin_u8(
+      &parser, test_buf_u8, kTestMaxLine, test_font_cb_u8, &fonts);
+  for (size_t pos = 0, n = first; pos != test_script_len; n = step) {
+    if (n > test_script_len - pos)
+      n = test_script_len - pos;
+    ass_parser_feed_u8(&parser, test_script + pos, n);
+    pos += n;
+  }
+  ass_parser_end_u8(&parser);
+  return test_fonts_eq(&fonts, kTestExpect);
+}
+
+// offset of the first s in the script
+static size_t test_find(const char *s) {
+  for (size_t i = 0; i != test_script_len; i++) {
+    size_t j = 0;
+    while (s[j] && i + j != test_script_len && test_script[i + j] == s[j])
+      j++;
+    if (s[j] == 0)
+      return i;
+  }
+  return 0;
+}
+
+// the same faces, whether the script is fed at once or in chunks
+static int test_parser_chunks() {
+  test_build_script();
+  const size_t crlf = test_find("\r\n") + 1;
+  const size_t block = test_find("{\\fnSplit") + 3;
+  const size_t whole = test_script_len;
+  // first chunk, then the size of the rest
+  const size_t feeds[][2] = {
+      {whole, whole},  // at once
+      {1, 1},
+      {3, 7},
+      {4093, 4093},
+      {crlf, 4096},   // CRLF split across chunks
+      {block, 4096},  // {\fn split at a boundary
+      {block, 2},
+  };
+  for (size_t i = 0; i != sizeof feeds / sizeof feeds[0]; i++) {
+    if (!test_feed(feeds[i][0], feeds[i][1]) ||
+        !test_feed_u8(feeds[i][0], feeds[i][1]))
+      return 0;
+  }
+  return 1;
+}
+
+// 1 if the tests pass
 int test_main() {
   const char data[] = {0x5b, 0x00};
   const wchar_t *wc = (const wchar_t *)data;
   ass_process_data(wc, sizeof data / 2, null_cb, NULL);
-  return 1;
+  return test_parser_chunks();
 }
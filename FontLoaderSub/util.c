@@ -1,8 +1,13 @@
 #include "util.h"
 #include <Windows.h>
-#include <Shlwapi.h>
+#include <psapi.h>
 #include <intrin.h>
 
+#if defined(_M_X64) || defined(_M_IX86_FP) && _M_IX86_FP >= 2
+#include <emmintrin.h>
+#define FL_SSE2
+#endif
+
 #pragma intrinsic(__movsb)
 #pragma intrinsic(__stosb)
 
@@ -44,127 +49,288 @@ int FlMemUnmap(memmap_t *mmap) {
   return 0;
 }
 
-static int FlTestUtf8(const uint8_t *buffer, size_t size) {
-  const uint8_t *p, *last;
-  int rem = 0;
-  for (p = buffer, last = buffer + size; p != last; p++) {
-    if (rem) {
-      if ((*p & 0xc0) == 0x80) {
-        // 10xxxxxx
-        --rem;
-      } else {
-        return 0;
-      }
-    } else if ((*p & 0x80) == 0) {
-      // rem = 0;
-    } else if ((*p & 0xe0) == 0xc0) {
-      // 110xxxxx
-      rem = 1;
-    } else if ((*p & 0xf0) == 0xe0) {
-      // 1110xxxx
-      rem = 2;
-    } else if ((*p & 0xf8) == 0xf0) {
-      // 11110xxx
-      rem = 3;
-    } else {
-      return 0;
+#define kFlPageSize (4096)
+#define kFlWarmBatch (256)  // pages per query
+
+typedef BOOL(WINAPI *PFN_QueryWorkingSetEx)(HANDLE, PVOID, DWORD);
+typedef BOOL(WINAPI *PFN_PrefetchVirtualMemory)(
+    HANDLE, ULONG_PTR, PWIN32_MEMORY_RANGE_ENTRY, ULONG);
+
+size_t FlMemWarm(const memmap_t *mmap, HANDLE evt_cancel) {
+  // resolved once, both are optional: K32QueryWorkingSetEx is on Win7+,
+  // PrefetchVirtualMemory on Win8+
+  static volatile LONG init;
+  static PFN_QueryWorkingSetEx pQueryWorkingSetEx;
+  static PFN_PrefetchVirtualMemory pPrefetchVirtualMemory;
+  if (!init) {
+    HMODULE kernel32 = GetModuleHandle(L"KERNEL32");
+    if (kernel32) {
+      pQueryWorkingSetEx = (PFN_QueryWorkingSetEx)GetProcAddress(
+          kernel32, "K32QueryWorkingSetEx");
+      pPrefetchVirtualMemory = (PFN_PrefetchVirtualMemory)GetProcAddress(
+          kernel32, "PrefetchVirtualMemory");
     }
+    InterlockedExchange(&init, 1);
   }
-  return rem == 0;
-}
 
-static wchar_t *FlTextTryDecode(
-    UINT codepage,
-    const uint8_t *mstr,
-    size_t bytes,
-    size_t *cch,
-    allocator_t *alloc) {
-  wchar_t *buf = NULL;
-  int ok = 0;
-  do {
-    const int r =
-        MultiByteToWideChar(codepage, 0, (const char *)mstr, bytes, NULL, 0);
-    *cch = r;
-    if (r == 0)
+  PSAPI_WORKING_SET_EX_INFORMATION info[kFlWarmBatch];
+  WIN32_MEMORY_RANGE_ENTRY range[kFlWarmBatch];
+  HANDLE proc = GetCurrentProcess();
+  volatile const char *bytes = mmap->data;
+  const size_t num_page = (mmap->size + kFlPageSize - 1) / kFlPageSize;
+  size_t num_read = 0;
+  for (size_t first = 0; first < num_page; first += kFlWarmBatch) {
+    if (WaitForSingleObject(evt_cancel, 0) != WAIT_TIMEOUT)
       break;
 
-    buf = (wchar_t *)alloc->alloc(buf, (r + 1) * sizeof buf[0], alloc->arg);
-    if (buf == NULL)
-      break;
+    const size_t n =
+        num_page - first < kFlWarmBatch ? num_page - first : kFlWarmBatch;
+    for (size_t i = 0; i != n; i++) {
+      info[i].VirtualAddress = (PVOID)(bytes + (first + i) * kFlPageSize);
+      info[i].VirtualAttributes.Flags = 0;
+    }
+    if (pQueryWorkingSetEx == NULL ||
+        !pQueryWorkingSetEx(proc, info, (DWORD)(n * sizeof info[0]))) {
+      // unknown, as if none is resident
+      for (size_t i = 0; i != n; i++)
+        info[i].VirtualAttributes.Flags = 0;
+    }
 
-    const int new_r =
-        MultiByteToWideChar(codepage, 0, (const char *)mstr, bytes, buf, r);
-    if (new_r == 0 || new_r != r)
-      break;
-    buf[r] = 0;
-    ok = 1;
-  } while (0);
+    // missing pages, merged into ranges
+    ULONG num_range = 0;
+    for (size_t i = 0; i != n; i++) {
+      if (info[i].VirtualAttributes.Valid)
+        continue;
+      if (num_range != 0 &&
+          (const char *)range[num_range - 1].VirtualAddress +
+                  range[num_range - 1].NumberOfBytes ==
+              info[i].VirtualAddress) {
+        range[num_range - 1].NumberOfBytes += kFlPageSize;
+      } else {
+        range[num_range].VirtualAddress = info[i].VirtualAddress;
+        range[num_range].NumberOfBytes = kFlPageSize;
+        num_range++;
+      }
+    }
+    if (num_range == 0)
+      continue;
+    if (pPrefetchVirtualMemory) {
+      // the last page is partial, but it's still one page of the view
+      pPrefetchVirtualMemory(proc, num_range, range, 0);
+    }
 
-  if (!ok) {
-    alloc->alloc(buf, 0, alloc->arg);
-    buf = NULL;
+    // prefetched pages are in memory, not in the working set yet
+    volatile char chksum = 0;
+    for (ULONG r = 0; r != num_range; r++) {
+      volatile const char *p = range[r].VirtualAddress;
+      const size_t rem = mmap->size - (size_t)(p - bytes);
+      const size_t len = range[r].NumberOfBytes;
+      for (size_t pos = 0; pos < len; pos += kFlPageSize)
+        chksum ^= p[pos];
+      num_read += len < rem ? len : rem;
+    }
   }
-  return buf;
+  return num_read;
 }
 
-static wchar_t *FlTextDecodeUtf16(
-    int big_endian,
-    const uint8_t *mstr,
-    size_t bytes,
-    size_t *cch,
-    allocator_t *alloc) {
-  const wchar_t *wstr = (const wchar_t*)mstr;
-  wchar_t *buf = NULL;
-  int ok = 0;
+// trail bytes of a UTF-8 lead byte, -1 if it's not one
+static int FlUtf8Trail(uint8_t lead) {
+  if ((lead & 0x80) == 0)
+    return 0;  // 0xxxxxxx
+  if ((lead & 0xe0) == 0xc0)
+    return 1;  // 110xxxxx
+  if ((lead & 0xf0) == 0xe0)
+    return 2;  // 1110xxxx
+  if ((lead & 0xf8) == 0xf0)
+    return 3;  // 11110xxx
+  return -1;
+}
 
-  do {
-    const size_t r = *cch = bytes / 2;
-    buf = (wchar_t *)alloc->alloc(buf, (r + 1) * sizeof buf[0], alloc->arg);
-    if (buf == NULL)
-      break;
+// bytes of the valid prefix, checked by the structure of sequences only
+static size_t FlUtf8Check(const uint8_t *buf, size_t size) {
+  const uint8_t *p = buf;
+  const uint8_t *last = buf + size;
+  while (p != last) {
+#ifdef FL_SSE2
+    // ASCII, 32 bytes at a time
+    for (; last - p >= 32; p += 32) {
+      const __m128i v0 = _mm_loadu_si128((const __m128i *)p);
+      const __m128i v1 = _mm_loadu_si128((const __m128i *)(p + 16));
+      if (_mm_movemask_epi8(_mm_or_si128(v0, v1)))
+        break;
+    }
+#endif
+    // a char at a time, for a block at least
+    const uint8_t *stop = last - p > 32 ? p + 32 : last;
+    while (p < stop) {
+      const int rem = FlUtf8Trail(*p);
+      if (rem < 0 || last - p <= rem)
+        return p - buf;
+      for (int i = 1; i <= rem; i++) {
+        if ((p[i] & 0xc0) != 0x80)
+          return p - buf;
+      }
+      p += rem + 1;
+    }
+  }
+  return size;
+}
 
-    for (size_t i = 0; i != r; i++) {
-      buf[i] = big_endian ? be16(wstr[i]) : wstr[i];
+// decodes n bytes to out, which has room for n chars. an invalid byte becomes
+// U+FFFD, as by MultiByteToWideChar.
+static size_t FlUtf8Decode(const uint8_t *s, size_t n, wchar_t *out) {
+  static const uint32_t kMinChar[] = {0, 0x80, 0x800, 0x10000};
+  const uint8_t *last = s + n;
+  wchar_t *o = out;
+  while (s != last) {
+#ifdef FL_SSE2
+    // ASCII is widened 16 bytes at a time
+    const __m128i zero = _mm_setzero_si128();
+    for (; last - s >= 16; s += 16, o += 16) {
+      const __m128i v = _mm_loadu_si128((const __m128i *)s);
+      if (_mm_movemask_epi8(v))
+        break;
+      _mm_storeu_si128((__m128i *)o, _mm_unpacklo_epi8(v, zero));
+      _mm_storeu_si128((__m128i *)(o + 8), _mm_unpackhi_epi8(v, zero));
     }
-    buf[r] = 0;
-    ok = 1;
-  } while (0);
+#endif
+    const uint8_t *stop = last - s > 16 ? s + 16 : last;
+    while (s < stop) {
+      const int rem = FlUtf8Trail(*s);
+      uint32_t ch = *s & (0x7f >> (rem > 0 ? rem + 1 : 0));
+      int ok = rem >= 0 && last - s > rem;
+      for (int i = 1; ok && i <= rem; i++) {
+        ok = (s[i] & 0xc0) == 0x80;
+        ch = ch << 6 | (s[i] & 0x3f);
+      }
+      // no overlong form, surrogate or char out of range
+      if (!ok || ch < kMinChar[rem] || ch > 0x10ffff ||
+          (ch & 0xfffff800) == 0xd800) {
+        *o++ = 0xfffd;
+        s++;
+        continue;
+      }
+      s += rem + 1;
+      if (ch >= 0x10000) {
+        ch -= 0x10000;
+        *o++ = (wchar_t)(0xd800 | ch >> 10);
+        *o++ = (wchar_t)(0xdc00 | (ch & 0x3ff));
+      } else {
+        *o++ = (wchar_t)ch;
+      }
+    }
+  }
+  return o - out;
+}
 
-  if (!ok) {
-    alloc->alloc(buf, 0, alloc->arg);
-    buf = NULL;
+// n units of UTF-16BE to out
+static void FlUtf16Swap(const uint8_t *s, size_t n, wchar_t *out) {
+  size_t i = 0;
+#ifdef FL_SSE2
+  for (; n - i >= 8; i += 8) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(s + i * 2));
+    const __m128i w = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    _mm_storeu_si128((__m128i *)(out + i), w);
   }
-  return buf;
+#endif
+  for (; i != n; i++)
+    out[i] = (wchar_t)(s[i * 2] << 8 | s[i * 2 + 1]);
 }
 
-wchar_t *FlTextDecode(
-    const uint8_t *buf,
-    size_t bytes,
-    size_t *cch,
-    allocator_t *alloc) {
-  wchar_t *res = NULL;
+int FlTextReaderInit(FL_TextReader *r, const uint8_t *buf, size_t bytes) {
+  r->pos = buf;
+  r->end = buf + bytes;
+  r->codepage = CP_ACP;
   if (bytes < 4)
-    return res;
+    return FL_UNRECOGNIZED;
 
   // detect BOM
   if (buf[0] == 0xef && buf[1] == 0xbb && buf[2] == 0xbf) {
-    res = FlTextTryDecode(CP_UTF8, buf + 3, bytes - 3, cch, alloc);
+    r->pos += 3;
+    r->codepage = CP_UTF8;
   } else if (buf[0] == 0xff && buf[1] == 0xfe) {
-    // UTF-16 LE
-    res = FlTextDecodeUtf16(0, buf + 2, bytes - 2, cch, alloc);
+    r->pos += 2;
+    r->codepage = kFlCodePageUtf16Le;
   } else if (buf[0] == 0xfe && buf[1] == 0xff) {
-    // UTF-16 BE
-    res = FlTextDecodeUtf16(1, buf + 2, bytes - 2, cch, alloc);
+    r->pos += 2;
+    r->codepage = kFlCodePageUtf16Be;
+  } else if (FlUtf8Check(buf, bytes) == bytes) {
+    r->codepage = CP_UTF8;
   }
+  return FL_OK;
+}
+
+// bytes of whole chars in the first n of p
+static size_t FlTextCut(UINT codepage, const uint8_t *p, size_t n) {
+  size_t i = n;
+  if (codepage == CP_UTF8) {
+    // back to the lead byte, then before it
+    while (i && (p[i - 1] & 0xc0) == 0x80 && n - i < 3)
+      i--;
+    if (i && (p[i - 1] & 0x80))
+      i--;
+  } else {
+    // trail bytes of DBCS code pages are at least 0x40
+    while (i && p[i - 1] >= 0x40)
+      i--;
+    if (i == 0) {
+      // walk the chars, p is at the beginning of one
+      size_t next = 0;
+      while (next < n) {
+        i = next;
+        next += IsDBCSLeadByteEx(codepage, p[next]) ? 2 : 1;
+      }
+      if (next == n)
+        i = n;
+    }
+  }
+  return i ? i : n;
+}
 
-  // detect UTF-8
-  if (!res && FlTestUtf8(buf, bytes)) {
-    res = FlTextTryDecode(CP_UTF8, buf, bytes, cch, alloc);
+size_t FlTextRead(FL_TextReader *r, wchar_t *buf, size_t cch) {
+  const size_t rem = r->end - r->pos;
+  if (r->codepage == kFlCodePageUtf16Le || r->codepage == kFlCodePageUtf16Be) {
+    const size_t n = rem / 2 < cch ? rem / 2 : cch;
+    if (r->codepage == kFlCodePageUtf16Be)
+      FlUtf16Swap(r->pos, n, buf);
+    else
+      zmemcpy(buf, r->pos, n * sizeof buf[0]);
+    r->pos += n * 2;
+    return n;
   }
-  // final resort
-  if (!res) {
-    res = FlTextTryDecode(CP_ACP, buf, bytes, cch, alloc);
+
+  // a char is one or two wchar_t from at least as many bytes
+  size_t n = rem < cch ? rem : cch;
+  if (n < rem)
+    n = FlTextCut(r->codepage, r->pos, n);
+  if (n == 0)
+    return 0;
+  if (r->codepage == CP_UTF8) {
+    r->pos += n;
+    return FlUtf8Decode(r->pos - n, n, buf);
   }
+  const int res = MultiByteToWideChar(
+      r->codepage, 0, (const char *)r->pos, (int)n, buf, (int)cch);
+  r->pos = res ? r->pos + n : r->end;
+  return res;
+}
+
+wchar_t *FlTextDecode(
+    const uint8_t *buf,
+    size_t bytes,
+    size_t *cch,
+    allocator_t *alloc) {
+  FL_TextReader reader;
+  if (FlTextReaderInit(&reader, buf, bytes) != FL_OK)
+    return NULL;
+
+  // no more chars than bytes
+  wchar_t *res = (wchar_t *)alloc->alloc(
+      NULL, (bytes + 1) * sizeof res[0], alloc->arg);
+  if (res == NULL)
+    return NULL;
+  *cch = FlTextRead(&reader, res, bytes);
+  res[*cch] = 0;
   return res;
 }
 
@@ -228,7 +394,55 @@ int FlVersionCmp(const wchar_t *a, const wchar_t *b) {
 }
 
 int FlStrCmpIW(const wchar_t *a, const wchar_t *b) {
-  return StrCmpIW(a, b);
+  // ordinal comparison after case folding, independent of user locale
+  wchar_t fa, fb;
+  do {
+    fa = FlCaseFold(*a++);
+    fb = FlCaseFold(*b++);
+  } while (fa && fa == fb);
+  return (int)fa - (int)fb;
+}
+
+static uint32_t FlRotl32(uint32_t x, int r) {
+  return (x << r) | (x >> (32 - r));
+}
+
+uint32_t FlFastHash(uint32_t seed, const void *data, size_t size) {
+  // MurmurHash3 x86_32, 32-bit operations only
+  const uint8_t *p = (const uint8_t *)data;
+  const size_t n = size / 4;
+  uint32_t h = seed, k;
+  for (size_t i = 0; i != n; i++, p += 4) {
+    k = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    k *= 0xcc9e2d51;
+    k = FlRotl32(k, 15);
+    k *= 0x1b873593;
+    h ^= k;
+    h = FlRotl32(h, 13);
+    h = h * 5 + 0xe6546b64;
+  }
+
+  k = 0;
+  switch (size & 3) {
+  case 3:
+    k ^= p[2] << 16;
+  case 2:
+    k ^= p[1] << 8;
+  case 1:
+    k ^= p[0];
+    k *= 0xcc9e2d51;
+    k = FlRotl32(k, 15);
+    k *= 0x1b873593;
+    h ^= k;
+  }
+
+  h ^= (uint32_t)size;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
 }
 
 
@@ -46,13 +46,41 @@ int FlMemMap(const wchar_t *path, memmap_t *mmap);
 
 int FlMemUnmap(memmap_t *mmap);
 
+// brings the pages of a view back to the working set, the ones not resident
+// are prefetched in bulk where possible. returns the bytes re-read.
+size_t FlMemWarm(const memmap_t *mmap, HANDLE evt_cancel);
+
 wchar_t *
 FlTextDecode(const uint8_t *buf, size_t bytes, size_t *cch, allocator_t *alloc);
 
+// decodes a text a window at a time, the encoding is detected as by
+// FlTextDecode
+#define kFlCodePageUtf16Le 1200
+#define kFlCodePageUtf16Be 1201
+
+typedef struct {
+  const uint8_t *pos;
+  const uint8_t *end;
+  UINT codepage;
+} FL_TextReader;
+
+// FL_UNRECOGNIZED if the text is too short
+int FlTextReaderInit(FL_TextReader *r, const uint8_t *buf, size_t bytes);
+
+// decodes at most cch chars, none at the end. no char is split between two
+// windows.
+size_t FlTextRead(FL_TextReader *r, wchar_t *buf, size_t cch);
+
 int FlVersionCmp(const wchar_t *a, const wchar_t *b);
 
 int FlStrCmpIW(const wchar_t *a, const wchar_t *b);
 
+// fast non-cryptographic hash of bytes
+uint32_t FlFastHash(uint32_t seed, const void *data, size_t size);
+
+// simple case folding, see case_fold.py
+wchar_t FlCaseFold(wchar_t ch);
+
 BOOL PerMonitorDpiHack();
 
 const TCHAR *ResLoadString(HMODULE hInstance, UINT idText);
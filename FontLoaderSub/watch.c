@@ -0,0 +1,248 @@
+#include "watch.h"
+
+#include "ass_string.h"
+#include "path.h"
+
+#define kWatchDelay 1000  // ms without changes before notifying
+
+int FlWatchInit(FL_Watch *w, allocator_t *alloc) {
+  zmemset(w, 0, sizeof *w);
+  w->alloc = alloc;
+  str_db_init(&w->dir_path, alloc, 0, 1);
+  str_db_init(&w->name, alloc, 0, 0);
+  str_db_init(&w->pending, alloc, 0, 1);
+  InitializeCriticalSection(&w->lock);
+
+  w->evt_stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+  return w->evt_stop ? FL_OK : FL_OS_ERROR;
+}
+
+int FlWatchFree(FL_Watch *w) {
+  FlWatchStop(w);
+  CloseHandle(w->evt_stop);
+  DeleteCriticalSection(&w->lock);
+  str_db_free(&w->dir_path);
+  str_db_free(&w->name);
+  str_db_free(&w->pending);
+  return FL_OK;
+}
+
+static void FlWatchCloseDir(FL_Watch *w, FL_WatchDir *d) {
+  if (d->dir != INVALID_HANDLE_VALUE)
+    CloseHandle(d->dir);
+  if (d->ov.hEvent)
+    CloseHandle(d->ov.hEvent);
+  w->alloc->alloc(d, 0, w->alloc->arg);
+}
+
+int FlWatchAdd(FL_Watch *w, const wchar_t *path) {
+  int r = FL_OK;
+  FL_WatchDir *d = NULL;
+  do {
+    if (w->num_dir == kWatchMaxDir)
+      break;  // ignored, like an unresolved path
+
+    str_db_seek(&w->name, 0);
+    r = FlResolvePath(path, &w->name);
+    if (r == FL_OS_ERROR) {
+      // ignore error
+      r = FL_OK;
+      break;
+    } else if (r != FL_OK) {
+      break;
+    }
+    const DWORD attr = GetFileAttributes(str_db_get(&w->name, 0));
+    if (attr == INVALID_FILE_ATTRIBUTES)
+      break;
+    const BOOL subtree = (attr & FILE_ATTRIBUTE_DIRECTORY) != 0;
+    if (!subtree)
+      FlPathParent(&w->name);
+    const wchar_t *dir_path = str_db_get(&w->name, 0);
+    if (str_db_str(&w->dir_path, 0, dir_path) != NULL)
+      break;  // watched by another subtitle
+
+    d = w->alloc->alloc(NULL, sizeof *d, w->alloc->arg);
+    if (d == NULL) {
+      r = FL_OUT_OF_MEMORY;
+      break;
+    }
+    d->subtree = subtree;
+    d->dir = CreateFile(
+        dir_path, FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+        OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+        NULL);
+    if (d->dir == INVALID_HANDLE_VALUE)
+      break;
+    d->ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (d->ov.hEvent == NULL) {
+      r = FL_OS_ERROR;
+      break;
+    }
+    d->path = str_db_tell(&w->dir_path);
+    if (!str_db_push_u16_le(&w->dir_path, dir_path, 0)) {
+      r = FL_OUT_OF_MEMORY;
+      break;
+    }
+    w->dir[w->num_dir++] = d;
+    d = NULL;
+  } while (0);
+
+  if (d)
+    FlWatchCloseDir(w, d);
+  return r;
+}
+
+static int FlWatchPush(FL_Watch *w, const wchar_t *path) {
+  int r = FL_OK;
+  EnterCriticalSection(&w->lock);
+  const size_t pos = str_db_tell(&w->pending);
+  const wchar_t *insert = str_db_push_u16_le(&w->pending, path, 0);
+  if (insert == NULL) {
+    r = FL_OUT_OF_MEMORY;
+  } else if (str_db_str(&w->pending, 0, insert) != insert) {
+    // already pending
+    str_db_seek(&w->pending, pos);
+  } else {
+    w->num_pending++;
+  }
+  LeaveCriticalSection(&w->lock);
+  return r;
+}
+
+static void FlWatchParse(FL_Watch *w, FL_WatchDir *d, DWORD bytes) {
+  const wchar_t *dir_path = str_db_get(&w->dir_path, d->path);
+  if (bytes == 0) {
+    // the buffer overflowed, walk the whole directory again
+    FlWatchPush(w, dir_path);
+    return;
+  }
+
+  const uint8_t *it = (const uint8_t *)d->buf;
+  while (1) {
+    const FILE_NOTIFY_INFORMATION *info = (const FILE_NOTIFY_INFORMATION *)it;
+    const size_t cch = info->FileNameLength / sizeof info->FileName[0];
+    const wchar_t *ext = info->FileName + cch - 4;
+    const int match_action = info->Action == FILE_ACTION_ADDED ||
+                             info->Action == FILE_ACTION_MODIFIED ||
+                             info->Action == FILE_ACTION_RENAMED_NEW_NAME;
+    const int match_ext = (cch > 4) && (ass_strncasecmp(ext, L".ass", 4) == 0 ||
+                                        ass_strncasecmp(ext, L".ssa", 4) == 0);
+    if (match_action && match_ext) {
+      const size_t len = ass_strlen(dir_path);
+      str_db_seek(&w->name, 0);
+      if (str_db_push_u16_le(&w->name, dir_path, len) &&
+          (len && dir_path[len - 1] == L'\\' ||
+           str_db_push_u16_le(&w->name, L"\\", 1)) &&
+          str_db_push_u16_le(&w->name, info->FileName, cch))
+        FlWatchPush(w, str_db_get(&w->name, 0));
+    }
+    if (info->NextEntryOffset == 0)
+      break;
+    it += info->NextEntryOffset;
+  }
+}
+
+static BOOL FlWatchRead(FL_WatchDir *d) {
+  const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME |
+                       FILE_NOTIFY_CHANGE_LAST_WRITE |
+                       FILE_NOTIFY_CHANGE_SIZE;
+  return ReadDirectoryChangesW(
+      d->dir, d->buf, sizeof d->buf, d->subtree, filter, NULL, &d->ov, NULL);
+}
+
+static DWORD WINAPI FlWatchWorker(LPVOID param) {
+  FL_Watch *w = (FL_Watch *)param;
+  HANDLE evt[kWatchMaxDir + 1];
+  FL_WatchDir *active[kWatchMaxDir + 1];
+  DWORD n = 1;
+
+  evt[0] = w->evt_stop;
+  for (uint32_t i = 0; i != w->num_dir; i++) {
+    if (FlWatchRead(w->dir[i])) {
+      active[n] = w->dir[i];
+      evt[n++] = w->dir[i]->ov.hEvent;
+    }
+  }
+
+  int changed = 0;
+  while (1) {
+    const DWORD r = WaitForMultipleObjects(
+        n, evt, FALSE, changed ? kWatchDelay : INFINITE);
+    if (r == WAIT_TIMEOUT) {
+      // settled, the subtitles are probably written completely
+      changed = 0;
+      PostMessage(w->hwnd, w->msg, 0, 0);
+      continue;
+    }
+    const DWORD id = r - WAIT_OBJECT_0;
+    if (id == 0 || id >= n)
+      break;
+
+    FL_WatchDir *d = active[id];
+    DWORD bytes;
+    if (GetOverlappedResult(d->dir, &d->ov, &bytes, FALSE)) {
+      FlWatchParse(w, d, bytes);
+      changed = 1;
+    }
+    if (!FlWatchRead(d)) {
+      // the directory is gone, keep watching the rest
+      n--;
+      active[id] = active[n];
+      evt[id] = evt[n];
+    }
+  }
+
+  // pending reads are cancelled by the thread issuing them
+  for (DWORD i = 1; i < n; i++) {
+    DWORD bytes;
+    CancelIo(active[i]->dir);
+    GetOverlappedResult(active[i]->dir, &active[i]->ov, &bytes, TRUE);
+  }
+  return 0;
+}
+
+int FlWatchStart(FL_Watch *w, HWND hwnd, UINT msg) {
+  if (w->num_dir == 0)
+    return FL_OS_ERROR;
+
+  w->hwnd = hwnd;
+  w->msg = msg;
+  ResetEvent(w->evt_stop);
+  DWORD thread_id;
+  w->thread = CreateThread(NULL, 0, FlWatchWorker, w, 0, &thread_id);
+  return w->thread ? FL_OK : FL_OS_ERROR;
+}
+
+int FlWatchStop(FL_Watch *w) {
+  if (w->thread) {
+    SetEvent(w->evt_stop);
+    WaitForSingleObject(w->thread, INFINITE);
+    CloseHandle(w->thread);
+    w->thread = NULL;
+  }
+  for (uint32_t i = 0; i != w->num_dir; i++)
+    FlWatchCloseDir(w, w->dir[i]);
+  w->num_dir = 0;
+  str_db_seek(&w->dir_path, 0);
+  return FL_OK;
+}
+
+uint32_t FlWatchTake(FL_Watch *w, str_db_t *out) {
+  EnterCriticalSection(&w->lock);
+  const str_db_t taken = w->pending;
+  w->pending = *out;
+  *out = taken;
+  str_db_seek(&w->pending, 0);
+  const uint32_t n = w->num_pending;
+  w->num_pending = 0;
+  LeaveCriticalSection(&w->lock);
+  return n;
+}
+
+uint32_t FlWatchPending(FL_Watch *w) {
+  EnterCriticalSection(&w->lock);
+  const uint32_t n = w->num_pending;
+  LeaveCriticalSection(&w->lock);
+  return n;
+}
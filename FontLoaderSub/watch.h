@@ -0,0 +1,48 @@
+#pragma once
+
+#include "util.h"
+#include "cstl.h"
+
+#define kWatchMaxDir (MAXIMUM_WAIT_OBJECTS - 1)
+
+typedef struct {
+  HANDLE dir;
+  OVERLAPPED ov;
+  size_t path;      // in FL_Watch.dir_path
+  BOOL subtree;     // 0 for the parent of a subtitle file
+  DWORD buf[4096];  // FILE_NOTIFY_INFORMATION, DWORD aligned
+} FL_WatchDir;
+
+typedef struct {
+  allocator_t *alloc;
+  HWND hwnd;
+  UINT msg;
+  HANDLE thread;
+  HANDLE evt_stop;
+  str_db_t dir_path;
+  FL_WatchDir *dir[kWatchMaxDir];
+  uint32_t num_dir;
+  str_db_t name;  // by the worker
+
+  CRITICAL_SECTION lock;
+  str_db_t pending;  // subtitles changed, guarded by lock
+  uint32_t num_pending;
+} FL_Watch;
+
+int FlWatchInit(FL_Watch *w, allocator_t *alloc);
+
+int FlWatchFree(FL_Watch *w);
+
+// a subtitle directory, or the parent of a subtitle file. before FlWatchStart
+int FlWatchAdd(FL_Watch *w, const wchar_t *path);
+
+// posts msg to hwnd, once changes settle
+int FlWatchStart(FL_Watch *w, HWND hwnd, UINT msg);
+
+// the directories are dropped, pending changes are kept
+int FlWatchStop(FL_Watch *w);
+
+// swaps the pending paths into out, which is a str_db_t of pad_len 1
+uint32_t FlWatchTake(FL_Watch *w, str_db_t *out);
+
+uint32_t FlWatchPending(FL_Watch *w);